@@ -1,9 +1,10 @@
 #pragma once
 
 #include <stdint.h>
-#include "tap.h"
+#include <stdatomic.h>
+#include "netdev.h"
 #include "eth.h"
-#include "list.h"
+#include "neigh.h"
 
 #define ARP_HWTYPE_ETHERNET 1
 #define ARP_HWSIZE_ETHERNET 6
@@ -11,8 +12,17 @@
 #define ARP_OP_REQUEST 1
 #define ARP_OP_REPLY 2
 
-#define ARP_ENTRY_STATE_WAITING 1  // waiting for reply
-#define ARP_ENTRY_STATE_ACTIVE 2
+// Neighbor table, sized for thousands of neighbors on one L2 segment
+#define ARP_TABLE_BITS 13
+#define ARP_TABLE_SIZE (1u << ARP_TABLE_BITS)
+#define ARP_TABLE_MAX_LOAD (ARP_TABLE_SIZE / 4 * 3)
+
+// Timers, in ms
+#define ARP_TIMER_INTERVAL 100  // aging and retries run this often
+#define ARP_REACHABLE_TIME 30000  // an entry expires this long after the neighbor was last heard from
+#define ARP_REFRESH_TIME 5000  // entries in use are refreshed this long before they expire
+#define ARP_RETRY_TIME 500  // wait for the first reply, doubled for each retransmission
+#define ARP_MAX_RETRIES 3  // unanswered retransmissions before a neighbor is given up on
 
 
 struct arp_packet
@@ -28,27 +38,13 @@ struct arp_packet
 	uint32_t dest_address;
 } __attribute__((packed));
 
-struct arp_buffer
-{
-	struct arp_buffer *next;
-	struct sk_buff *buffer;
-};
-
-struct arp_entry
-{
-	struct list_head list;
-	struct arp_buffer* buffer_head;
-	uint8_t state;
-	uint16_t protocol_type;
-	uint8_t mac[6];
-	uint32_t address;
-};
-
+void *arp_timer(void *args);
+void arp_print_stats();
 void arp_free_cache();
-struct arp_entry* arp_get_entry(uint16_t protocol_type, uint32_t address);
-struct arp_entry *arp_add_entry_active(uint8_t *mac_address, uint32_t ipv4_address);
-struct arp_entry *arp_send_request(struct net_dev* dev, uint32_t ipv4_address);
+int arp_lookup(uint16_t protocol_type, uint32_t address, uint8_t *mac, struct neigh_entry **entry, uint32_t *seq);
+int arp_resolve(struct net_dev *dev, uint32_t address, struct sk_buff *buffer);
+int arp_add_entry_active(struct net_dev *dev, uint8_t *mac_address, uint32_t ipv4_address);
+int arp_send_request(struct net_dev* dev, uint32_t ipv4_address);
 int arp_send_reply(struct net_dev* dev, struct arp_packet *arp_packet);
-int arp_process_packet(struct net_dev *dev, struct eth_frame *eth_frame);
+int arp_process_packet(struct net_dev *dev, struct sk_buff *buffer);
 
-void arp_add_to_buffer(struct arp_entry *arp_entry, struct sk_buff *sk_buff);
\ No newline at end of file
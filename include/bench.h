@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdint.h>
+
+// Command line settings some benchmarks take
+struct bench_options {
+	const char *replay_path;  // capture fed to the stack by the replay benchmark
+	const char *record_path;  // frames sent during the replay are written here, may be NULL
+	int timed;  // replay at the original timing
+	uint32_t loops;  // times the capture is replayed
+	uint32_t rx_batch;
+	uint16_t mtu;  // 0 for the default
+};
+
+// Runs the named benchmark, returns 0 on success
+int bench_run(const char *name, const struct bench_options *options);
+void bench_list();
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdint.h>
+
+// One way of computing checksum_partial(). Every implementation returns exactly what the 16 bit reference loop
+// returns, for any alignment and length, as long as the reference's 32 bit sum doesn't overflow. With the small
+// sums the stack passes in that takes more than 64 KB.
+struct checksum_impl {
+	const char *name;
+	uint32_t (*partial)(const void *data, uint32_t len, uint32_t sum);
+	uint32_t (*copy)(void *dst, const void *src, uint32_t len, uint32_t sum);  // memcpy() returning partial()'s sum
+	int (*supported)();
+};
+
+extern const struct checksum_impl checksum_impls[];
+extern const uint32_t checksum_impl_count;
+
+const struct checksum_impl *checksum_impl_active();
@@ -2,10 +2,15 @@
 #include <unistd.h>
 #include <stdio.h>
 #include "skbuff.h"
-#include "tap.h"
+#include "netdev.h"
 
-#define ETHERNET_MAX_PAYLOAD_SIZE 1520
 #define ETHERNET_HEADER_SIZE 14
+#define ETHERNET_VLAN_HEADER_SIZE 4
+
+#define ETH_RX_RING_SIZE 64  // preallocated RX buffers per ring
+#define ETH_RX_BATCH_MAX ETH_RX_RING_SIZE  // frames read per poll wakeup at most
+#define ETH_RX_BATCH_DEFAULT 32
+#define ETH_RX_LARGE_SIZE 65536  // RX buffer size when the device can deliver merged frames
 
 
 struct eth_frame
@@ -17,9 +22,33 @@ struct eth_frame
 } __attribute__((packed));
 
 
+// Preallocated RX buffers. Buffers are taken from the head and handed back to the tail once the frame has
+// been processed. If an upper layer kept a reference to one, a fresh buffer takes its place.
+struct eth_rx_ring {
+	struct sk_buff *slots[ETH_RX_RING_SIZE];
+	uint32_t head;  // next buffer to hand out
+	uint32_t tail;  // next slot for a recycled buffer
+
+	uint32_t buffer_size;
+	uint32_t reserve;  // puts the IPv4 header of received frames on a 4 byte boundary
+};
+
+// Largest frame the device receives without offloads, a VLAN tag included
+static inline uint32_t eth_max_frame_size(const struct net_dev *dev) {
+	return dev->mtu + ETHERNET_HEADER_SIZE + ETHERNET_VLAN_HEADER_SIZE;
+}
+
 static inline struct eth_frame *eth_frame_from_skb(struct sk_buff *buff) {
-	return (struct eth_frame *)buff->data;
+	return (struct eth_frame *)buff->mac_header;
 }
 
-uint16_t eth_read(struct net_dev *dev, struct eth_frame *frame);
 int eth_write(uint8_t dest_mac[], uint16_t eth_type, struct sk_buff *buffer);
+
+void eth_rx_ring_init(struct eth_rx_ring *ring, struct net_dev *dev);
+struct sk_buff *eth_rx_ring_get(struct eth_rx_ring *ring, struct net_dev *dev, uint16_t queue);
+void eth_rx_ring_recycle(struct eth_rx_ring *ring, struct sk_buff *buffer);
+void eth_rx_ring_free(struct eth_rx_ring *ring);
+
+uint32_t eth_read_batch(struct net_dev *dev, uint16_t queue, struct eth_rx_ring *ring, struct sk_buff **buffers,
+						uint32_t max);
+void eth_flush(struct net_dev *dev, uint16_t queue);
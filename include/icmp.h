@@ -12,10 +12,19 @@ struct icmp_v4_packet {
 	uint8_t data[];
 } __attribute__((packed));
 
+// Body of echo requests and replies
+struct icmp_v4_echo {
+	uint16_t id;
+	uint16_t seq;
+	uint8_t data[];
+} __attribute__((packed));
+
 
-int icmp_process_packet(struct net_dev *dev, struct eth_frame *frame);
+int icmp_process_packet(struct net_dev *dev, struct sk_buff *buffer);
+int icmp_send_echo(struct net_dev *dev, uint16_t queue, uint32_t dest_ip, uint16_t id, uint16_t seq, uint32_t data_len);
+void icmp_set_echo_reply_handler(void (*handler)(struct net_dev *dev, uint16_t id, uint16_t seq));
 
 
 static inline struct icmp_v4_packet *icmp_v4_packet_from_skb(struct sk_buff *buff) {
-	return (struct icmp_v4_packet *)(buff->data + ETHERNET_HEADER_SIZE + IP_HEADER_SIZE);
+	return (struct icmp_v4_packet *)buff->transport_header;
 }
\ No newline at end of file
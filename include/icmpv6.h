@@ -0,0 +1,49 @@
+#pragma once
+
+#include "skbuff.h"
+#include "eth.h"
+#include "ipv6.h"
+
+
+#define ICMPV6_ND_HOP_LIMIT 255  // neighbor discovery messages from off the link arrive with less
+
+
+struct icmpv6_packet {
+	uint8_t type;
+	uint8_t code;
+	uint16_t checksum;
+	uint8_t data[];
+} __attribute__((packed));
+
+// Body of echo requests and replies
+struct icmpv6_echo {
+	uint16_t id;
+	uint16_t seq;
+	uint8_t data[];
+} __attribute__((packed));
+
+// Body of neighbor solicitations and advertisements, the flags are reserved in solicitations
+struct icmpv6_neighbor {
+	uint32_t flags;
+	uint8_t target[16];
+	uint8_t options[];
+} __attribute__((packed));
+
+// Source or target link-layer address option
+struct icmpv6_option_lladdr {
+	uint8_t type;
+	uint8_t len;  // in units of 8 bytes
+	uint8_t mac[6];
+} __attribute__((packed));
+
+
+int icmpv6_process_packet(struct net_dev *dev, struct sk_buff *buffer);
+int icmpv6_send_echo(struct net_dev *dev, uint16_t queue, const uint8_t *dest_ip, uint16_t id, uint16_t seq,
+					 uint32_t data_len);
+int icmpv6_send_neighbor_solicit(struct net_dev *dev, uint16_t queue, const uint8_t *target);
+void icmpv6_set_echo_reply_handler(void (*handler)(struct net_dev *dev, uint16_t id, uint16_t seq));
+
+
+static inline struct icmpv6_packet *icmpv6_packet_from_skb(struct sk_buff *buff) {
+	return (struct icmpv6_packet *)buff->transport_header;
+}
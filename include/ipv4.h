@@ -5,12 +5,13 @@
 
 #include "skbuff.h"
 #include "sock.h"
-#include "tap.h"
+#include "netdev.h"
 #include "eth.h"
 
 
 #define IP_HEADER_SIZE 20
 #define IP_DEFAULT_TTL 64
+#define IPV4_TIMER_INTERVAL 1000  // ms between reassembly and path MTU expiry runs
 
 #define IP_FLAG_DF 0x4000  // don't fragment
 #define IP_FLAG_MF 0x2000  // more fragments
@@ -31,8 +32,9 @@ struct ipv4_packet {
 } __attribute__((packed));
 
 static inline struct ipv4_packet *ipv4_packet_from_skb(struct sk_buff *buff) {
-	return (struct ipv4_packet *)(buff->data + ETHERNET_HEADER_SIZE);
+	return (struct ipv4_packet *)buff->network_header;
 }
 
-int ipv4_process_packet(struct net_dev *dev, struct eth_frame *frame);
+int ipv4_process_packet(struct net_dev *dev, struct sk_buff *buffer);
 int ipv4_send_packet(struct sock *sock, struct sk_buff *buffer);
+void *ipv4_timer(void *args);
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "list.h"
+#include "skbuff.h"
+#include "netdev.h"
+
+
+#define IPV4_FRAG_OFFSET_MASK 0x1fff  // fragment offset in 8 byte units, below the flags
+
+#define IPV4_FRAG_INLINE 4  // fragments a queue holds without allocating, two is by far the most common
+#define IPV4_FRAG_MAX 64  // fragments of one datagram, anything beyond is an attack or a broken sender
+#define IPV4_FRAG_QUEUES 256  // datagrams reassembled at once, the oldest one makes room for a new one
+#define IPV4_FRAG_HASH_SIZE 64
+#define IPV4_FRAG_MEM_MAX (4u << 20)  // bytes of buffers held by all queues, the oldest queues are dropped above
+#define IPV4_FRAG_TIMEOUT 30000  // ms a datagram has to be complete in
+
+
+// A fragment that arrived, kept as a reference to its RX buffer
+struct ipv4_frag {
+	struct sk_buff *buffer;
+	uint8_t *data;  // payload, inside the buffer
+	uint16_t offset;
+	uint16_t len;
+};
+
+// Datagram being reassembled. The fragments are kept sorted by offset and never overlap, the holes are whatever
+// lies between them.
+struct ipv4_frag_queue {
+	struct list_head list;  // in arrival order of the first fragment, for expiry and eviction
+	struct ipv4_frag_queue *hash_next;
+
+	uint32_t source_ip;
+	uint32_t dest_ip;
+	uint16_t id;
+	uint8_t protocol;
+
+	uint32_t expires;
+	uint32_t total_len;  // payload length, known once the last fragment arrived
+	uint32_t received;  // payload bytes held
+	uint32_t mem;  // size of the buffers held
+
+	uint8_t count;
+	uint8_t capacity;
+	struct ipv4_frag *frags;  // points to inline_frags until more are needed
+	struct ipv4_frag inline_frags[IPV4_FRAG_INLINE];
+};
+
+struct ipv4_frag_stats {
+	uint64_t fragments;  // fragments received
+	uint64_t reassembled;  // datagrams completed
+	uint64_t timeouts;  // datagrams that didn't complete in time
+	uint64_t evicted;  // datagrams dropped for the queue or memory limit
+	uint64_t invalid;  // datagrams dropped for overlapping or inconsistent fragments
+	uint64_t duplicates;  // fragments received twice
+};
+
+
+struct sk_buff *ipv4_frag_add(struct net_dev *dev, struct sk_buff *buffer);
+void ipv4_frag_expire();
+void ipv4_frag_print_stats();
+void ipv4_frag_free();
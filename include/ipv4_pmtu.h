@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+
+#define IPV4_PMTU_SIZE 256  // destinations remembered, a newer one takes the slot of an older one
+#define IPV4_PMTU_MIN 552  // lowest MTU a report is believed for, a lower one locks the path at it (RFC 1191 says 68)
+#define IPV4_PMTU_EXPIRES 600000  // ms until a lowered MTU is tried again, RFC 1191's 10 minutes
+
+
+// Path MTU learned from a "fragmentation needed" error
+struct ipv4_pmtu_entry {
+	atomic_uint seq;  // bumped on every change, dst caches filled in from the slot are checked against it
+	uint32_t dest_ip;  // 0 if the slot is free
+	uint16_t mtu;
+	uint8_t locked;  // a report went below IPV4_PMTU_MIN, TCP stops setting DF so routers on the path fragment
+	uint32_t expires;
+};
+
+
+uint16_t ipv4_pmtu_get(uint32_t dest_ip, uint16_t dev_mtu, uint32_t *seq, uint8_t *locked);
+int ipv4_pmtu_unchanged(uint32_t dest_ip, uint32_t seq);
+void ipv4_pmtu_update(uint32_t dest_ip, uint16_t mtu);
+void ipv4_pmtu_expire();
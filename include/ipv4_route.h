@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "netdev.h"
+
+
+#define IPV4_ROUTE_MAX 256  // routes in the table
+#define IPV4_ROUTE_STRIDE 8  // address bits per trie level, a lookup visits at most four nodes
+#define IPV4_ROUTE_FANOUT (1 << IPV4_ROUTE_STRIDE)
+#define IPV4_ROUTE_LEVELS (32 / IPV4_ROUTE_STRIDE)
+
+
+struct ipv4_route {
+	uint32_t prefix;  // network order, host bits cleared
+	uint8_t prefix_len;  // 0 for the default route
+	uint32_t gateway;  // next hop, 0 if destinations are on-link
+	struct net_dev *dev;
+	uint32_t source_ip;  // address sockets on the route send from, 0 for the device's
+};
+
+// Multibit trie node. A prefix is expanded over every slot it covers at the level its last bit falls into, so the
+// deepest route found on the way down is the longest match.
+struct ipv4_route_node {
+	uint16_t routes[IPV4_ROUTE_FANOUT];  // 1 + index of the longest prefix covering the slot at this level, 0 if none
+	struct ipv4_route_node *children[IPV4_ROUTE_FANOUT];
+};
+
+
+int ipv4_route_add(uint32_t prefix, uint8_t prefix_len, uint32_t gateway, struct net_dev *dev, uint32_t source_ip);
+int ipv4_route_remove(uint32_t prefix, uint8_t prefix_len);
+int ipv4_route_lookup(uint32_t dest_ip, struct ipv4_route *route);
+uint32_t ipv4_route_generation();
+void ipv4_route_print();
+void ipv4_route_free();
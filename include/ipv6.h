@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <netinet/in.h>
+
+#include "skbuff.h"
+#include "sock.h"
+#include "netdev.h"
+#include "eth.h"
+
+
+#define IPV6_HEADER_SIZE 40
+#define IPV6_DEFAULT_HOP_LIMIT 64
+#define IPV6_MIN_MTU 1280  // every link carries packets this large
+
+
+struct ipv6_packet {
+	uint32_t version_class_flow;  // version, traffic class and flow label, network order
+	uint16_t payload_len;  // host order once ipv6_process_packet() accepted the packet
+	uint8_t next_header;
+	uint8_t hop_limit;
+	uint8_t source_ip[16];
+	uint8_t dest_ip[16];
+	uint8_t data[];
+} __attribute__((packed));
+
+static inline struct ipv6_packet *ipv6_packet_from_skb(struct sk_buff *buff) {
+	return (struct ipv6_packet *)buff->network_header;
+}
+
+static inline int ipv6_addr_is_multicast(const uint8_t *address) {
+	return address[0] == 0xff;
+}
+
+static inline int ipv6_addr_is_link_local(const uint8_t *address) {
+	return address[0] == 0xfe && (address[1] & 0xc0) == 0x80;
+}
+
+// Multicast addresses map to 33:33 followed by their last 32 bits
+static inline void ipv6_multicast_mac(const uint8_t *address, uint8_t *mac) {
+	mac[0] = 0x33;
+	mac[1] = 0x33;
+	memcpy(&mac[2], &address[12], 4);
+}
+
+int ipv6_process_packet(struct net_dev *dev, struct sk_buff *buffer);
+void ipv6_push_header(struct sk_buff *buffer, const uint8_t *source_ip, const uint8_t *dest_ip, uint8_t next_header,
+					  uint8_t hop_limit);
+int ipv6_send_packet(struct sock *sock, struct sk_buff *buffer);
+int ipv6_addr_is_local(struct net_dev *dev, const uint8_t *address);
+void ipv6_addr_link_local(struct net_dev *dev, uint8_t *address);
+void ipv6_addr_source(struct net_dev *dev, const uint8_t *dest_ip, uint8_t *source_ip);
+void ipv6_addr_solicited_node(const uint8_t *address, uint8_t *solicited);
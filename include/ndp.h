@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include "netdev.h"
+#include "eth.h"
+#include "neigh.h"
+
+// What the message passed to ndp_update() allows, RFC 4861 sections 7.2.3 and 7.2.5
+#define NDP_UPDATE_CREATE 1  // a solicitation, an unknown neighbor is added as STALE
+#define NDP_UPDATE_SOLICITED 2  // an advertisement answering a solicitation, the neighbor is REACHABLE
+#define NDP_UPDATE_OVERRIDE 4  // the MAC replaces a different one in the cache
+
+// Neighbor cache
+#define NDP_TABLE_BITS 10
+#define NDP_TABLE_SIZE (1u << NDP_TABLE_BITS)
+
+// Timers, in ms, RFC 4861 defaults
+#define NDP_TIMER_INTERVAL 100  // aging and retransmissions run this often
+#define NDP_REACHABLE_TIME 30000  // an entry expires this long after the neighbor was last heard from
+#define NDP_REFRESH_TIME 5000  // entries in use are solicited again this long before they expire
+#define NDP_RETRANS_TIME 1000  // between solicitations
+#define NDP_MAX_RETRIES 3  // unanswered solicitations before a neighbor is given up on
+
+
+void *ndp_timer(void *args);
+void ndp_print_stats();
+void ndp_free_cache();
+int ndp_lookup(const uint8_t *address, uint8_t *mac, struct neigh_entry **entry, uint32_t *seq);
+int ndp_resolve(struct net_dev *dev, const uint8_t *address, struct sk_buff *buffer);
+int ndp_update(struct net_dev *dev, const uint8_t *address, const uint8_t *mac, uint8_t flags);
+
@@ -0,0 +1,163 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <string.h>
+#include "netdev.h"
+
+#define NEIGH_STATE_FREE 0  // slot never used, ends a probe sequence
+#define NEIGH_STATE_INCOMPLETE 1  // request sent, waiting for the answer
+#define NEIGH_STATE_REACHABLE 2
+#define NEIGH_STATE_DELETED 3  // slot was used, probing continues past it and inserts may take it over
+#define NEIGH_STATE_STALE 4  // MAC learned without confirmation, sent to but asked for again once it is used
+
+#define NEIGH_KEY_MAX 16  // an IPv6 address
+#define NEIGH_PENDING_MAX 4  // packets kept per unresolved neighbor, the oldest one is dropped for a new one
+
+
+// Slot of a neighbor table. Entries live in the table itself, so a reader never holds a pointer that could be
+// freed. Writers hold the table's mutex and make seq odd while they change the slot, readers retry when they saw it
+// odd or changed.
+struct neigh_entry
+{
+	atomic_uint seq;
+	uint8_t state;
+	atomic_uchar used;  // set by lookups and dst cache hits, cleared when the neighbor answers; decides on a refresh
+	uint8_t mac[6];
+	uint8_t key[NEIGH_KEY_MAX];  // protocol address, the table's key_size bytes of it
+
+	// Only touched under the table's mutex
+	uint32_t expires;  // REACHABLE and STALE: when the entry is dropped unless the neighbor is heard from
+	uint32_t next_request;  // when the next request goes out, for INCOMPLETE, STALE and refreshed entries
+	uint8_t retries;
+	uint8_t stale;  // about to expire, used was cleared so only sends from now on count
+	struct net_dev *dev;  // requests are sent through it
+
+	// Packets waiting for the answer
+	struct sk_buff *pending[NEIGH_PENDING_MAX];
+	uint8_t pending_head;
+	uint8_t pending_count;
+} __attribute__((aligned(64)));
+
+struct neigh_stats {
+	uint64_t requests;  // first requests for an address
+	uint64_t retries;  // retransmitted requests
+	uint64_t refreshes;  // requests for entries in use that are about to expire
+	uint64_t failed;  // neighbors that never answered
+	uint64_t expired;  // entries aged out
+	uint64_t pending_drops;  // packets dropped from full pending rings or for neighbors that never answered
+};
+
+// Open addressed neighbor table, linear probing, inserts are refused past 3/4 load so probe sequences stay short.
+// ARP and NDP each fill one in with their key, hash and request, and keep the state changes their messages cause
+// to themselves.
+struct neigh_table {
+	const char *name;
+	uint16_t eth_type;  // of the packets waiting for a MAC
+	uint8_t key_size;
+	uint8_t bits;  // the table has 1 << bits slots
+	struct neigh_entry *entries;
+	uint32_t (*hash)(const uint8_t *key);  // the top bits pick the slot
+	void (*request)(struct net_dev *dev, uint16_t queue, const uint8_t *key);  // asks the link for the MAC
+
+	// Timers, in ms
+	uint32_t reachable_time;  // an entry expires this long after the neighbor was last heard from
+	uint32_t refresh_time;  // entries in use are asked for again this long before they expire
+	uint32_t retrans_time;  // wait for the first answer
+	uint8_t backoff;  // the wait doubles with every retransmission
+	uint8_t max_retries;  // unanswered retransmissions before a neighbor is given up on
+
+	pthread_mutex_t mutex;  // serializes writers and the stats, readers go without
+	uint32_t used;  // slots that aren't free, deleted ones included
+	struct neigh_stats stats;
+};
+
+static inline uint32_t neigh_table_size(const struct neigh_table *table) {
+	return 1u << table->bits;
+}
+
+static inline uint32_t neigh_table_max_load(const struct neigh_table *table) {
+	return neigh_table_size(table) / 4 * 3;
+}
+
+static inline void neigh_write_begin(struct neigh_entry *entry) {
+	atomic_store_explicit(&entry->seq, atomic_load_explicit(&entry->seq, memory_order_relaxed) + 1,
+						  memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+}
+
+static inline void neigh_write_end(struct neigh_entry *entry) {
+	atomic_store_explicit(&entry->seq, atomic_load_explicit(&entry->seq, memory_order_relaxed) + 1,
+						  memory_order_release);
+}
+
+uint32_t neigh_time();
+int neigh_resolve(struct neigh_table *table, struct net_dev *dev, const uint8_t *key, struct sk_buff *buffer);
+void neigh_timer_run(struct neigh_table *table);
+void neigh_print_stats(struct neigh_table *table);
+void neigh_free(struct neigh_table *table);
+
+// Writers, the caller holds the table's mutex
+struct neigh_entry *neigh_find_locked(struct neigh_table *table, const uint8_t *key, struct neigh_entry **free_slot);
+struct neigh_entry *neigh_insert_locked(struct neigh_table *table, struct neigh_entry *slot, struct net_dev *dev,
+										const uint8_t *key, uint8_t state, const uint8_t *mac);
+void neigh_set_locked(struct neigh_entry *entry, uint8_t state, const uint8_t *mac);
+void neigh_confirm_locked(struct neigh_table *table, struct neigh_entry *entry);
+uint8_t neigh_pending_take_locked(struct neigh_entry *entry, struct sk_buff **pending);
+
+
+// Whether a dst cache filled in from the entry at seq still holds, every change to the slot bumps it. A hit counts
+// as a lookup for the refresh.
+static inline int neigh_entry_unchanged(struct neigh_entry *entry, uint32_t seq) {
+	if(atomic_load_explicit(&entry->seq, memory_order_acquire) != seq)
+		return 0;
+
+	if(!atomic_load_explicit(&entry->used, memory_order_relaxed))
+		atomic_store_explicit(&entry->used, 1, memory_order_relaxed);
+	return 1;
+}
+
+// State of the key, NEIGH_STATE_FREE if it isn't known. The MAC is copied out for a reachable or stale entry, along
+// with its slot and seq for neigh_entry_unchanged() if entry isn't NULL. Takes no lock, so it is cheap enough for
+// every packet sent. Inlined into each protocol's lookup, which passes its hash of the key and its key size as a
+// constant, so the compare isn't a memcmp() call.
+static inline int neigh_lookup(struct neigh_table *table, const uint8_t *key, uint8_t key_size, uint32_t hash,
+							   uint8_t *mac, struct neigh_entry **entry_out, uint32_t *seq_out) {
+	uint32_t mask = neigh_table_size(table) - 1;
+	uint32_t index = hash >> (32 - table->bits);
+
+	for(uint32_t probes = 0; probes <= mask; probes++) {
+		struct neigh_entry *entry = &table->entries[index];
+		uint32_t seq;
+		uint8_t state;
+		int match;
+
+		do {
+			seq = atomic_load_explicit(&entry->seq, memory_order_acquire);
+			state = entry->state;
+			match = memcmp(entry->key, key, key_size) == 0;
+			if(match)
+				memcpy(mac, entry->mac, sizeof(entry->mac));
+			atomic_thread_fence(memory_order_acquire);
+		} while((seq & 1) || seq != atomic_load_explicit(&entry->seq, memory_order_relaxed));
+
+		if(state == NEIGH_STATE_FREE)
+			return NEIGH_STATE_FREE;
+
+		if(match && state != NEIGH_STATE_DELETED) {
+			// Written once per refresh period at most, the cache line stays shared otherwise
+			if(!atomic_load_explicit(&entry->used, memory_order_relaxed))
+				atomic_store_explicit(&entry->used, 1, memory_order_relaxed);
+			if(entry_out != NULL && (state == NEIGH_STATE_REACHABLE || state == NEIGH_STATE_STALE)) {
+				*entry_out = entry;
+				*seq_out = seq;
+			}
+			return state;
+		}
+
+		index = (index + 1) & mask;
+	}
+
+	return NEIGH_STATE_FREE;
+}
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <linux/if.h>
+
+#include "list.h"
+
+#define NET_DEV_MAX_QUEUES 16
+#define NET_DEV_DEFAULT_MTU 1500
+#define NET_DEV_MIN_MTU 68  // smallest IPv4 link MTU
+#define NET_DEV_MAX_MTU 65535  // jumbo frames of any size the IPv4 total length allows
+#define NET_BATCH_HISTOGRAM_SIZE 7  // batch size buckets: 1, 2-3, 4-7, ..., 64+
+#define NET_TX_QUEUE_SIZE 64  // frames collected before a queue is flushed early
+#define NET_DEV_FRAG_QUEUE 0  // IPv4 fragments meet on this queue for reassembly
+
+// net_dev->features
+#define NETIF_F_VNET_HDR (1 << 0)  // every frame is preceded by a struct virtio_net_hdr
+#define NETIF_F_HW_CSUM (1 << 1)  // the device finishes TCP checksums for us, and may skip them on RX
+#define NETIF_F_TSO (1 << 2)  // TCP segments up to 64 KB are cut into MSS sized ones by the device
+#define NETIF_F_GRO (1 << 3)  // the device may deliver merged frames up to 64 KB
+
+struct sk_buff;
+struct eth_rx_ring;
+struct net_dev;
+struct ipv4_packet;
+
+
+// What a driver implements. A driver sees frames starting at the Ethernet header (or the virtio-net header with
+// NETIF_F_VNET_HDR), everything above is the stack's business.
+struct net_dev_ops {
+	const char *name;
+
+	// Opens every queue of the device, fills in the hardware address and the features it ended up with.
+	// features holds what the user asked for, arg is driver specific configuration and may be NULL. dev->mtu
+	// holds the MTU asked for, 0 to keep the interface's. Drivers replace it with the MTU in effect, or leave
+	// it at 0 for the default.
+	int (*open)(struct net_dev *dev, uint32_t features, const void *arg);
+	void (*close)(struct net_dev *dev);
+
+	// Receives up to max frames, buffers get dev and queue_mapping set. Buffers may come from the ring or be the
+	// driver's own, either way they are handed to eth_rx_ring_recycle() once processed.
+	uint32_t (*rx_batch)(struct net_dev *dev, uint16_t queue, struct eth_rx_ring *ring, struct sk_buff **buffers,
+						 uint32_t max);
+
+	// Optional, decides when rx_batch() is called instead of the worker polling queue->fd. Returns 1 if it has
+	// work, 0 if not, -1 if the queue went away.
+	int (*rx_wait)(struct net_dev *dev, uint16_t queue);
+
+	// Sends count frames and consumes the references to them, returns the number of frames sent
+	uint32_t (*tx_batch)(struct net_dev *dev, uint16_t queue, struct sk_buff **buffers, uint32_t count);
+
+	// Optional, pushes out frames tx_batch() left queued
+	void (*flush)(struct net_dev *dev, uint16_t queue);
+
+	// Optional, prints driver statistics along with the queue ones
+	void (*print_stats)(struct net_dev *dev);
+};
+
+struct net_batch_stats {
+	uint64_t batches;
+	uint64_t frames;
+	uint32_t max_batch;
+	uint64_t histogram[NET_BATCH_HISTOGRAM_SIZE];
+};
+
+// One device queue, served by its own worker thread. Flows are steered to queues by their 4-tuple hash, the lock
+// serializes the stack for every flow on the queue.
+struct net_queue {
+	struct net_dev *dev;
+	uint16_t index;
+	int fd;  // polled by the worker, -1 if the driver has nothing to poll and the worker spins
+	void *priv;  // driver state of the queue
+
+	pthread_mutex_t lock;
+	struct list_head sockets;  // TCP sockets steered to this queue
+
+	// Frames sent since the last flush, handed to the driver together by eth_flush()
+	pthread_mutex_t tx_lock;
+	struct sk_buff *tx_queue[NET_TX_QUEUE_SIZE];
+	uint32_t tx_count;
+
+	pthread_t thread;
+	struct net_batch_stats rx_stats;
+	struct net_batch_stats tx_stats;  // updated under tx_lock
+};
+
+struct net_dev {
+	const struct net_dev_ops *ops;
+	char name[IFNAMSIZ];
+	void *priv;  // driver state of the device
+
+	uint8_t hwaddr[6];
+	uint32_t ipv4;
+	uint64_t ipv6[2];
+	uint16_t mtu;
+
+	uint32_t features;
+	uint8_t vnet_hdr_len;  // bytes in front of every frame, 0 without NETIF_F_VNET_HDR
+
+	atomic_int running;  // queue workers keep going while set
+	uint32_t rx_batch;  // frames read per worker wakeup at most
+
+	uint16_t queue_count;
+	struct net_queue queues[NET_DEV_MAX_QUEUES];
+};
+
+
+struct net_dev *net_dev_open(const struct net_dev_ops *ops, const char *name, uint16_t queue_count, uint32_t features,
+							 uint16_t mtu, const void *arg);
+void net_dev_close(struct net_dev *dev);
+
+void net_dev_start(struct net_dev *dev, uint32_t rx_batch);
+void net_dev_stop(struct net_dev *dev);
+void net_dev_flush(struct net_dev *dev);
+void net_dev_print_stats(struct net_dev *dev);
+void net_batch_stats_add(struct net_batch_stats *stats, uint32_t count);
+
+int net_dev_if_mtu(const char *ifname, uint16_t mtu);
+
+struct net_queue *net_dev_flow_queue(struct net_dev *dev, uint32_t local_ip, uint32_t remote_ip, uint16_t local_port,
+									 uint16_t remote_port);
+struct net_queue *net_dev_ipv4_queue(struct net_dev *dev, const struct ipv4_packet *ip_packet, uint32_t len);
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <linux/if_packet.h>
+
+#include "skbuff.h"
+#include "netdev.h"
+
+// Ring geometry, per queue
+#define PACKET_BLOCK_SIZE (1 << 18)  // 256 KiB, fits a few hundred full sized frames or a couple of GRO ones
+#define PACKET_RX_BLOCKS 16
+#define PACKET_RX_BLOCK_TIMEOUT 1  // ms until the kernel hands over a block that isn't full
+#define PACKET_FRAME_SIZE 2048  // smallest TX slot, grows with the MTU, only a hint for RX where frames are packed
+#define PACKET_TX_BLOCKS 2
+
+// Frame data follows the header, the kernel ignores the sockaddr_ll part on TX
+#define PACKET_TX_DATA_OFFSET (TPACKET3_HDRLEN - sizeof(struct sockaddr_ll))
+
+
+// TPACKET_V3 rings of one queue, RX and TX share one mapping.
+// RX frames are wrapped in sk_buffs in place, each block is an skb_page that goes back to the kernel when the last
+// sk_buff pointing into it is freed. TX frames are copied into slots and the kernel is kicked once per batch.
+struct packet_ring {
+	uint8_t *map;
+	size_t map_size;
+
+	struct tpacket_req3 rx_req;
+	uint8_t *rx_ring;
+	uint32_t rx_block;  // block being walked
+	struct skb_page *rx_page;  // our reference to that block, NULL until its frames are walked
+	struct tpacket3_hdr *rx_frame;  // next frame in the block
+	uint32_t rx_frames_left;
+
+	struct tpacket_req3 tx_req;
+	uint8_t *tx_ring;
+	uint32_t tx_frame;  // next slot to fill
+	uint32_t tx_pending;  // slots filled since the last kick
+	pthread_mutex_t tx_lock;  // any thread may send through any queue
+};
+
+
+extern const struct net_dev_ops packet_ops;
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "netdev.h"
+#include "skbuff.h"
+
+// Classic capture file format, the magic tells byte order and timestamp resolution
+#define PCAP_MAGIC_US 0xa1b2c3d4
+#define PCAP_MAGIC_NS 0xa1b23c4d
+#define PCAP_LINKTYPE_ETHERNET 1
+#define PCAP_SNAPLEN 262144
+
+// pcapng block types
+#define PCAPNG_BLOCK_SHB 0x0a0d0d0a  // section header
+#define PCAPNG_BLOCK_IDB 0x00000001  // interface description
+#define PCAPNG_BLOCK_SPB 0x00000003  // simple packet
+#define PCAPNG_BLOCK_EPB 0x00000006  // enhanced packet
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1a2b3c4d
+#define PCAPNG_OPT_IF_TSRESOL 9
+#define PCAPNG_MAX_INTERFACES 64  // per section, packets of interfaces beyond that are skipped
+
+
+struct pcap_file_header {
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t linktype;
+} __attribute__((packed));
+
+struct pcap_record_header {
+	uint32_t ts_sec;
+	uint32_t ts_frac;  // µs or ns, depending on the magic
+	uint32_t caplen;
+	uint32_t len;
+} __attribute__((packed));
+
+
+// What the pcap device is opened with, passed as net_dev_open()'s arg
+struct pcap_config {
+	const char *replay_path;  // frames received by the device, pcap or pcapng
+	const char *record_path;  // frames sent by the device are written here, may be NULL
+	int timed;  // keep the gaps between frames instead of replaying as fast as possible
+	uint32_t loops;  // times the capture is replayed, 0 counts as 1
+};
+
+struct pcap_frame {
+	const uint8_t *data;  // points into the loaded file
+	uint32_t len;
+	uint64_t ts_ns;  // capture time
+};
+
+// Device fed from a capture file. The file is loaded and indexed when the device is opened so that replay only
+// copies frames into RX buffers, the stack writes into the frames it receives.
+struct pcap_replay {
+	uint8_t *file;
+	size_t file_size;
+
+	struct pcap_frame *frames;
+	uint32_t frame_count;
+	uint32_t frame_capacity;
+	uint64_t frame_bytes;
+	uint32_t skipped;  // records too short to replay
+
+	int timed;
+	uint32_t loops;
+	uint32_t loop;  // loops done
+	uint32_t next;  // next frame of the current loop
+	uint64_t start_ns;  // the first frame went out
+	uint64_t loop_start_ns;  // frame times of the current loop count from here
+	uint64_t end_ns;  // the last frame was processed
+	atomic_int done;
+
+	FILE *record;
+	pthread_mutex_t record_lock;  // any thread may send through the device
+	uint64_t recorded;
+};
+
+
+extern const struct net_dev_ops pcap_ops;
+
+int pcap_replay_done(struct net_dev *dev);
+void pcap_print_stats(struct net_dev *dev);
@@ -1,19 +1,203 @@
 #pragma once
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
 
 #include "list.h"
-#include "tap.h"
+#include "netdev.h"
+
+
+#define SKB_CACHE_LINE 64
+#define SKB_MAX_HEADER 160  // headroom for virtio-net + Ethernet + IPv4 + TCP headers, options included
+#define SKB_MAX_FRAGS 4  // payload fragments an sk_buff can reference besides its own data
+
+// Pool tuning
+#define SKB_LOCAL_CACHE_MAX 64  // per-thread free list length before buffers are handed back to the global list
+#define SKB_CACHE_BATCH 32  // number of buffers moved between the per-thread and the global list at once
+#define SKB_GLOBAL_CACHE_MAX 4096  // buffers kept on a global list, anything above is free()'d
+
+
+// Size classes, data capacity of each class is in skb_class_size[]
+enum skb_size_class {
+	SKB_CLASS_SMALL,  // ACKs, ARP, small ICMP
+	SKB_CLASS_MTU,  // full sized Ethernet frames
+	SKB_CLASS_LARGE,  // big ICMP echoes and such
+	SKB_CLASS_HUGE,  // GRO merged frames received with offloads on
+	SKB_CLASS_COUNT,
+	SKB_CLASS_NONE = SKB_CLASS_COUNT  // too big for the pool, malloc'd and free'd directly
+};
+
+// skb->ip_summed
+#define CHECKSUM_NONE 0  // RX: not verified yet, TX: checksum filled in by the stack
+#define CHECKSUM_UNNECESSARY 1  // RX: the device verified the checksum
+#define CHECKSUM_PARTIAL 2  // RX and TX: only the pseudo header sum is in place, the rest is summed by the device
+#define CHECKSUM_COMPLETE 3  // TX: csum holds the sum of the frags, computed while copying the payload in
+
+
+// Reference counted memory that sk_buff fragments point into. It is either allocated by skb_page_alloc(),
+// or wraps memory owned by the user, in which case release() tells the user that it's not referenced anymore.
+struct skb_page {
+	atomic_uint refcnt;
+	uint8_t *data;
+	uint32_t size;
+
+	void (*release)(struct skb_page *page);
+	void *private;  // for release()
+};
+
+struct skb_frag {
+	struct skb_page *page;
+	uint32_t offset;
+	uint32_t len;
+};
 
 struct sk_buff {
-	uint8_t manual_free;  // eth_write() should not free() it
+	struct sk_buff *next_free;  // free list link, only valid while the buffer is in the pool
+	uint8_t size_class;
+	atomic_uint users;  // references held, the buffer goes back to the pool when the last one is dropped
 	struct net_dev* dev;
-	uint32_t size;
+	uint16_t queue_mapping;  // device queue the buffer was received on or is sent through
+	uint32_t len;  // bytes between data and tail, plus data_len
+	uint32_t data_len;  // bytes held in frags
 
 	uint32_t payload_size;
 
+	uint8_t ip_summed;
+	uint32_t csum;  // TX with CHECKSUM_COMPLETE: checksum_partial() of the frags, as if they were contiguous
+	uint16_t csum_offset;  // TX with CHECKSUM_PARTIAL: offset of the checksum field from the transport header
+	uint16_t gso_size;  // TX: payload size of each segment the device should cut the buffer into, 0 if not TSO
+
+	// head <= data <= tail <= end, each layer pushes its header in front of data
+	uint8_t *head;
 	uint8_t *data;
+	uint8_t *tail;
+	uint8_t *end;
+
+	uint8_t *mac_header;
+	uint8_t *network_header;
+	uint8_t *transport_header;
+
+	// Set when the linear data lives in driver memory instead of the buffer's own block, see skb_wrap()
+	struct skb_page *head_page;
+
+	// Set while the buffer belongs to an RX ring, which takes it back once the frame is processed
+	struct eth_rx_ring *rx_ring;
+
+	// Payload following the linear data
+	uint8_t nr_frags;
+	struct skb_frag frags[SKB_MAX_FRAGS];
+};
+
+struct skb_pool_stats {
+	uint64_t hits[SKB_CLASS_COUNT + 1];  // buffer taken from a free list
+	uint64_t misses[SKB_CLASS_COUNT + 1];  // new block had to be allocated
 };
 
+// Ownership: skb_alloc() returns a buffer with one reference, every holder (retransmission queue, ARP pending
+// queue, driver TX path) takes its own with skb_get() and drops it with skb_free(). Functions that take an
+// sk_buff to send it, like eth_write() and ipv4_send_packet(), consume the caller's reference.
 struct sk_buff* skb_alloc(uint32_t size);
-void skb_free(struct sk_buff *skb);
\ No newline at end of file
+void skb_free(struct sk_buff *skb);
+void skb_over_panic(struct sk_buff *skb, uint32_t len, const char *func);
+void skb_add_frag(struct sk_buff *skb, struct skb_page *page, uint32_t offset, uint32_t len);
+struct sk_buff *skb_wrap(struct skb_page *page, uint32_t offset, uint32_t len);
+struct sk_buff *skb_copy(struct sk_buff *skb);
+struct sk_buff *skb_copy_head(struct sk_buff *skb);
+struct sk_buff *skb_keep(struct sk_buff *skb);
+void skb_copy_bits(struct sk_buff *skb, uint32_t offset, uint8_t *to, uint32_t len);
+void skb_trim(struct sk_buff *skb, uint32_t len);
+
+struct skb_page *skb_page_alloc(uint32_t size);
+struct skb_page *skb_page_wrap(uint8_t *data, uint32_t size, void (*release)(struct skb_page *), void *private);
+void skb_page_put(struct skb_page *page);
+
+
+static inline struct sk_buff *skb_get(struct sk_buff *skb) {
+	atomic_fetch_add_explicit(&skb->users, 1, memory_order_relaxed);
+	return skb;
+}
+
+static inline int skb_shared(struct sk_buff *skb) {
+	return atomic_load_explicit(&skb->users, memory_order_acquire) > 1;
+}
+
+static inline struct skb_page *skb_page_get(struct skb_page *page) {
+	atomic_fetch_add_explicit(&page->refcnt, 1, memory_order_relaxed);
+	return page;
+}
+
+static inline uint8_t *skb_frag_address(const struct skb_frag *frag) {
+	return frag->page->data + frag->offset;
+}
+
+// Length of the linear part
+static inline uint32_t skb_headlen(const struct sk_buff *skb) {
+	return skb->len - skb->data_len;
+}
+
+
+static inline uint32_t skb_headroom(const struct sk_buff *skb) {
+	return (uint32_t)(skb->data - skb->head);
+}
+
+static inline uint32_t skb_tailroom(const struct sk_buff *skb) {
+	return (uint32_t)(skb->end - skb->tail);
+}
+
+// Makes room for headers in front of the data, only allowed on an empty buffer
+static inline void skb_reserve(struct sk_buff *skb, uint32_t len) {
+	if(skb_tailroom(skb) < len)
+		skb_over_panic(skb, len, __func__);
+
+	skb->data += len;
+	skb->tail += len;
+}
+
+// Prepends len bytes of header to the data, returns the start of the new header
+static inline uint8_t *skb_push(struct sk_buff *skb, uint32_t len) {
+	if(skb_headroom(skb) < len)
+		skb_over_panic(skb, len, __func__);
+
+	skb->data -= len;
+	skb->len += len;
+	return skb->data;
+}
+
+// Removes len bytes of header from the start of the data, returns the new start
+static inline uint8_t *skb_pull(struct sk_buff *skb, uint32_t len) {
+	if(skb->len < len)
+		skb_over_panic(skb, len, __func__);
+
+	skb->data += len;
+	skb->len -= len;
+	return skb->data;
+}
+
+// Appends len bytes to the end of the data, returns the start of the appended area
+static inline uint8_t *skb_put(struct sk_buff *skb, uint32_t len) {
+	if(skb_tailroom(skb) < len)
+		skb_over_panic(skb, len, __func__);
+
+	uint8_t *tmp = skb->tail;
+	skb->tail += len;
+	skb->len += len;
+	return tmp;
+}
+
+static inline void skb_reset_mac_header(struct sk_buff *skb) {
+	skb->mac_header = skb->data;
+}
+
+static inline void skb_reset_network_header(struct sk_buff *skb) {
+	skb->network_header = skb->data;
+}
+
+static inline void skb_reset_transport_header(struct sk_buff *skb) {
+	skb->transport_header = skb->data;
+}
+
+void skb_pool_get_stats(struct skb_pool_stats *stats);
+void skb_pool_print_stats();
+void skb_pool_flush_local();
+void skb_pool_free();
@@ -1,16 +1,74 @@
 #pragma once
 
 #include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
 
-#include "tap.h"
+#include "netdev.h"
 
 
+struct neigh_entry;
+
+// Where a socket's packets go, filled in from the route by a send that found the next hop resolved, and reused by
+// every following one as long as what it was filled in from is unchanged: the routing table, the neighbor entry of
+// the next hop and the path MTU slot of the destination. Changes to other neighbors or paths leave it alone.
+struct dst_cache {
+	struct neigh_entry *neigh;  // next hop's ARP or NDP slot, NULL if the cache was never filled in
+	uint32_t neigh_seq;  // seq of the neighbor slot when it was filled in
+	uint32_t route_generation;  // from ipv4_route_generation(), unused by IPv6
+	uint32_t pmtu_seq;  // seq of the destination's path MTU slot, unused by IPv6
+	struct net_dev *dev;  // the route's, may differ from the socket's
+	uint8_t mac[6];  // next hop
+	uint16_t mtu;  // of the path, from ipv4_pmtu_get()
+	uint8_t df;  // IPv4 packets go out with DF: TCP's do unless the path MTU is locked
+	uint32_t header_sum;  // partial checksum of the IPv4 header fields that are the same in every packet, unused by IPv6
+};
+
+// Address of either family in network order. An IPv4 address takes the first word and leaves the rest zeroed, so
+// addresses of one family compare and hash the same way.
+struct sock_addr {
+	union {
+		uint32_t ipv4;
+		uint8_t ipv6[16];
+		uint32_t words[4];
+	};
+};
+
 struct sock {
+	uint8_t family;  // AF_INET or AF_INET6
 	uint8_t protocol;  // TCP, UDP?
 	struct net_dev *dev;
+	uint16_t queue;  // device queue the flow is steered to
 
-	uint32_t source_ip;
-	uint32_t dest_ip;
+	struct sock_addr source;
+	struct sock_addr dest;
 	uint16_t source_port;
 	uint16_t dest_port;
+
+	struct dst_cache dst;  // only used by the thread sending through the socket
 };
+
+
+static inline struct sock_addr sock_addr_ipv4(uint32_t ipv4) {
+	return (struct sock_addr){ .words = { ipv4, 0, 0, 0 } };
+}
+
+static inline struct sock_addr sock_addr_ipv6(const uint8_t *ipv6) {
+	struct sock_addr addr;
+	memcpy(addr.ipv6, ipv6, sizeof(addr.ipv6));
+	return addr;
+}
+
+static inline int sock_addr_equal(const struct sock_addr *a, const struct sock_addr *b) {
+	return ((a->words[0] ^ b->words[0]) | (a->words[1] ^ b->words[1]) | (a->words[2] ^ b->words[2]) |
+			(a->words[3] ^ b->words[3])) == 0;
+}
+
+// 32 bits for flow hashing, an IPv4 address stays as it is
+static inline uint32_t sock_addr_fold(const struct sock_addr *addr) {
+	return addr->words[0] ^ addr->words[1] ^ addr->words[2] ^ addr->words[3];
+}
+
+static inline struct net_queue *sock_queue(struct sock *sock) {
+	return &sock->dev->queues[sock->queue];
+}
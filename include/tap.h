@@ -2,21 +2,16 @@
 
 #include <stdint.h>
 
-#define TAP_DEVICE_IP "192.168.100.6"
-#define TAP_DEVICE_MTU 1500
+#include "netdev.h"
+#include "skbuff.h"
 
+#define TAP_DEVICE_IP "192.168.100.6"
+#define TAP_DEVICE_PREFIX_LEN 24
+#define TAP_DEVICE_IPV6 "fd00:100::6"  // the link-local address comes from the MAC
 
-struct net_dev {
-	int sock_fd;
-	uint8_t hwaddr[6];
-	uint32_t ipv4;
-	uint64_t ipv6[2];
-	uint16_t mtu;
-};
 
-struct net_dev *device;
+extern const struct net_dev_ops tap_ops;
 
-int tap_alloc(char *dev);
-struct net_dev *tap_init_dev(char *dev);
-void free_tap_device();
-struct net_dev *get_tap_device();
\ No newline at end of file
+int tap_alloc(char *dev, int multi_queue, int vnet_hdr);
+int tap_read_vnet_hdr(struct net_dev *dev, struct sk_buff *buffer);
+void tap_push_vnet_hdr(struct net_dev *dev, struct sk_buff *buffer);
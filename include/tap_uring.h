@@ -0,0 +1,107 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "netdev.h"
+#include "skbuff.h"
+
+// Per queue
+#define TAP_URING_ENTRIES 256  // SQ size, the CQ gets twice as many
+#define TAP_URING_RX_BUFFERS 64  // reads kept posted
+#define TAP_URING_TX_SLOTS 256  // writes in flight
+#define TAP_URING_SQ_IDLE_MS 100  // SQPOLL thread goes to sleep after this long without work
+#define TAP_URING_POLL_NS 1  // the worker polls the ring's fd this long, like it polls other drivers' fds
+#define TAP_URING_SPIN_US 1000  // with SQPOLL the worker spins on the CQ this long before it blocks
+#define TAP_URING_WAIT_MS 10  // longest a blocked worker waits for a completion, it checks for shutdown in between
+
+// CQE user_data: what completed, and which RX buffer or TX slot
+#define TAP_URING_RX_TAG (1ull << 32)
+#define TAP_URING_TX_TAG (2ull << 32)
+#define TAP_URING_INDEX_MASK 0xffffffffull
+
+
+// What the io_uring TAP device is opened with, passed as net_dev_open()'s arg
+struct tap_uring_config {
+	int sqpoll;  // a kernel thread picks up submissions, the hot path makes no syscalls
+};
+
+// RX buffer in the registered area. Received frames are wrapped in sk_buffs in place, the buffer is posted
+// again once the last sk_buff pointing into it is freed.
+struct tap_uring_rx {
+	struct tap_uring *ring;
+	uint32_t index;
+	uint32_t len;  // bytes read, while the buffer waits to be handed to the stack
+};
+
+struct tap_uring_tx {
+	struct sk_buff *buffer;  // referenced until the write completes
+	struct iovec iov[1 + SKB_MAX_FRAGS];  // read by the kernel at any point before completion with SQPOLL
+};
+
+struct tap_uring_stats {
+	uint64_t enters;  // io_uring_enter() calls
+	uint64_t waits;  // of them, the worker blocking for a completion after spinning idle
+	uint64_t sqes;
+	uint64_t rx_completions;
+	uint64_t tx_completions;
+	uint64_t errors;
+};
+
+// io_uring of one TAP queue. Submission and completion queues are shared by the queue worker and every thread
+// sending through the queue, the lock serializes them.
+struct tap_uring {
+	int fd;
+	int tap_fd;
+	int sqpoll;
+	int ext_arg;  // io_uring_enter() takes a timeout
+	uint64_t idle_since;  // when the worker last found nothing to do, 0 while it's busy
+	pthread_mutex_t lock;
+
+	uint8_t *sq_map;
+	size_t sq_map_size;
+	uint8_t *cq_map;  // same as sq_map with IORING_FEAT_SINGLE_MMAP
+	size_t cq_map_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+
+	uint32_t *sq_head;
+	uint32_t *sq_tail;
+	uint32_t *sq_flags;
+	uint32_t sq_mask;
+	uint32_t sq_entries;
+	uint32_t sq_local_tail;  // SQEs filled in, published on submit
+	uint32_t sq_submitted;  // SQEs handed to the kernel
+
+	uint32_t *cq_head;
+	uint32_t *cq_tail;
+	uint32_t cq_mask;
+	struct io_uring_cqe *cqes;
+
+	// Registered as one buffer, each RX buffer takes rx_stride bytes of it
+	uint8_t *rx_area;
+	size_t rx_area_size;
+	uint32_t rx_stride;
+	uint32_t rx_reserve;  // puts the IPv4 header on a 4 byte boundary
+	struct tap_uring_rx rx[TAP_URING_RX_BUFFERS];
+	uint32_t rx_ready[TAP_URING_RX_BUFFERS];  // completed reads waiting for rx_batch()
+	uint32_t rx_ready_head;
+	uint32_t rx_ready_tail;
+
+	// Buffers freed by the stack, possibly from another thread, waiting to be posted again
+	pthread_mutex_t rx_free_lock;
+	uint32_t rx_free[TAP_URING_RX_BUFFERS];
+	uint32_t rx_free_count;
+
+	struct tap_uring_tx tx[TAP_URING_TX_SLOTS];
+	uint32_t tx_free[TAP_URING_TX_SLOTS];
+	uint32_t tx_free_count;
+
+	struct tap_uring_stats stats;
+};
+
+
+extern const struct net_dev_ops tap_uring_ops;
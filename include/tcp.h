@@ -9,11 +9,13 @@
 #include "sock.h"
 #include "eth.h"
 #include "ipv4.h"
+#include "ipv6.h"
 #include "utils.h"
 
 
 #define TCP_HEADER_SIZE 20
 #define TCP_INITIAL_WINDOW 64240  // initial window size
+#define TCP_TSO_MAX_SIZE (65535 - 60 - 60)  // payload of a TSO segment, IPv4 and TCP headers with options have to fit
 
 
 // Options
@@ -59,7 +61,7 @@ struct tcp_options {
 	uint8_t sack_permitted;
 	uint32_t timestamp;
 	uint32_t echo;
-} __attribute__((packed)) tcp_options;
+} __attribute__((packed));
 
 struct tcp_segment {
 	uint16_t source_port;
@@ -112,11 +114,9 @@ struct tcp_socket {
 	uint32_t irs;  // initial received sequence number
 };
 
-struct list_head tcp_socket_list;
-
 
 static inline struct tcp_segment *tcp_segment_from_skb(struct sk_buff *buff) {
-	return (struct tcp_segment *)(buff->data + ETHERNET_HEADER_SIZE + IP_HEADER_SIZE);
+	return (struct tcp_segment *)buff->transport_header;
 }
 
 static inline void tcp_segment_ntoh(struct tcp_segment *tcp_segment) {
@@ -129,11 +129,13 @@ static inline void tcp_segment_ntoh(struct tcp_segment *tcp_segment) {
 	tcp_segment->urg_pointer = ntohs(tcp_segment->urg_pointer);
 }
 
-void tcp_in(struct eth_frame *frame);
-struct sk_buff *tcp_out_create_buffer(uint16_t payload_size);
+void tcp_in(struct sk_buff *buffer);
+void tcp_in_queue_push(struct tcp_socket *tcp_socket, struct sk_buff *sk_buff);
+struct sk_buff *tcp_out_create_buffer(uint16_t payload_size, uint8_t options_size);
 
 void tcp_out_send(struct tcp_socket *tcp_socket, struct sk_buff *buffer);
 uint32_t tcp_out_data(struct tcp_socket *tcp_socket, uint8_t *data, uint32_t data_len);
+uint32_t tcp_out_data_page(struct tcp_socket *tcp_socket, struct skb_page *page, uint32_t offset, uint32_t data_len);
 void tcp_out_set_seqnums(struct tcp_socket *tcp_socket, struct sk_buff *buffer);
 void tcp_out_header(struct tcp_socket *tcp_socket, struct sk_buff *buffer);
 void tcp_out_ack(struct tcp_socket *tcp_socket);
@@ -154,8 +156,9 @@ void tcp_calc_rto(struct tcp_socket *tcp_socket);
 
 void tcp_socket_free(struct tcp_socket *tcp_socket);
 void tcp_socket_free_queues(struct tcp_socket *tcp_socket);
-struct tcp_socket* tcp_socket_new(struct net_dev *device, uint32_t dest_ip, uint16_t source_port, uint16_t dest_port);
-struct tcp_socket* tcp_socket_get(uint32_t source_ip, uint32_t dest_ip, uint16_t source_port, uint16_t dest_port);
+uint32_t tcp_socket_read(struct tcp_socket *tcp_socket, uint8_t *data, uint32_t data_len);
+struct tcp_socket* tcp_socket_new(struct net_dev *device, uint8_t family, const struct sock_addr *source, const struct sock_addr *dest, uint16_t source_port, uint16_t dest_port);
+struct tcp_socket* tcp_socket_get(struct net_dev *dev, uint8_t family, const struct sock_addr *source, const struct sock_addr *dest, uint16_t source_port, uint16_t dest_port);
 
 
 
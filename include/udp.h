@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "skbuff.h"
+#include "sock.h"
+#include "netdev.h"
+
+
+#define UDP_HEADER_SIZE 8
+#define UDP_HASH_SIZE 256  // buckets of the port demux table
+#define UDP_RX_RING_SIZE 256  // datagrams a socket holds until they are read, more are dropped
+#define UDP_EPHEMERAL_MIN 49152  // local ports picked when binding to port 0, RFC 6335's dynamic range
+
+
+struct udp_datagram {
+	uint16_t source_port;
+	uint16_t dest_port;
+	uint16_t len;
+	uint16_t checksum;
+	uint8_t data[];
+} __attribute__((packed));
+
+// One datagram of a batch, in the spirit of struct mmsghdr. Received ones point into the RX buffer they arrived in,
+// which the message holds until udp_recv_done().
+struct udp_msg {
+	uint32_t remote_ip;  // network order
+	uint16_t remote_port;  // host order
+	uint8_t *data;
+	uint32_t len;
+	struct sk_buff *buffer;  // receive only
+};
+
+struct udp_socket {
+	struct sock sock;  // dest and dest_port are whoever the last datagram was sent to, the dst cache follows them
+	struct udp_socket *hash_next;
+
+	// Kept RX buffers, filled by the queue workers and drained by the reader
+	pthread_mutex_t lock;
+	struct sk_buff *ring[UDP_RX_RING_SIZE];
+	uint32_t head;
+	uint32_t tail;
+};
+
+
+static inline struct udp_datagram *udp_datagram_from_skb(struct sk_buff *buff) {
+	return (struct udp_datagram *)buff->transport_header;
+}
+
+void udp_in(struct sk_buff *buffer);
+struct udp_socket *udp_socket_new(struct net_dev *dev, uint32_t source_ip, uint16_t port);
+void udp_socket_close(struct udp_socket *udp_socket);
+uint32_t udp_send_batch(struct udp_socket *udp_socket, struct udp_msg *msgs, uint32_t count);
+uint32_t udp_recv_batch(struct udp_socket *udp_socket, struct udp_msg *msgs, uint32_t count);
+void udp_recv_done(struct udp_msg *msgs, uint32_t count);
+void udp_print_stats();
@@ -2,7 +2,17 @@
 
 #include <netinet/in.h>
 
+#include "skbuff.h"
+
+uint32_t checksum_partial(const void *data, uint32_t len, uint32_t sum);
+uint32_t checksum_copy_partial(void *dst, const void *src, uint32_t len, uint32_t sum);
+uint16_t checksum_fold(uint32_t sum);
 uint16_t checksum(register uint16_t *ptr, register uint32_t len, register uint32_t sum);
+uint32_t checksum_skb(struct sk_buff *skb, uint8_t *start, uint32_t sum);
+uint16_t checksum_adjust(uint16_t check, const void *old_data, const void *new_data, uint32_t len);
+uint32_t pseudo_header_sum(uint8_t protocol, uint16_t len, uint32_t source_ip, uint32_t dest_ip);
+uint32_t ipv6_pseudo_header_sum(uint8_t protocol, uint32_t len, const uint8_t *source_ip, const uint8_t *dest_ip);
+uint32_t tcp_pseudo_header_sum(uint16_t tcp_segment_len, uint32_t source_ip, uint32_t dest_ip);
 uint16_t tcp_checksum(void *tcp_segment, uint16_t tcp_segment_len, uint32_t source_ip, uint32_t dest_ip);
 
 #define max(x,y) ( \
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "netdev.h"
+#include "skbuff.h"
+
+#define WIRE_RING_SIZE 1024  // frames in flight per direction and queue
+
+
+// Frames travelling to one queue of one end. The queue worker is the only consumer, senders take the lock.
+struct wire_ring {
+	struct sk_buff *slots[WIRE_RING_SIZE];
+	atomic_uint head;  // next frame to receive
+	atomic_uint tail;  // next free slot
+	pthread_mutex_t lock;
+	atomic_uint_fast64_t drops;  // frames lost to a full ring or a missing peer
+};
+
+// In-process cable between two devices, opened with wire_ops under the same name. Frames are handed over as
+// sk_buff pointers, nothing is copied unless the sender keeps a reference.
+struct wire {
+	char name[IFNAMSIZ];
+	uint8_t index;
+	uint16_t queue_count;
+
+	struct net_dev *ends[2];
+	struct wire_ring rings[2][NET_DEV_MAX_QUEUES];  // rings[i] deliver to ends[i]
+
+	struct list_head list;
+};
+
+
+extern const struct net_dev_ops wire_ops;
+
+uint64_t wire_drops(struct net_dev *dev);
@@ -6,83 +6,136 @@
 #include <stdlib.h>
 #include <arpa/inet.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <inttypes.h>
 #include "arp.h"
-#include "tap.h"
+#include "netdev.h"
 #include "eth.h"
 #include "skbuff.h"
+#include "ipv4.h"
 
 
+extern int RUNNING;
+
 static uint8_t BROADCAST_ADDRESS[] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
-static LIST_HEAD(arp_entry_list);
-pthread_mutex_t arp_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-void arp_free_cache() {
-	struct list_head *list_item, *tmp;
-	struct arp_entry *entry;
+#define ARP_KEY_SIZE 6  // protocol type and address, both in network order
 
-	pthread_mutex_lock(&arp_mutex);
 
-	list_for_each_safe(list_item, tmp, &arp_entry_list) {
-		entry = list_entry(list_item, struct arp_entry, list);
+static inline void arp_key(uint8_t *key, uint16_t protocol_type, uint32_t address) {
+	protocol_type = htons(protocol_type);
+	memcpy(key, &protocol_type, sizeof(protocol_type));
+	memcpy(key + 2, &address, sizeof(address));
+}
 
-		// Clean up ARP buffer too
-		struct arp_buffer *buffer = entry->buffer_head;
-		while(buffer != NULL) {
-			skb_free(buffer->buffer);
+// Fibonacci hashing, the host byte order puts the bits that differ between neighbors at the bottom
+static inline uint32_t arp_hash(const uint8_t *key) {
+	uint16_t protocol_type;
+	uint32_t address;
+	memcpy(&protocol_type, key, sizeof(protocol_type));
+	memcpy(&address, key + 2, sizeof(address));
 
-			struct arp_buffer *buffer_next = buffer->next;
-			free(buffer);
-			buffer = buffer_next;
-		}
+	return (ntohl(address) ^ ((uint32_t)ntohs(protocol_type) << 16)) * 2654435761u;
+}
 
-		list_del(list_item);
-		free(entry);
-	}
+static void arp_request(struct net_dev *dev, uint16_t queue, const uint8_t *key) {
+	uint32_t address;
+	memcpy(&address, key + 2, sizeof(address));
+
+	arp_send_request(dev, address);
+}
+
+static struct neigh_entry arp_entries[ARP_TABLE_SIZE];
+static struct neigh_table arp_table = {
+	.name = "ARP",
+	.eth_type = ETH_P_IP,
+	.key_size = ARP_KEY_SIZE,
+	.bits = ARP_TABLE_BITS,
+	.entries = arp_entries,
+	.hash = arp_hash,
+	.request = arp_request,
+	.reachable_time = ARP_REACHABLE_TIME,
+	.refresh_time = ARP_REFRESH_TIME,
+	.retrans_time = ARP_RETRY_TIME,
+	.backoff = 1,
+	.max_retries = ARP_MAX_RETRIES,
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+
+void arp_free_cache() {
+	neigh_free(&arp_table);
+}
 
+// State of the address, NEIGH_STATE_FREE if it isn't known, see neigh_lookup()
+int arp_lookup(uint16_t protocol_type, uint32_t address, uint8_t *mac, struct neigh_entry **entry, uint32_t *seq) {
+	uint8_t key[ARP_KEY_SIZE];
+	arp_key(key, protocol_type, address);
 
-	pthread_mutex_unlock(&arp_mutex);
+	return neigh_lookup(&arp_table, key, ARP_KEY_SIZE, arp_hash(key), mac, entry, seq);
 }
 
-struct arp_entry* arp_get_entry(uint16_t protocol_type, uint32_t address) {
-	struct list_head *list_item;
-	struct arp_entry *entry;
+// Adds or updates a resolved address and restarts its reachability timer, returns -1 if the table is full. ARP has
+// no notion of unconfirmed MACs, whatever a neighbor says about itself is taken as reachable.
+int arp_add_entry_active(struct net_dev *dev, uint8_t *mac_address, uint32_t ipv4_address) {
+	struct sk_buff *pending[NEIGH_PENDING_MAX];
+	uint8_t pending_count = 0;
+	uint8_t key[ARP_KEY_SIZE];
+	arp_key(key, ETH_P_IP, ipv4_address);
 
-	pthread_mutex_lock(&arp_mutex);
+	pthread_mutex_lock(&arp_table.mutex);
 
-	list_for_each(list_item, &arp_entry_list) {
-		entry = list_entry(list_item, struct arp_entry, list);
-		if(entry->protocol_type == protocol_type && entry->address == address) {
-			pthread_mutex_unlock(&arp_mutex);
-			return entry;
-		}
+	struct neigh_entry *slot;
+	struct neigh_entry *entry = neigh_find_locked(&arp_table, key, &slot);
+
+	if(entry == NULL)
+		entry = neigh_insert_locked(&arp_table, slot, dev, key, NEIGH_STATE_REACHABLE, mac_address);
+	else if(entry->state != NEIGH_STATE_REACHABLE || memcmp(entry->mac, mac_address, ARP_HWSIZE_ETHERNET) != 0) {
+		neigh_set_locked(entry, NEIGH_STATE_REACHABLE, mac_address);
+		pending_count = neigh_pending_take_locked(entry, pending);
 	}
 
-	pthread_mutex_unlock(&arp_mutex);
+	if(entry != NULL)
+		neigh_confirm_locked(&arp_table, entry);
 
-	return NULL;
+	pthread_mutex_unlock(&arp_table.mutex);
+
+	// Buffers waiting for the reply go out in the order they were sent
+	for(uint8_t i = 0; i < pending_count; i++)
+		eth_write(mac_address, ETH_P_IP, pending[i]);
+
+	return entry != NULL ? 0 : -1;
 }
 
-struct arp_entry *arp_add_entry_active(uint8_t *mac_address, uint32_t ipv4_address) {
-	pthread_mutex_lock(&arp_mutex);
+// Slow path of ipv4_send_packet() when arp_lookup() found no MAC, takes over the caller's reference to the buffer
+int arp_resolve(struct net_dev *dev, uint32_t address, struct sk_buff *buffer) {
+	uint8_t key[ARP_KEY_SIZE];
+	arp_key(key, ETH_P_IP, address);
 
-	struct arp_entry *entry = malloc(sizeof(struct arp_entry));
-	entry->buffer_head = NULL;
-	entry->state = ARP_ENTRY_STATE_ACTIVE;
-	entry->protocol_type = ETH_P_IP;
-	entry->address = ipv4_address;
-	memcpy(entry->mac, mac_address, sizeof(entry->mac));
-	list_add(&entry->list, &arp_entry_list);
+	return neigh_resolve(&arp_table, dev, key, buffer);
+}
 
-	pthread_mutex_unlock(&arp_mutex);
-	return entry;
+void *arp_timer(void *args) {
+	while(RUNNING) {
+		neigh_timer_run(&arp_table);
+		usleep(ARP_TIMER_INTERVAL * 1000);
+	}
+
+	skb_pool_flush_local();
+	return NULL;
+}
+
+void arp_print_stats() {
+	neigh_print_stats(&arp_table);
 }
 
 int arp_send_reply(struct net_dev* dev, struct arp_packet *packet) {
-	struct sk_buff *buffer = skb_alloc(ETHERNET_HEADER_SIZE + sizeof(struct arp_packet));
+	struct sk_buff *buffer = skb_alloc(SKB_MAX_HEADER + sizeof(struct arp_packet));
+	skb_reserve(buffer, SKB_MAX_HEADER);
+	skb_reset_network_header(buffer);
 
 	buffer->dev = dev;
-	struct eth_frame *eth_frame = (struct eth_frame *)buffer->data;
-	struct arp_packet *packet_resp = (struct arp_packet *)eth_frame->payload;
+	struct arp_packet *packet_resp = (struct arp_packet *)skb_put(buffer, sizeof(struct arp_packet));
 
 	// Header
 	packet_resp->hw_type = htons(ARP_HWTYPE_ETHERNET);
@@ -103,26 +156,13 @@ int arp_send_reply(struct net_dev* dev, struct arp_packet *packet) {
 	return eth_write(BROADCAST_ADDRESS, ETH_P_ARP, buffer);
 }
 
-struct arp_entry *arp_send_request(struct net_dev* dev, uint32_t ipv4_address) {
-	// First create the entry in SENT state
-	pthread_mutex_lock(&arp_mutex);
-
-	struct arp_entry *entry = malloc(sizeof(struct arp_entry));
-	entry->buffer_head = NULL;
-	entry->state = ARP_ENTRY_STATE_WAITING;
-	entry->protocol_type = ETH_P_IP;
-	entry->address = ipv4_address;
-	memset(entry->mac, 0, ARP_HWSIZE_ETHERNET);
-	list_add(&entry->list, &arp_entry_list);
-
-	pthread_mutex_unlock(&arp_mutex);
-
-	// Send the request
-	struct sk_buff *buffer = skb_alloc(ETHERNET_HEADER_SIZE + sizeof(struct arp_packet));
+int arp_send_request(struct net_dev* dev, uint32_t ipv4_address) {
+	struct sk_buff *buffer = skb_alloc(SKB_MAX_HEADER + sizeof(struct arp_packet));
+	skb_reserve(buffer, SKB_MAX_HEADER);
+	skb_reset_network_header(buffer);
 
 	buffer->dev = dev;
-	struct eth_frame *eth_frame = (struct eth_frame *)buffer->data;
-	struct arp_packet *packet = (struct arp_packet *)eth_frame->payload;
+	struct arp_packet *packet = (struct arp_packet *)skb_put(buffer, sizeof(struct arp_packet));
 
 	// Header
 	packet->hw_type = htons(ARP_HWTYPE_ETHERNET);
@@ -140,14 +180,12 @@ struct arp_entry *arp_send_request(struct net_dev* dev, uint32_t ipv4_address) {
 	packet->dest_address = ipv4_address;
 
 	// Send it
-	eth_write(BROADCAST_ADDRESS, ETH_P_ARP, buffer);
-
-	return entry;
+	return eth_write(BROADCAST_ADDRESS, ETH_P_ARP, buffer);
 }
 
 
-int arp_process_packet(struct net_dev *dev, struct eth_frame *eth_frame) {
-	struct arp_packet *arp_packet = (struct arp_packet *)eth_frame->payload;
+int arp_process_packet(struct net_dev *dev, struct sk_buff *buffer) {
+	struct arp_packet *arp_packet = (struct arp_packet *)buffer->network_header;
 
 	arp_packet->op_code = ntohs(arp_packet->op_code);
 	arp_packet->hw_type = ntohs(arp_packet->hw_type);
@@ -174,28 +212,8 @@ int arp_process_packet(struct net_dev *dev, struct eth_frame *eth_frame) {
 			return -1;
 		}
 
-		struct arp_entry *entry = arp_get_entry(arp_packet->protocol_type, arp_packet->source_address);
-
-		// check if IP is not in cache yet, or we were waiting for reply
-		if(!entry)
-			arp_add_entry_active(arp_packet->source_mac, arp_packet->source_address);
-
-		else if(entry->state == ARP_ENTRY_STATE_WAITING) {
-			// Received reply for sent request
-			pthread_mutex_lock(&arp_mutex);
-			memcpy(entry->mac, arp_packet->source_mac, ARP_HWSIZE_ETHERNET);
-			entry->state = ARP_ENTRY_STATE_ACTIVE;
-
-			while(entry->buffer_head != NULL) {
-				eth_write(entry->mac, entry->protocol_type, entry->buffer_head->buffer);
-
-				struct arp_buffer *buffer_next = entry->buffer_head->next;
-				free(entry->buffer_head);
-				entry->buffer_head = buffer_next;
-			}
-
-			pthread_mutex_unlock(&arp_mutex);
-		}
+		// Learn the sender, and send whatever waited for it
+		arp_add_entry_active(dev, arp_packet->source_mac, arp_packet->source_address);
 
 		if(arp_packet->dest_address != dev->ipv4) {
 			printf("ARP not for us, ignore\n");
@@ -213,23 +231,3 @@ int arp_process_packet(struct net_dev *dev, struct eth_frame *eth_frame) {
 	}
 }
 
-
-void arp_add_to_buffer(struct arp_entry *arp_entry, struct sk_buff *sk_buff) {
-	struct arp_buffer* arp_buffer = malloc(sizeof(struct arp_buffer));
-	arp_buffer->next = NULL;
-	arp_buffer->buffer = sk_buff;
-
-	pthread_mutex_lock(&arp_mutex);
-
-	if(arp_entry->buffer_head == NULL)
-		arp_entry->buffer_head = arp_buffer;
-	else {
-		struct arp_buffer *tail = arp_entry->buffer_head;
-		while(tail->next != NULL)
-			tail = tail->next;
-
-		tail->next = arp_buffer;
-	}
-
-	pthread_mutex_unlock(&arp_mutex);
-}
@@ -0,0 +1,601 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <inttypes.h>
+#include <arpa/inet.h>
+#include <linux/if_ether.h>
+
+#include "bench.h"
+#include "netdev.h"
+#include "wire.h"
+#include "pcap.h"
+#include "tap.h"
+#include "eth.h"
+#include "arp.h"
+#include "ipv4_route.h"
+#include "icmp.h"
+#include "icmpv6.h"
+#include "ndp.h"
+#include "udp.h"
+#include "checksum.h"
+#include "utils.h"
+
+#define BENCH_WIRE_CLIENT_IP "10.0.0.1"
+#define BENCH_WIRE_SERVER_IP "10.0.0.2"
+#define BENCH_WIRE_CLIENT_IPV6 "fd00::1"
+#define BENCH_WIRE_SERVER_IPV6 "fd00::2"
+#define BENCH_WIRE_PINGS 10000  // round trips timed one by one
+#define BENCH_WIRE_PACKETS 200000  // echoes sent for the throughput run
+#define BENCH_WIRE_WINDOW 64  // echoes in flight during the throughput run
+#define BENCH_WIRE_PAYLOAD 56
+#define BENCH_UDP_PORT 9000
+#define BENCH_UDP_PACKETS 1000000  // datagrams per batch size
+#define BENCH_UDP_PAYLOAD 64
+#define BENCH_UDP_WINDOW (UDP_RX_RING_SIZE / 2)  // datagrams in flight, the receiver's ring never fills up
+#define BENCH_TIMEOUT_NS 2000000000ull
+#define BENCH_CHECKSUM_BYTES (64ull << 20)  // summed per size and implementation
+#define BENCH_CHECKSUM_VERIFY_LEN 2048  // every length up to this is compared with the reference, at every alignment
+#define BENCH_ARP_LOOKUPS 10000000  // per table size, hits and misses each
+#define BENCH_ROUTE_LOOKUPS 10000000  // per table size
+#define BENCH_COPY_ARENA (32u << 20)  // copies walk through this much memory, like a large send from user memory
+
+
+struct bench {
+	const char *name;
+	const char *description;
+	int (*run)(const struct bench_options *options);
+};
+
+
+static uint64_t bench_now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static int bench_compare_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+
+static atomic_uint_fast64_t bench_echo_replies;
+
+static void bench_echo_reply(struct net_dev *dev, uint16_t id, uint16_t seq) {
+	atomic_fetch_add_explicit(&bench_echo_replies, 1, memory_order_release);
+}
+
+// Queued, it goes out with the next flush. IPv6 is used when the server has an IPv6 address.
+static void bench_echo_send(struct net_dev *dev, struct net_dev *server, uint16_t seq) {
+	pthread_mutex_lock(&dev->queues[0].lock);
+	if(server->ipv6[0] | server->ipv6[1])
+		icmpv6_send_echo(dev, 0, (uint8_t *)server->ipv6, 1, seq, BENCH_WIRE_PAYLOAD);
+	else
+		icmp_send_echo(dev, 0, server->ipv4, 1, seq, BENCH_WIRE_PAYLOAD);
+	pthread_mutex_unlock(&dev->queues[0].lock);
+}
+
+// Waits until count replies came in, workers may share the CPU with us
+static int bench_echo_wait(uint64_t count) {
+	uint64_t deadline = bench_now_ns() + BENCH_TIMEOUT_NS;
+
+	while(atomic_load_explicit(&bench_echo_replies, memory_order_acquire) < count) {
+		if(bench_now_ns() > deadline)
+			return -1;
+		sched_yield();
+	}
+
+	return 0;
+}
+
+// Two stacks joined by a wire device, one pings the other: round trip latency, then throughput with a window of
+// echoes in flight. No kernel in the path. name is the benchmark's, wire6 pings over IPv6.
+static int bench_wire_run(const struct bench_options *options, const char *name, int ipv6) {
+	struct net_dev *client = net_dev_open(&wire_ops, "wire0", 1, 0, options->mtu, NULL);
+	struct net_dev *server = net_dev_open(&wire_ops, "wire0", 1, 0, options->mtu, NULL);
+	inet_pton(AF_INET, BENCH_WIRE_CLIENT_IP, &client->ipv4);
+	inet_pton(AF_INET, BENCH_WIRE_SERVER_IP, &server->ipv4);
+	if(ipv6) {
+		inet_pton(AF_INET6, BENCH_WIRE_CLIENT_IPV6, client->ipv6);
+		inet_pton(AF_INET6, BENCH_WIRE_SERVER_IPV6, server->ipv6);
+	}
+
+	// Both stacks share the routing table, each reaches the other through its own end of the wire. IPv6 needs no
+	// routes, the other end is on-link.
+	ipv4_route_add(server->ipv4, 32, 0, client, 0);
+	ipv4_route_add(client->ipv4, 32, 0, server, 0);
+
+	net_dev_start(client, options->rx_batch);
+	net_dev_start(server, options->rx_batch);
+
+	icmp_set_echo_reply_handler(bench_echo_reply);
+	icmpv6_set_echo_reply_handler(bench_echo_reply);
+	atomic_store(&bench_echo_replies, 0);
+
+	// The first echo waits for ARP or NDP
+	int res = 0;
+	bench_echo_send(client, server, 0);
+	eth_flush(client, 0);
+	if(bench_echo_wait(1) < 0) {
+		printf("%s: no reply to the first echo\n", name);
+		res = -1;
+		goto out;
+	}
+
+	uint64_t *rtt = malloc(BENCH_WIRE_PINGS * sizeof(uint64_t));
+	if(rtt == NULL) {
+		perror("could not allocate memory for benchmark");
+		exit(1);
+	}
+
+	for(uint32_t i = 0; i < BENCH_WIRE_PINGS; i++) {
+		uint64_t start = bench_now_ns();
+		bench_echo_send(client, server, (uint16_t)(i + 1));
+		eth_flush(client, 0);
+		if(bench_echo_wait(i + 2) < 0) {
+			printf("%s: echo #%u timed out\n", name, i + 1);
+			free(rtt);
+			res = -1;
+			goto out;
+		}
+		rtt[i] = bench_now_ns() - start;
+	}
+
+	qsort(rtt, BENCH_WIRE_PINGS, sizeof(uint64_t), bench_compare_u64);
+	uint64_t rtt_sum = 0;
+	for(uint32_t i = 0; i < BENCH_WIRE_PINGS; i++)
+		rtt_sum += rtt[i];
+
+	printf("%s: %u round trips, %u byte echoes | min %" PRIu64 " ns | avg %" PRIu64 " ns | p50 %" PRIu64
+		   " ns | p99 %" PRIu64 " ns\n", name, BENCH_WIRE_PINGS, BENCH_WIRE_PAYLOAD, rtt[0], rtt_sum / BENCH_WIRE_PINGS,
+		   rtt[BENCH_WIRE_PINGS / 2], rtt[BENCH_WIRE_PINGS * 99 / 100]);
+	free(rtt);
+
+	uint64_t base = atomic_load(&bench_echo_replies);
+	uint64_t start = bench_now_ns();
+	uint64_t deadline = start + BENCH_TIMEOUT_NS * 10;
+	uint32_t sent = 0;
+
+	while(1) {
+		uint64_t received = atomic_load_explicit(&bench_echo_replies, memory_order_acquire) - base;
+		if(received >= BENCH_WIRE_PACKETS)
+			break;
+
+		if(bench_now_ns() > deadline) {
+			printf("%s: throughput run timed out, %" PRIu64 " of %u echoes answered, %" PRIu64 " frames dropped\n",
+				   name, received, BENCH_WIRE_PACKETS, wire_drops(client) + wire_drops(server));
+			res = -1;
+			goto out;
+		}
+
+		// The window is filled up, then sent as one batch
+		if(sent < BENCH_WIRE_PACKETS && sent - received < BENCH_WIRE_WINDOW)
+			bench_echo_send(client, server, (uint16_t)sent++);
+		else {
+			eth_flush(client, 0);
+			sched_yield();
+		}
+	}
+
+	uint64_t elapsed = bench_now_ns() - start;
+	printf("%s: %u echoes, window %u | %.0f round trips/s | %.0f packets/s | %.1f ns/packet\n",
+		   name, BENCH_WIRE_PACKETS, BENCH_WIRE_WINDOW, BENCH_WIRE_PACKETS * 1e9 / elapsed,
+		   2 * BENCH_WIRE_PACKETS * 1e9 / elapsed, (double)elapsed / (2 * BENCH_WIRE_PACKETS));
+
+out:
+	icmp_set_echo_reply_handler(NULL);
+	icmpv6_set_echo_reply_handler(NULL);
+	net_dev_stop(client);
+	net_dev_stop(server);
+	net_dev_print_stats(client);
+	net_dev_print_stats(server);
+	net_dev_close(client);
+	net_dev_close(server);
+	arp_free_cache();
+	ndp_free_cache();
+	ipv4_route_free();
+
+	return res;
+}
+
+static int bench_wire(const struct bench_options *options) {
+	return bench_wire_run(options, "wire", 0);
+}
+
+static int bench_wire6(const struct bench_options *options) {
+	return bench_wire_run(options, "wire6", 1);
+}
+
+
+// Datagrams from one stack to a socket on the other over the wire, sent and read in batches of growing size. The
+// sender keeps a window in flight and drains the receiving socket itself, so both ends run in this thread.
+static int bench_udp(const struct bench_options *options) {
+	static const uint32_t batches[] = { 1, 8, 32 };
+	struct udp_msg msgs[32];
+	uint8_t payload[BENCH_UDP_PAYLOAD] = {0};
+	int res = 0;
+
+	struct net_dev *client = net_dev_open(&wire_ops, "wire0", 1, 0, options->mtu, NULL);
+	struct net_dev *server = net_dev_open(&wire_ops, "wire0", 1, 0, options->mtu, NULL);
+	inet_pton(AF_INET, BENCH_WIRE_CLIENT_IP, &client->ipv4);
+	inet_pton(AF_INET, BENCH_WIRE_SERVER_IP, &server->ipv4);
+	ipv4_route_add(server->ipv4, 32, 0, client, 0);
+	ipv4_route_add(client->ipv4, 32, 0, server, 0);
+
+	net_dev_start(client, options->rx_batch);
+	net_dev_start(server, options->rx_batch);
+
+	struct udp_socket *sender = udp_socket_new(client, 0, 0);
+	struct udp_socket *receiver = udp_socket_new(server, 0, BENCH_UDP_PORT);
+
+	for(uint32_t i = 0; i < 32; i++)
+		msgs[i] = (struct udp_msg){ .remote_ip = server->ipv4, .remote_port = BENCH_UDP_PORT, .data = payload,
+									.len = BENCH_UDP_PAYLOAD };
+
+	// The first datagram waits for ARP
+	udp_send_batch(sender, msgs, 1);
+	uint64_t deadline = bench_now_ns() + BENCH_TIMEOUT_NS;
+	while(udp_recv_batch(receiver, &msgs[1], 1) == 0) {
+		if(bench_now_ns() > deadline) {
+			printf("udp: the first datagram never arrived\n");
+			res = -1;
+			goto out;
+		}
+		sched_yield();
+	}
+	udp_recv_done(&msgs[1], 1);
+	msgs[1].remote_ip = server->ipv4;
+	msgs[1].remote_port = BENCH_UDP_PORT;
+	msgs[1].data = payload;
+	msgs[1].len = BENCH_UDP_PAYLOAD;
+
+	for(uint32_t b = 0; b < sizeof(batches) / sizeof(batches[0]); b++) {
+		uint32_t batch = batches[b];
+		struct udp_msg received_msgs[32];
+		uint32_t sent = 0, received = 0;
+
+		uint64_t start = bench_now_ns();
+		deadline = start + BENCH_TIMEOUT_NS * 10;
+
+		while(received < BENCH_UDP_PACKETS) {
+			if(bench_now_ns() > deadline) {
+				printf("udp: batch %u timed out, %u of %u datagrams arrived, %" PRIu64 " frames dropped\n", batch,
+					   received, sent, wire_drops(client) + wire_drops(server));
+				res = -1;
+				goto out;
+			}
+
+			if(sent < BENCH_UDP_PACKETS && sent - received + batch <= BENCH_UDP_WINDOW)
+				sent += udp_send_batch(sender, msgs, min(batch, BENCH_UDP_PACKETS - sent));
+
+			uint32_t count = udp_recv_batch(receiver, received_msgs, batch);
+			udp_recv_done(received_msgs, count);
+			received += count;
+
+			if(count == 0 && sent - received + batch > BENCH_UDP_WINDOW)
+				sched_yield();
+		}
+
+		uint64_t elapsed = bench_now_ns() - start;
+		printf("udp: batch %2u, %u byte datagrams | %.0f datagrams/s | %.1f ns/datagram\n", batch,
+			   BENCH_UDP_PAYLOAD, BENCH_UDP_PACKETS * 1e9 / elapsed, (double)elapsed / BENCH_UDP_PACKETS);
+	}
+
+out:
+	udp_socket_close(sender);
+	udp_socket_close(receiver);
+	net_dev_stop(client);
+	net_dev_stop(server);
+	net_dev_close(client);
+	net_dev_close(server);
+	arp_free_cache();
+	ipv4_route_free();
+	udp_print_stats();
+
+	return res;
+}
+
+
+// Compares every checksum implementation with the reference, then times them on payloads from an IPv4 header up
+// to a TSO segment
+static int bench_checksum(const struct bench_options *options) {
+	static const uint32_t sizes[] = { 20, 40, 64, 128, 256, 576, 1460, 1500, 4096, 8960, 16384, 65536 };
+	uint32_t buffer_size = 65536 + 64;
+	uint8_t *buffer = malloc(buffer_size);
+	if(buffer == NULL) {
+		perror("could not allocate memory for benchmark");
+		exit(1);
+	}
+
+	srand48(1);
+	for(uint32_t i = 0; i < buffer_size; i++)
+		buffer[i] = (uint8_t)lrand48();
+
+	// Random sums in the range the stack passes in, pseudo headers and fragment sums
+	const struct checksum_impl *ref = &checksum_impls[0];
+	uint64_t mismatches = 0;
+	for(uint32_t impl = 1; impl < checksum_impl_count; impl++) {
+		if(!checksum_impls[impl].supported())
+			continue;
+
+		for(uint32_t len = 0; len <= BENCH_CHECKSUM_VERIFY_LEN; len++) {
+			for(uint32_t offset = 0; offset < 8; offset++) {
+				uint32_t sum = (uint32_t)lrand48() & 0x7ffff;
+				if(checksum_impls[impl].partial(buffer + offset, len, sum) != ref->partial(buffer + offset, len, sum))
+					mismatches++;
+			}
+		}
+
+		// All ones and all zeros are where ones' complement sums go wrong
+		for(uint32_t i = 0; i < 2; i++) {
+			uint8_t *edge = malloc(65536);
+			if(edge == NULL) {
+				perror("could not allocate memory for benchmark");
+				exit(1);
+			}
+			memset(edge, i ? 0xff : 0, 65536);
+			for(uint32_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+				if(checksum_impls[impl].partial(edge, sizes[s], 0) != ref->partial(edge, sizes[s], 0) ||
+				   checksum_impls[impl].partial(edge, sizes[s], 0xffff) != ref->partial(edge, sizes[s], 0xffff))
+					mismatches++;
+			}
+			free(edge);
+		}
+	}
+
+	if(mismatches) {
+		printf("checksum: %" PRIu64 " results differ from the reference\n", mismatches);
+		free(buffer);
+		return -1;
+	}
+	printf("checksum: all implementations match the reference, active: %s\n", checksum_impl_active()->name);
+
+	printf("%8s", "bytes");
+	for(uint32_t impl = 0; impl < checksum_impl_count; impl++) {
+		if(checksum_impls[impl].supported())
+			printf(" | %25s", checksum_impls[impl].name);
+	}
+	printf("\n");
+
+	volatile uint32_t sink = 0;
+	for(uint32_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		uint32_t size = sizes[s];
+		uint64_t rounds = BENCH_CHECKSUM_BYTES / size;
+		printf("%8u", size);
+
+		for(uint32_t impl = 0; impl < checksum_impl_count; impl++) {
+			if(!checksum_impls[impl].supported())
+				continue;
+
+			uint64_t start = bench_now_ns();
+			for(uint64_t i = 0; i < rounds; i++)
+				sink += checksum_impls[impl].partial(buffer, size, (uint32_t)i & 0xffff);
+			uint64_t elapsed = bench_now_ns() - start;
+
+			printf(" | %10.1f ns %6.2f GB/s", (double)elapsed / rounds, (double)rounds * size / elapsed);
+		}
+		printf("\n");
+	}
+
+	free(buffer);
+	return 0;
+}
+
+// What tcp_out_data() does with every segment: copy and sum in two passes, as it used to, against the fused copies
+static int bench_copy(const struct bench_options *options) {
+	static const uint32_t sizes[] = { 64, 536, 1460, 2048, 2920, 4096, 5840, 8960, 16384, 65536 };
+	const struct checksum_impl *ref = &checksum_impls[0];
+	const struct checksum_impl *active = checksum_impl_active();
+
+	uint8_t *src = malloc(BENCH_COPY_ARENA + 64);
+	uint8_t *dst = malloc(BENCH_COPY_ARENA + 64);
+	if(src == NULL || dst == NULL) {
+		perror("could not allocate memory for benchmark");
+		exit(1);
+	}
+
+	srand48(1);
+	for(uint32_t i = 0; i < BENCH_COPY_ARENA + 64; i++)
+		src[i] = (uint8_t)lrand48();
+	memset(dst, 0, BENCH_COPY_ARENA + 64);
+
+	// Same sum as the reference and the same bytes as memcpy(), at every alignment of both sides
+	uint64_t mismatches = 0;
+	for(uint32_t impl = 0; impl < checksum_impl_count; impl++) {
+		if(!checksum_impls[impl].supported())
+			continue;
+
+		for(uint32_t len = 0; len <= BENCH_CHECKSUM_VERIFY_LEN; len += 1 + len / 64) {
+			for(uint32_t offset = 0; offset < 8; offset++) {
+				uint32_t sum = (uint32_t)lrand48() & 0x7ffff;
+				uint8_t *out = dst + (offset * 3) % 8;
+				memset(out, 0, len + 8);
+
+				if(checksum_impls[impl].copy(out, src + offset, len, sum) != ref->partial(src + offset, len, sum) ||
+				   memcmp(out, src + offset, len) != 0 || out[len] != 0)
+					mismatches++;
+			}
+		}
+	}
+
+	if(mismatches) {
+		printf("copy: %" PRIu64 " results differ from memcpy() and the reference sum\n", mismatches);
+		free(src);
+		free(dst);
+		return -1;
+	}
+	printf("copy: all implementations match memcpy() and the reference sum, active: %s\n", active->name);
+
+	printf("%8s | %19s", "bytes", "two-pass");
+	for(uint32_t impl = 0; impl < checksum_impl_count; impl++) {
+		if(checksum_impls[impl].supported())
+			printf(" | %19s", checksum_impls[impl].name);
+	}
+	printf("\n");
+
+	volatile uint32_t sink = 0;
+	for(uint32_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		uint32_t size = sizes[s];
+		uint32_t slots = BENCH_COPY_ARENA / size;
+		uint64_t rounds = BENCH_CHECKSUM_BYTES / size;
+		printf("%8u", size);
+
+		// -1 is the two-pass copy with the active implementation
+		for(int32_t impl = -1; impl < (int32_t)checksum_impl_count; impl++) {
+			if(impl >= 0 && !checksum_impls[impl].supported())
+				continue;
+
+			uint64_t start = bench_now_ns();
+			for(uint64_t i = 0; i < rounds; i++) {
+				uint64_t offset = (i % slots) * size;
+				if(impl < 0) {
+					memcpy(dst + offset, src + offset, size);
+					sink += active->partial(dst + offset, size, 0);
+				}
+				else
+					sink += checksum_impls[impl].copy(dst + offset, src + offset, size, 0);
+			}
+			uint64_t elapsed = bench_now_ns() - start;
+
+			printf(" | %6.1f ns %6.2f GB/s", (double)elapsed / rounds, (double)rounds * size / elapsed);
+		}
+		printf("\n");
+	}
+
+	free(src);
+	free(dst);
+	return 0;
+}
+
+// Neighbor table lookups as ipv4_send_packet() does them, from a handful of neighbors to a full table
+static int bench_arp(const struct bench_options *options) {
+	static const uint32_t sizes[] = { 16, 256, 1024, 4096, ARP_TABLE_MAX_LOAD };
+	uint8_t mac[ARP_HWSIZE_ETHERNET] = { 0x02, 0, 0, 0, 0, 0 };
+	volatile uint32_t sink = 0;
+
+	for(uint32_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		uint32_t size = sizes[s];
+
+		// 10.x.y.z, consecutive like hosts on one segment
+		arp_free_cache();
+		for(uint32_t i = 0; i < size; i++) {
+			if(arp_add_entry_active(NULL, mac, htonl(0x0a000000 + i)) < 0) {
+				printf("arp: table full after %u entries\n", i);
+				return -1;
+			}
+		}
+
+		uint64_t start = bench_now_ns();
+		for(uint32_t i = 0; i < BENCH_ARP_LOOKUPS; i++)
+			sink += arp_lookup(ETH_P_IP, htonl(0x0a000000 + (i * 7919) % size), mac, NULL, NULL) ==
+					NEIGH_STATE_REACHABLE;
+		uint64_t hit_ns = bench_now_ns() - start;
+
+		start = bench_now_ns();
+		for(uint32_t i = 0; i < BENCH_ARP_LOOKUPS; i++)
+			sink += arp_lookup(ETH_P_IP, htonl(0x0b000000 + i), mac, NULL, NULL) == NEIGH_STATE_REACHABLE;
+		uint64_t miss_ns = bench_now_ns() - start;
+
+		printf("arp: %5u neighbors | hit %5.1f ns | miss %5.1f ns\n", size, (double)hit_ns / BENCH_ARP_LOOKUPS,
+			   (double)miss_ns / BENCH_ARP_LOOKUPS);
+	}
+
+	arp_free_cache();
+	return 0;
+}
+
+// Route lookups as a dst cache miss does them, from a default route alone to a full table of prefixes between /8
+// and /32. The trie bounds every lookup to four nodes, whatever the table holds.
+static int bench_route(const struct bench_options *options) {
+	static const uint32_t sizes[] = { 1, 16, 64, IPV4_ROUTE_MAX };
+	static struct net_dev dev = { .name = "bench0" };
+	struct ipv4_route route;
+	volatile uint32_t sink = 0;
+
+	srand48(1);
+	for(uint32_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		ipv4_route_free();
+		ipv4_route_add(0, 0, htonl(0x0a000001), &dev, 0);
+		for(uint32_t i = 1; i < sizes[s]; i++)
+			ipv4_route_add(htonl((uint32_t)lrand48()), (uint8_t)(8 + lrand48() % 25), 0, &dev, 0);
+
+		uint64_t start = bench_now_ns();
+		for(uint32_t i = 0; i < BENCH_ROUTE_LOOKUPS; i++)
+			sink += ipv4_route_lookup(htonl(i * 2654435761u), &route) == 0;
+		uint64_t elapsed = bench_now_ns() - start;
+
+		printf("route: %3u routes | %5.1f ns/lookup\n", sizes[s], (double)elapsed / BENCH_ROUTE_LOOKUPS);
+	}
+
+	ipv4_route_free();
+	return 0;
+}
+
+// Feeds a capture through the receive path as fast as the stack takes it, or at the pace it was captured. Frames
+// are addressed to the TAP device's IP, as in captures taken on tap0.
+static int bench_replay(const struct bench_options *options) {
+	if(options->replay_path == NULL) {
+		printf("replay: no capture file, please use -r\n");
+		return -1;
+	}
+
+	struct pcap_config config = {
+		.replay_path = options->replay_path,
+		.record_path = options->record_path,
+		.timed = options->timed,
+		.loops = options->loops,
+	};
+
+	struct net_dev *dev = net_dev_open(&pcap_ops, "pcap0", 1, 0, options->mtu, &config);
+	if(dev == NULL)
+		return -1;
+	inet_pton(AF_INET, TAP_DEVICE_IP, &dev->ipv4);
+	ipv4_route_add(0, 0, 0, dev, 0);  // replies go back out of the capture device
+
+	net_dev_start(dev, options->rx_batch);
+	while(!pcap_replay_done(dev))
+		usleep(1000);
+	net_dev_stop(dev);
+
+	pcap_print_stats(dev);
+	net_dev_print_stats(dev);
+	net_dev_close(dev);
+	arp_free_cache();
+	ipv4_route_free();
+
+	return 0;
+}
+
+
+static const struct bench benches[] = {
+	{ "wire", "ICMP echo latency and throughput between two stacks over an in-process wire", bench_wire },
+	{ "wire6", "the wire benchmark with ICMPv6 echoes, neighbors resolved with NDP", bench_wire6 },
+	{ "udp", "UDP datagrams/s between two stacks over an in-process wire, sent and read in batches", bench_udp },
+	{ "checksum", "checksum implementations checked against each other and timed from 20 B to 64 KB", bench_checksum },
+	{ "arp", "neighbor table lookups with up to thousands of entries", bench_arp },
+	{ "route", "longest prefix match route lookups with up to a full routing table", bench_route },
+	{ "copy", "fused copy+checksum of TCP payloads against memcpy() followed by a checksum pass", bench_copy },
+	{ "replay", "receive path throughput fed from a pcap/pcapng capture (-r), optionally recording TX (-w)",
+	  bench_replay },
+};
+
+int bench_run(const char *name, const struct bench_options *options) {
+	for(size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+		if(strcmp(benches[i].name, name) == 0)
+			return benches[i].run(options);
+	}
+
+	printf("unknown benchmark: %s\n", name);
+	bench_list();
+	return -1;
+}
+
+void bench_list() {
+	printf("Benchmarks:\n");
+	for(size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++)
+		printf("  %-12s %s\n", benches[i].name, benches[i].description);
+}
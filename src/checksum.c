@@ -0,0 +1,395 @@
+#include <string.h>
+
+// SSE2 is part of x86-64, AVX2 is checked for at runtime
+#ifdef __x86_64__
+#include <immintrin.h>
+#define CHECKSUM_X86
+#endif
+
+#define CHECKSUM_SIMD_MIN 64  // shorter data, IPv4 headers and such, is summed faster without setting up vectors
+#define CHECKSUM_COPY_FUSED_MAX 2048  // longer data is copied and summed faster in two passes, see -B copy
+
+#include "checksum.h"
+#include "utils.h"
+
+
+// Wide sums are kept modulo 2^64 - 1 by adding carries back in. 2^16 - 1 divides 2^64 - 1, so folding down to 16
+// bits gives what summing 16 bit words would, and a sum that was not 0 never becomes 0.
+static inline uint64_t checksum_add64(uint64_t sum, uint64_t value) {
+	sum += value;
+	return sum + (sum < value);
+}
+
+static inline uint32_t checksum_fold64(uint64_t sum) {
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffffffff) + (sum >> 32);
+
+	uint32_t sum32 = (uint32_t)sum;
+	sum32 = (sum32 >> 16) + (sum32 & 0xffff);
+	sum32 += sum32 >> 16;
+	return sum32 & 0xffff;
+}
+
+static inline uint64_t checksum_load64(const uint8_t *ptr) {
+	uint64_t value;
+	memcpy(&value, ptr, sizeof(value));
+	return value;
+}
+
+// Less than 8 bytes, or whatever the vector loops left over
+static inline uint64_t checksum_tail(const uint8_t *ptr, uint32_t len, uint64_t sum) {
+	while(len >= 8) {
+		sum = checksum_add64(sum, checksum_load64(ptr));
+		ptr += 8;
+		len -= 8;
+	}
+
+	if(len >= 4) {
+		uint32_t value;
+		memcpy(&value, ptr, sizeof(value));
+		sum = checksum_add64(sum, value);
+		ptr += 4;
+		len -= 4;
+	}
+
+	if(len >= 2) {
+		uint16_t value;
+		memcpy(&value, ptr, sizeof(value));
+		sum = checksum_add64(sum, value);
+		ptr += 2;
+		len -= 2;
+	}
+
+	// The odd byte goes where it would sit in a 16 bit word read from memory
+	if(len == 1) {
+		uint16_t odd_byte = 0;
+		*(uint8_t *)&odd_byte = *ptr;
+		sum = checksum_add64(sum, odd_byte);
+	}
+
+	return sum;
+}
+
+
+static int checksum_always() {
+	return 1;
+}
+
+// The original loop, one 16 bit word at a time
+static uint32_t checksum_partial_ref(const void *data, uint32_t len, uint32_t sum) {
+	// Credit: 	http://www.csee.usf.edu/~kchriste/tools/checksum.c
+	//			https://github.com/chobits/tapip
+	const uint16_t		*ptr = data;
+	uint16_t			odd_byte;
+
+	/*
+	 * Our algorithm is simple, using a 32-bit accumulator (sum),
+	 * we add sequential 16-bit words to it, and at the end, fold back
+	 * all the carry bits from the top 16 bits into the lower 16 bits.
+	 */
+	while (len > 1)  {
+		sum += *ptr++;
+		len -= 2;
+	}
+
+	/* mop up an odd byte, if necessary */
+	if (len == 1) {
+		odd_byte = 0;		/* make sure top half is zero */
+		*((uint8_t *) &odd_byte) = *(uint8_t *)ptr;   /* one byte only */
+		sum += odd_byte;
+	}
+
+	/*
+	 * Add back carry outs from top 16 bits to low 16 bits.
+	 */
+	sum  = (sum >> 16) + (sum & 0xffff);	/* add high-16 to low-16 */
+	sum += (sum >> 16);			/* add carry */
+	return sum & 0xffff;
+}
+
+// Two passes, what the fused copies are measured against
+static uint32_t checksum_copy_ref(void *dst, const void *src, uint32_t len, uint32_t sum) {
+	memcpy(dst, src, len);
+	return checksum_partial_ref(dst, len, sum);
+}
+
+// 32 bytes per round in 64 bit words, the carries of the adds are chained through one accumulator
+static uint32_t checksum_partial_scalar64(const void *data, uint32_t len, uint32_t sum) {
+	const uint8_t *ptr = data;
+	uint64_t sum64 = sum;
+
+	while(len >= 32) {
+		sum64 = checksum_add64(sum64, checksum_load64(ptr));
+		sum64 = checksum_add64(sum64, checksum_load64(ptr + 8));
+		sum64 = checksum_add64(sum64, checksum_load64(ptr + 16));
+		sum64 = checksum_add64(sum64, checksum_load64(ptr + 24));
+		ptr += 32;
+		len -= 32;
+	}
+
+	return checksum_fold64(checksum_tail(ptr, len, sum64));
+}
+
+// Every word is summed on its way through a register. The tail is copied first and summed from the destination,
+// which is in the cache by then.
+static uint32_t checksum_copy_scalar64(void *dst, const void *src, uint32_t len, uint32_t sum) {
+	uint8_t *out = dst;
+	const uint8_t *in = src;
+	uint64_t sum64 = sum;
+
+	while(len >= 32) {
+		uint64_t a = checksum_load64(in), b = checksum_load64(in + 8);
+		uint64_t c = checksum_load64(in + 16), d = checksum_load64(in + 24);
+		memcpy(out, &a, 8);
+		memcpy(out + 8, &b, 8);
+		memcpy(out + 16, &c, 8);
+		memcpy(out + 24, &d, 8);
+
+		sum64 = checksum_add64(sum64, a);
+		sum64 = checksum_add64(sum64, b);
+		sum64 = checksum_add64(sum64, c);
+		sum64 = checksum_add64(sum64, d);
+		in += 32;
+		out += 32;
+		len -= 32;
+	}
+
+	memcpy(out, in, len);
+	return checksum_fold64(checksum_tail(out, len, sum64));
+}
+
+
+#ifdef CHECKSUM_X86
+
+// 32 bit words are widened to 64 bit lanes, which take 2^32 adds before they could overflow
+static uint32_t checksum_partial_sse2(const void *data, uint32_t len, uint32_t sum) {
+	if(len < CHECKSUM_SIMD_MIN)
+		return checksum_partial_scalar64(data, len, sum);
+
+	const uint8_t *ptr = data;
+	__m128i zero = _mm_setzero_si128();
+	__m128i sum_lo = zero, sum_hi = zero;
+
+	while(len >= 64) {
+		__m128i a = _mm_loadu_si128((const __m128i *)ptr);
+		__m128i b = _mm_loadu_si128((const __m128i *)(ptr + 16));
+		__m128i c = _mm_loadu_si128((const __m128i *)(ptr + 32));
+		__m128i d = _mm_loadu_si128((const __m128i *)(ptr + 48));
+
+		sum_lo = _mm_add_epi64(sum_lo, _mm_unpacklo_epi32(a, zero));
+		sum_hi = _mm_add_epi64(sum_hi, _mm_unpackhi_epi32(a, zero));
+		sum_lo = _mm_add_epi64(sum_lo, _mm_unpacklo_epi32(b, zero));
+		sum_hi = _mm_add_epi64(sum_hi, _mm_unpackhi_epi32(b, zero));
+		sum_lo = _mm_add_epi64(sum_lo, _mm_unpacklo_epi32(c, zero));
+		sum_hi = _mm_add_epi64(sum_hi, _mm_unpackhi_epi32(c, zero));
+		sum_lo = _mm_add_epi64(sum_lo, _mm_unpacklo_epi32(d, zero));
+		sum_hi = _mm_add_epi64(sum_hi, _mm_unpackhi_epi32(d, zero));
+		ptr += 64;
+		len -= 64;
+	}
+
+	while(len >= 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)ptr);
+		sum_lo = _mm_add_epi64(sum_lo, _mm_unpacklo_epi32(a, zero));
+		sum_hi = _mm_add_epi64(sum_hi, _mm_unpackhi_epi32(a, zero));
+		ptr += 16;
+		len -= 16;
+	}
+
+	uint64_t lanes[2];
+	_mm_storeu_si128((__m128i *)lanes, _mm_add_epi64(sum_lo, sum_hi));
+
+	uint64_t sum64 = checksum_add64(sum, lanes[0]);
+	sum64 = checksum_add64(sum64, lanes[1]);
+	return checksum_fold64(checksum_tail(ptr, len, sum64));
+}
+
+static uint32_t checksum_copy_sse2(void *dst, const void *src, uint32_t len, uint32_t sum) {
+	if(len < CHECKSUM_SIMD_MIN)
+		return checksum_copy_scalar64(dst, src, len, sum);
+
+	uint8_t *out = dst;
+	const uint8_t *in = src;
+	__m128i zero = _mm_setzero_si128();
+	__m128i sum_lo = zero, sum_hi = zero;
+
+	while(len >= 64) {
+		__m128i a = _mm_loadu_si128((const __m128i *)in);
+		__m128i b = _mm_loadu_si128((const __m128i *)(in + 16));
+		__m128i c = _mm_loadu_si128((const __m128i *)(in + 32));
+		__m128i d = _mm_loadu_si128((const __m128i *)(in + 48));
+		_mm_storeu_si128((__m128i *)out, a);
+		_mm_storeu_si128((__m128i *)(out + 16), b);
+		_mm_storeu_si128((__m128i *)(out + 32), c);
+		_mm_storeu_si128((__m128i *)(out + 48), d);
+
+		sum_lo = _mm_add_epi64(sum_lo, _mm_unpacklo_epi32(a, zero));
+		sum_hi = _mm_add_epi64(sum_hi, _mm_unpackhi_epi32(a, zero));
+		sum_lo = _mm_add_epi64(sum_lo, _mm_unpacklo_epi32(b, zero));
+		sum_hi = _mm_add_epi64(sum_hi, _mm_unpackhi_epi32(b, zero));
+		sum_lo = _mm_add_epi64(sum_lo, _mm_unpacklo_epi32(c, zero));
+		sum_hi = _mm_add_epi64(sum_hi, _mm_unpackhi_epi32(c, zero));
+		sum_lo = _mm_add_epi64(sum_lo, _mm_unpacklo_epi32(d, zero));
+		sum_hi = _mm_add_epi64(sum_hi, _mm_unpackhi_epi32(d, zero));
+		in += 64;
+		out += 64;
+		len -= 64;
+	}
+
+	uint64_t lanes[2];
+	_mm_storeu_si128((__m128i *)lanes, _mm_add_epi64(sum_lo, sum_hi));
+
+	uint64_t sum64 = checksum_add64(sum, lanes[0]);
+	sum64 = checksum_add64(sum64, lanes[1]);
+	memcpy(out, in, len);
+	return checksum_fold64(checksum_tail(out, len, sum64));
+}
+
+__attribute__((target("avx2")))
+static uint32_t checksum_partial_avx2(const void *data, uint32_t len, uint32_t sum) {
+	if(len < CHECKSUM_SIMD_MIN)
+		return checksum_partial_scalar64(data, len, sum);
+
+	const uint8_t *ptr = data;
+	__m256i zero = _mm256_setzero_si256();
+	__m256i sum_lo = zero, sum_hi = zero;
+
+	while(len >= 128) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)ptr);
+		__m256i b = _mm256_loadu_si256((const __m256i *)(ptr + 32));
+		__m256i c = _mm256_loadu_si256((const __m256i *)(ptr + 64));
+		__m256i d = _mm256_loadu_si256((const __m256i *)(ptr + 96));
+
+		sum_lo = _mm256_add_epi64(sum_lo, _mm256_unpacklo_epi32(a, zero));
+		sum_hi = _mm256_add_epi64(sum_hi, _mm256_unpackhi_epi32(a, zero));
+		sum_lo = _mm256_add_epi64(sum_lo, _mm256_unpacklo_epi32(b, zero));
+		sum_hi = _mm256_add_epi64(sum_hi, _mm256_unpackhi_epi32(b, zero));
+		sum_lo = _mm256_add_epi64(sum_lo, _mm256_unpacklo_epi32(c, zero));
+		sum_hi = _mm256_add_epi64(sum_hi, _mm256_unpackhi_epi32(c, zero));
+		sum_lo = _mm256_add_epi64(sum_lo, _mm256_unpacklo_epi32(d, zero));
+		sum_hi = _mm256_add_epi64(sum_hi, _mm256_unpackhi_epi32(d, zero));
+		ptr += 128;
+		len -= 128;
+	}
+
+	while(len >= 32) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)ptr);
+		sum_lo = _mm256_add_epi64(sum_lo, _mm256_unpacklo_epi32(a, zero));
+		sum_hi = _mm256_add_epi64(sum_hi, _mm256_unpackhi_epi32(a, zero));
+		ptr += 32;
+		len -= 32;
+	}
+
+	uint64_t lanes[4];
+	_mm256_storeu_si256((__m256i *)lanes, _mm256_add_epi64(sum_lo, sum_hi));
+
+	uint64_t sum64 = sum;
+	for(int i = 0; i < 4; i++)
+		sum64 = checksum_add64(sum64, lanes[i]);
+	return checksum_fold64(checksum_tail(ptr, len, sum64));
+}
+
+__attribute__((target("avx2")))
+static uint32_t checksum_copy_avx2(void *dst, const void *src, uint32_t len, uint32_t sum) {
+	if(len < CHECKSUM_SIMD_MIN)
+		return checksum_copy_scalar64(dst, src, len, sum);
+
+	uint8_t *out = dst;
+	const uint8_t *in = src;
+	__m256i zero = _mm256_setzero_si256();
+	__m256i sum_lo = zero, sum_hi = zero;
+
+	while(len >= 128) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)in);
+		__m256i b = _mm256_loadu_si256((const __m256i *)(in + 32));
+		__m256i c = _mm256_loadu_si256((const __m256i *)(in + 64));
+		__m256i d = _mm256_loadu_si256((const __m256i *)(in + 96));
+		_mm256_storeu_si256((__m256i *)out, a);
+		_mm256_storeu_si256((__m256i *)(out + 32), b);
+		_mm256_storeu_si256((__m256i *)(out + 64), c);
+		_mm256_storeu_si256((__m256i *)(out + 96), d);
+
+		sum_lo = _mm256_add_epi64(sum_lo, _mm256_unpacklo_epi32(a, zero));
+		sum_hi = _mm256_add_epi64(sum_hi, _mm256_unpackhi_epi32(a, zero));
+		sum_lo = _mm256_add_epi64(sum_lo, _mm256_unpacklo_epi32(b, zero));
+		sum_hi = _mm256_add_epi64(sum_hi, _mm256_unpackhi_epi32(b, zero));
+		sum_lo = _mm256_add_epi64(sum_lo, _mm256_unpacklo_epi32(c, zero));
+		sum_hi = _mm256_add_epi64(sum_hi, _mm256_unpackhi_epi32(c, zero));
+		sum_lo = _mm256_add_epi64(sum_lo, _mm256_unpacklo_epi32(d, zero));
+		sum_hi = _mm256_add_epi64(sum_hi, _mm256_unpackhi_epi32(d, zero));
+		in += 128;
+		out += 128;
+		len -= 128;
+	}
+
+	while(len >= 32) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)in);
+		_mm256_storeu_si256((__m256i *)out, a);
+		sum_lo = _mm256_add_epi64(sum_lo, _mm256_unpacklo_epi32(a, zero));
+		sum_hi = _mm256_add_epi64(sum_hi, _mm256_unpackhi_epi32(a, zero));
+		in += 32;
+		out += 32;
+		len -= 32;
+	}
+
+	uint64_t lanes[4];
+	_mm256_storeu_si256((__m256i *)lanes, _mm256_add_epi64(sum_lo, sum_hi));
+
+	uint64_t sum64 = sum;
+	for(int i = 0; i < 4; i++)
+		sum64 = checksum_add64(sum64, lanes[i]);
+	memcpy(out, in, len);
+	return checksum_fold64(checksum_tail(out, len, sum64));
+}
+
+static int checksum_avx2_supported() {
+	__builtin_cpu_init();  // constructors may run before the CPU model is known
+	return __builtin_cpu_supports("avx2");
+}
+
+#endif
+
+
+// Fastest last, the first supported one from the end is picked at startup
+const struct checksum_impl checksum_impls[] = {
+	{ "reference", checksum_partial_ref, checksum_copy_ref, checksum_always },
+	{ "scalar64", checksum_partial_scalar64, checksum_copy_scalar64, checksum_always },
+#ifdef CHECKSUM_X86
+	{ "sse2", checksum_partial_sse2, checksum_copy_sse2, checksum_always },
+	{ "avx2", checksum_partial_avx2, checksum_copy_avx2, checksum_avx2_supported },
+#endif
+};
+
+const uint32_t checksum_impl_count = sizeof(checksum_impls) / sizeof(checksum_impls[0]);
+
+static const struct checksum_impl *checksum_active = &checksum_impls[0];
+
+__attribute__((constructor))
+static void checksum_select() {
+	for(uint32_t i = checksum_impl_count; i > 0; i--) {
+		if(checksum_impls[i - 1].supported()) {
+			checksum_active = &checksum_impls[i - 1];
+			return;
+		}
+	}
+}
+
+const struct checksum_impl *checksum_impl_active() {
+	return checksum_active;
+}
+
+// Ones' complement sum of the data added to sum, folded to 16 bits but not inverted
+uint32_t checksum_partial(const void *data, uint32_t len, uint32_t sum) {
+	return checksum_active->partial(data, len, sum);
+}
+
+// Copies the data and returns checksum_partial() of it. Up to a couple of KB every byte is read once, past that
+// memcpy() and a pass over the copy still in cache win.
+uint32_t checksum_copy_partial(void *dst, const void *src, uint32_t len, uint32_t sum) {
+	if(len > CHECKSUM_COPY_FUSED_MAX) {
+		memcpy(dst, src, len);
+		return checksum_active->partial(dst, len, sum);
+	}
+
+	return checksum_active->copy(dst, src, len, sum);
+}
@@ -3,37 +3,149 @@
 #include <malloc.h>
 #include <linux/if_ether.h>
 #include "../include/eth.h"
+#include "utils.h"
 
 
-uint16_t eth_read(struct net_dev *dev, struct eth_frame *frame) {
-	ssize_t bytes = read(dev->sock_fd, frame, ETHERNET_MAX_PAYLOAD_SIZE);
-	if (bytes == -1) {
-		perror("failed to read data");
-		return 0;
-	}
-
-	frame->eth_type = ntohs(frame->eth_type);
+// Hands the queued frames to the driver in one batch, tx_lock has to be held so batches go out in order
+static void eth_tx_queue_flush(struct net_queue *queue) {
+	if(queue->tx_count == 0)
+		return;
 
-	return (uint16_t)bytes;
+	struct net_dev *dev = queue->dev;
+	dev->ops->tx_batch(dev, queue->index, queue->tx_queue, queue->tx_count);
+	net_batch_stats_add(&queue->tx_stats, queue->tx_count);
+	queue->tx_count = 0;
 }
 
-
+// Consumes the caller's reference to the buffer. The frame is queued and goes out at the next eth_flush() of its
+// queue: the queue worker flushes after every RX batch, timers and senders outside of it flush when they are done.
 int eth_write(uint8_t dest_mac[], uint16_t eth_type, struct sk_buff *buffer) {
-	struct eth_frame *frame = eth_frame_from_skb(buffer);
+	// A shared buffer may already carry an Ethernet header from an earlier send
+	skb_pull(buffer, (uint32_t)(buffer->network_header - buffer->data));
+
+	struct eth_frame *frame = (struct eth_frame *)skb_push(buffer, ETHERNET_HEADER_SIZE);
+	skb_reset_mac_header(buffer);
+
 	memcpy(frame->mac_dest, dest_mac, sizeof(frame->mac_dest));
 	memcpy(frame->mac_source, buffer->dev->hwaddr, sizeof(frame->mac_source));
 	frame->eth_type = htons(eth_type);
 
-	ssize_t bytes = write(buffer->dev->sock_fd, buffer->data, (size_t)(buffer->size));
-	if(!buffer->manual_free)
+	// Queued until the next flush point, or until the queue is full
+	struct net_queue *queue = &buffer->dev->queues[buffer->queue_mapping];
+	uint32_t len = buffer->len;
+
+	pthread_mutex_lock(&queue->tx_lock);
+	queue->tx_queue[queue->tx_count++] = buffer;
+	if(queue->tx_count == NET_TX_QUEUE_SIZE)
+		eth_tx_queue_flush(queue);
+	pthread_mutex_unlock(&queue->tx_lock);
+
+	return (int)len;
+}
+
+
+static struct sk_buff *eth_rx_ring_alloc(struct eth_rx_ring *ring) {
+	struct sk_buff *buffer = skb_alloc(ring->reserve + ring->buffer_size);
+	buffer->rx_ring = ring;
+	return buffer;
+}
+
+void eth_rx_ring_init(struct eth_rx_ring *ring, struct net_dev *dev) {
+	uint32_t frame_size = dev->features & NETIF_F_GRO ? ETH_RX_LARGE_SIZE : eth_max_frame_size(dev);
+
+	ring->buffer_size = dev->vnet_hdr_len + frame_size;
+	ring->reserve = (4 - (dev->vnet_hdr_len + ETHERNET_HEADER_SIZE) % 4) % 4;
+
+	for(int i = 0; i < ETH_RX_RING_SIZE; i++)
+		ring->slots[i] = eth_rx_ring_alloc(ring);
+
+	ring->head = 0;
+	ring->tail = ETH_RX_RING_SIZE;
+}
+
+// Returns an empty buffer ready for eth_read()
+struct sk_buff *eth_rx_ring_get(struct eth_rx_ring *ring, struct net_dev *dev, uint16_t queue) {
+	struct sk_buff *buffer;
+	if(ring->head == ring->tail)
+		buffer = eth_rx_ring_alloc(ring);  // every buffer is in flight
+	else
+		buffer = ring->slots[ring->head++ % ETH_RX_RING_SIZE];
+
+	buffer->dev = dev;
+	buffer->queue_mapping = queue;
+	skb_reserve(buffer, ring->reserve);
+
+	return buffer;
+}
+
+void eth_rx_ring_recycle(struct eth_rx_ring *ring, struct sk_buff *buffer) {
+	if(buffer->rx_ring != ring) {
+		// Driver memory, an oversized frame or one handed over by a peer
+		skb_free(buffer);
+		return;
+	}
+
+	if(skb_shared(buffer) || ring->tail - ring->head == ETH_RX_RING_SIZE) {
+		// Someone kept it, drop only our reference
 		skb_free(buffer);
+		if(ring->tail - ring->head == ETH_RX_RING_SIZE)
+			return;
 
-	if(bytes == -1) {
-		perror("failed to write data");
-		return 0;
+		buffer = eth_rx_ring_alloc(ring);
 	}
+	else {
+		// Payload attached on the way up is dropped with the frame
+		for(int i = 0; i < buffer->nr_frags; i++)
+			skb_page_put(buffer->frags[i].page);
+		buffer->nr_frags = 0;
+		buffer->data_len = 0;
 
-	return (int)bytes;
+		buffer->data = buffer->head;
+		buffer->tail = buffer->head;
+		buffer->len = 0;
+		buffer->payload_size = 0;
+		buffer->ip_summed = CHECKSUM_NONE;
+		buffer->gso_size = 0;
+		buffer->mac_header = NULL;
+		buffer->network_header = NULL;
+		buffer->transport_header = NULL;
+	}
+
+	ring->slots[ring->tail++ % ETH_RX_RING_SIZE] = buffer;
 }
 
+void eth_rx_ring_free(struct eth_rx_ring *ring) {
+	while(ring->head != ring->tail)
+		skb_free(ring->slots[ring->head++ % ETH_RX_RING_SIZE]);
+}
+
+
+// Receives a batch of frames from the queue, data is left at the Ethernet header
+uint32_t eth_read_batch(struct net_dev *dev, uint16_t queue, struct eth_rx_ring *ring, struct sk_buff **buffers,
+						uint32_t max) {
+	uint32_t count = dev->ops->rx_batch(dev, queue, ring, buffers, max);
 
+	for(uint32_t i = 0; i < count; i++) {
+		skb_reset_mac_header(buffers[i]);
+
+		struct eth_frame *frame = eth_frame_from_skb(buffers[i]);
+		frame->eth_type = ntohs(frame->eth_type);
+	}
+
+	if(count > 0)
+		net_batch_stats_add(&dev->queues[queue].rx_stats, count);
+
+	return count;
+}
+
+// Sends the frames queued by eth_write(), then whatever the driver queued itself
+void eth_flush(struct net_dev *dev, uint16_t queue) {
+	struct net_queue *net_queue = &dev->queues[queue];
+
+	pthread_mutex_lock(&net_queue->tx_lock);
+	eth_tx_queue_flush(net_queue);
+	pthread_mutex_unlock(&net_queue->tx_lock);
+
+	if(dev->ops->flush != NULL)
+		dev->ops->flush(dev, queue);
+}
@@ -3,37 +3,120 @@
 
 #include "icmp.h"
 #include "utils.h"
+#include "ipv4_pmtu.h"
+#include "tcp.h"
 
 
-int icmp_process_packet(struct net_dev *dev, struct eth_frame *frame) {
-	struct ipv4_packet *ip_packet = (struct ipv4_packet *)frame->payload;
-	struct icmp_v4_packet *icmp_packet = (struct icmp_v4_packet *)(ip_packet->data + ((ip_packet->header_len*4) - sizeof(struct ipv4_packet)));
+static void (*icmp_echo_reply_handler)(struct net_dev *dev, uint16_t id, uint16_t seq);
 
-	uint32_t icmp_packet_size = ip_packet->len - (ip_packet->header_len * (uint16_t) 4);
+// RFC 1191 plateaus, for routers that don't report the next hop MTU
+static const uint16_t icmp_mtu_plateaus[] = { 32000, 17914, 8166, 4352, 2002, 1492, 1006, 508, 296, 68 };
 
-	uint16_t checksum_orig = icmp_packet->checksum;
-	icmp_packet->checksum = 0;
-	uint16_t checksum_actual = checksum((uint16_t *)icmp_packet, icmp_packet_size, 0);
 
-	if(checksum_orig != checksum_actual) {
-		fprintf(stderr, "wrong checksum for ICMP packet");
+// A router dropped one of our DF packets, the path to its destination takes at most the MTU it reports. A TCP
+// socket's MSS shrinks right away and the dropped segments are sent again cut to the new size. netdev steers these
+// errors to the quoted flow's queue, so the socket is touched under its own lock.
+static int icmp_frag_needed(struct net_dev *dev, struct icmp_v4_packet *icmp_packet, uint32_t icmp_packet_size) {
+	if(icmp_packet_size < sizeof(struct icmp_v4_packet) + 4 + IP_HEADER_SIZE)
 		return -1;
+
+	struct ipv4_packet *quoted = (struct ipv4_packet *)(icmp_packet->data + 4);
+	uint32_t quoted_header_len = quoted->header_len * 4u;
+	if(quoted->version != 4 || quoted_header_len < IP_HEADER_SIZE || quoted->source_ip != dev->ipv4 ||
+	   icmp_packet_size < sizeof(struct icmp_v4_packet) + 4 + quoted_header_len)
+		return -1;
+
+	uint16_t mtu;
+	memcpy(&mtu, &icmp_packet->data[2], sizeof(mtu));
+	mtu = ntohs(mtu);
+
+	// Old routers leave the field 0, guess the next plateau below the packet that didn't fit
+	uint16_t quoted_len = ntohs(quoted->len);
+	if(mtu == 0 || mtu >= quoted_len) {
+		mtu = icmp_mtu_plateaus[sizeof(icmp_mtu_plateaus) / sizeof(icmp_mtu_plateaus[0]) - 1];
+		for(uint32_t i = 0; i < sizeof(icmp_mtu_plateaus) / sizeof(icmp_mtu_plateaus[0]); i++) {
+			if(icmp_mtu_plateaus[i] < quoted_len) {
+				mtu = icmp_mtu_plateaus[i];
+				break;
+			}
+		}
+	}
+
+	// A quoted TCP segment has to be one we sent that isn't acknowledged yet, or anyone could shrink the path MTU to
+	// the host (RFC 5927 section 7.2). Other protocols have nothing to check against.
+	struct tcp_socket *tcp_socket = NULL;
+	if(quoted->protocol == IPPROTO_TCP) {
+		// Ports and sequence number, the 8 bytes every router quotes
+		if(icmp_packet_size < sizeof(struct icmp_v4_packet) + 4 + quoted_header_len + 8)
+			return 0;
+
+		uint16_t ports[2];
+		uint32_t seq;
+		memcpy(ports, (uint8_t *)quoted + quoted_header_len, sizeof(ports));
+		memcpy(&seq, (uint8_t *)quoted + quoted_header_len + 4, sizeof(seq));
+		seq = ntohl(seq);
+
+		struct sock_addr source = sock_addr_ipv4(quoted->source_ip), dest = sock_addr_ipv4(quoted->dest_ip);
+		tcp_socket = tcp_socket_get(dev, AF_INET, &source, &dest, ntohs(ports[0]), ntohs(ports[1]));
+		if(tcp_socket == NULL)
+			return 0;
+
+		if((int32_t)(seq - tcp_socket->snd_una) < 0 || (int32_t)(seq - tcp_socket->snd_nxt) >= 0)
+			return 0;
+	}
+
+	ipv4_pmtu_update(quoted->dest_ip, mtu);
+	if(tcp_socket == NULL)
+		return 0;
+
+	mtu = max(mtu, (uint16_t)IPV4_PMTU_MIN);
+	uint16_t mss = (uint16_t)(mtu - IP_HEADER_SIZE - TCP_HEADER_SIZE);
+	if(mss < tcp_socket->mss) {
+		tcp_socket->mss = mss;
+		tcp_out_queue_send(tcp_socket);
+	}
+
+	return 0;
+}
+
+
+int icmp_process_packet(struct net_dev *dev, struct sk_buff *in_buffer) {
+	struct ipv4_packet *ip_packet = ipv4_packet_from_skb(in_buffer);
+	struct icmp_v4_packet *icmp_packet = icmp_v4_packet_from_skb(in_buffer);
+
+	uint32_t icmp_packet_size = ip_packet->len - (ip_packet->header_len * (uint16_t) 4);
+
+	if(in_buffer->ip_summed != CHECKSUM_UNNECESSARY) {
+		uint16_t checksum_orig = icmp_packet->checksum;
+		icmp_packet->checksum = 0;
+		uint16_t checksum_actual = checksum((uint16_t *)icmp_packet, icmp_packet_size, 0);
+
+		if(checksum_orig != checksum_actual) {
+			fprintf(stderr, "wrong checksum for ICMP packet");
+			return -1;
+		}
 	}
 
-	struct sock socket;
-	socket.source_ip = ip_packet->dest_ip;
-	socket.dest_ip = ip_packet->source_ip;
+	struct sock socket = {0};  // no dst cache, the socket lives for one packet
+	socket.family = AF_INET;
+	socket.source = sock_addr_ipv4(ip_packet->dest_ip);
+	socket.dest = sock_addr_ipv4(ip_packet->source_ip);
 	socket.protocol = IPPROTO_ICMP;
 	socket.dev = dev;
+	socket.queue = in_buffer->queue_mapping;
 
 	if(icmp_packet->type == ICMP_ECHO) {
 		// Echo request
-		struct sk_buff *buffer = skb_alloc(ETHERNET_HEADER_SIZE + ip_packet->len);
-		struct icmp_v4_packet *icmp_packet_response = icmp_v4_packet_from_skb(buffer);
+		struct sk_buff *buffer = skb_alloc(SKB_MAX_HEADER + icmp_packet_size);
+		skb_reserve(buffer, SKB_MAX_HEADER);
+		skb_reset_transport_header(buffer);
+
+		struct icmp_v4_packet *icmp_packet_response = (struct icmp_v4_packet *)skb_put(buffer, icmp_packet_size);
 
 		// Echo reply
 		icmp_packet_response->type = ICMP_ECHOREPLY;
 		icmp_packet_response->code = 0;
+		icmp_packet_response->checksum = 0;
 
 		// Copy the data
 		memcpy(icmp_packet_response->data, icmp_packet->data, icmp_packet_size - sizeof(struct icmp_v4_packet));
@@ -43,7 +126,17 @@ int icmp_process_packet(struct net_dev *dev, struct eth_frame *frame) {
 
 		return ipv4_send_packet(&socket, buffer);
 	}
+	else if(icmp_packet->type == ICMP_ECHOREPLY) {
+		struct icmp_v4_echo *echo = (struct icmp_v4_echo *)icmp_packet->data;
+
+		if(icmp_echo_reply_handler != NULL && icmp_packet_size >= sizeof(struct icmp_v4_packet) + sizeof(*echo))
+			icmp_echo_reply_handler(dev, ntohs(echo->id), ntohs(echo->seq));
+		return 0;
+	}
 	else if(icmp_packet->type == ICMP_DEST_UNREACH) {
+		if(icmp_packet->code == ICMP_FRAG_NEEDED)
+			return icmp_frag_needed(dev, icmp_packet, icmp_packet_size);
+
 		fprintf(stderr, "ICMP - destination unreachable, code: %d", icmp_packet->code);
 		return -1;
 	}
@@ -55,4 +148,39 @@ int icmp_process_packet(struct net_dev *dev, struct eth_frame *frame) {
 	}
 
 	return -1;
-}
\ No newline at end of file
+}
+// Sends an echo request with data_len bytes of payload, the caller holds the lock of the queue
+int icmp_send_echo(struct net_dev *dev, uint16_t queue, uint32_t dest_ip, uint16_t id, uint16_t seq, uint32_t data_len) {
+	uint32_t icmp_packet_size = (uint32_t)(sizeof(struct icmp_v4_packet) + sizeof(struct icmp_v4_echo)) + data_len;
+
+	struct sock socket = {0};  // no dst cache, the socket lives for one packet
+	socket.family = AF_INET;
+	socket.source = sock_addr_ipv4(dev->ipv4);
+	socket.dest = sock_addr_ipv4(dest_ip);
+	socket.protocol = IPPROTO_ICMP;
+	socket.dev = dev;
+	socket.queue = queue;
+
+	struct sk_buff *buffer = skb_alloc(SKB_MAX_HEADER + icmp_packet_size);
+	skb_reserve(buffer, SKB_MAX_HEADER);
+	skb_reset_transport_header(buffer);
+
+	struct icmp_v4_packet *icmp_packet = (struct icmp_v4_packet *)skb_put(buffer, icmp_packet_size);
+	icmp_packet->type = ICMP_ECHO;
+	icmp_packet->code = 0;
+	icmp_packet->checksum = 0;
+
+	struct icmp_v4_echo *echo = (struct icmp_v4_echo *)icmp_packet->data;
+	echo->id = htons(id);
+	echo->seq = htons(seq);
+	memset(echo->data, 0, data_len);
+
+	icmp_packet->checksum = checksum_fold(checksum_partial(icmp_packet, icmp_packet_size, 0));
+
+	return ipv4_send_packet(&socket, buffer);
+}
+
+// Called for every echo reply received, from the worker of the queue it arrived on
+void icmp_set_echo_reply_handler(void (*handler)(struct net_dev *dev, uint16_t id, uint16_t seq)) {
+	icmp_echo_reply_handler = handler;
+}
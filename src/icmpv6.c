@@ -0,0 +1,244 @@
+#include <netinet/icmp6.h>
+#include <linux/if_ether.h>
+#include <memory.h>
+
+#include "icmpv6.h"
+#include "ndp.h"
+#include "utils.h"
+
+
+static void (*icmpv6_echo_reply_handler)(struct net_dev *dev, uint16_t id, uint16_t seq);
+
+static const uint8_t icmpv6_all_nodes[16] = { 0xff, 0x02, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x01 };
+static const uint8_t icmpv6_unspecified[16];
+
+
+// Checksum over the IPv6 pseudo header and the message
+static uint16_t icmpv6_checksum(struct icmpv6_packet *icmp_packet, uint32_t len, const uint8_t *source_ip,
+								const uint8_t *dest_ip) {
+	uint32_t sum = ipv6_pseudo_header_sum(IPPROTO_ICMPV6, len, source_ip, dest_ip);
+	return checksum_fold(checksum_partial(icmp_packet, len, sum));
+}
+
+// MAC of a link-layer address option of the type, NULL if there is none or the options are malformed
+static const uint8_t *icmpv6_find_lladdr(const uint8_t *options, uint32_t len, uint8_t type) {
+	while(len >= 2) {
+		uint32_t option_len = options[1] * 8u;
+		if(option_len == 0 || option_len > len)
+			return NULL;
+
+		if(options[0] == type && option_len >= sizeof(struct icmpv6_option_lladdr))
+			return ((const struct icmpv6_option_lladdr *)options)->mac;
+
+		options += option_len;
+		len -= option_len;
+	}
+
+	return NULL;
+}
+
+// Neighbor discovery message carrying our MAC in a link-layer address option, sent straight to dest_mac
+static int icmpv6_send_neighbor(struct net_dev *dev, uint16_t queue, uint8_t type, uint32_t flags,
+								const uint8_t *target, const uint8_t *source_ip, const uint8_t *dest_ip,
+								const uint8_t *dest_mac) {
+	uint32_t icmp_packet_size = (uint32_t)(sizeof(struct icmpv6_packet) + sizeof(struct icmpv6_neighbor) +
+										   sizeof(struct icmpv6_option_lladdr));
+
+	struct sk_buff *buffer = skb_alloc(SKB_MAX_HEADER + icmp_packet_size);
+	skb_reserve(buffer, SKB_MAX_HEADER);
+	skb_reset_transport_header(buffer);
+	buffer->dev = dev;
+	buffer->queue_mapping = queue;
+
+	struct icmpv6_packet *icmp_packet = (struct icmpv6_packet *)skb_put(buffer, icmp_packet_size);
+	icmp_packet->type = type;
+	icmp_packet->code = 0;
+	icmp_packet->checksum = 0;
+
+	struct icmpv6_neighbor *neighbor = (struct icmpv6_neighbor *)icmp_packet->data;
+	neighbor->flags = flags;
+	memcpy(neighbor->target, target, sizeof(neighbor->target));
+
+	struct icmpv6_option_lladdr *option = (struct icmpv6_option_lladdr *)neighbor->options;
+	option->type = type == ND_NEIGHBOR_SOLICIT ? ND_OPT_SOURCE_LINKADDR : ND_OPT_TARGET_LINKADDR;
+	option->len = 1;
+	memcpy(option->mac, dev->hwaddr, sizeof(option->mac));
+
+	icmp_packet->checksum = icmpv6_checksum(icmp_packet, icmp_packet_size, source_ip, dest_ip);
+
+	ipv6_push_header(buffer, source_ip, dest_ip, IPPROTO_ICMPV6, ICMPV6_ND_HOP_LIMIT);
+
+	uint8_t mac[6];
+	memcpy(mac, dest_mac, sizeof(mac));
+	return eth_write(mac, ETH_P_IPV6, buffer);
+}
+
+// Asks the target's solicited-node group for its MAC, from the caller's device queue
+int icmpv6_send_neighbor_solicit(struct net_dev *dev, uint16_t queue, const uint8_t *target) {
+	uint8_t source_ip[16], dest_ip[16], dest_mac[6];
+	ipv6_addr_source(dev, target, source_ip);
+	ipv6_addr_solicited_node(target, dest_ip);
+	ipv6_multicast_mac(dest_ip, dest_mac);
+
+	return icmpv6_send_neighbor(dev, queue, ND_NEIGHBOR_SOLICIT, 0, target, source_ip, dest_ip, dest_mac);
+}
+
+// Learns the sender and answers for our own addresses. A solicitation from the unspecified address is duplicate
+// address detection, its answer goes to all nodes.
+static int icmpv6_neighbor_solicit(struct net_dev *dev, struct sk_buff *in_buffer, uint32_t icmp_packet_size) {
+	struct ipv6_packet *ip_packet = ipv6_packet_from_skb(in_buffer);
+	struct icmpv6_packet *icmp_packet = icmpv6_packet_from_skb(in_buffer);
+	struct icmpv6_neighbor *solicit = (struct icmpv6_neighbor *)icmp_packet->data;
+
+	if(icmp_packet_size < sizeof(struct icmpv6_packet) + sizeof(struct icmpv6_neighbor) ||
+	   ipv6_addr_is_multicast(solicit->target) || !ipv6_addr_is_local(dev, solicit->target))
+		return -1;
+
+	const uint8_t *source_mac = icmpv6_find_lladdr(solicit->options, icmp_packet_size - sizeof(struct icmpv6_packet) -
+												   sizeof(struct icmpv6_neighbor), ND_OPT_SOURCE_LINKADDR);
+	int dad = memcmp(ip_packet->source_ip, icmpv6_unspecified, 16) == 0;
+
+	if(dad) {
+		uint8_t dest_mac[6];
+		ipv6_multicast_mac(icmpv6_all_nodes, dest_mac);
+		return icmpv6_send_neighbor(dev, in_buffer->queue_mapping, ND_NEIGHBOR_ADVERT, ND_NA_FLAG_OVERRIDE,
+									solicit->target, solicit->target, icmpv6_all_nodes, dest_mac);
+	}
+
+	// Unicast solicitations checking on a neighbor may leave the option out, the frame still tells where it came from
+	if(source_mac != NULL)
+		ndp_update(dev, ip_packet->source_ip, source_mac, NDP_UPDATE_CREATE | NDP_UPDATE_OVERRIDE);
+	else
+		source_mac = eth_frame_from_skb(in_buffer)->mac_source;
+
+	return icmpv6_send_neighbor(dev, in_buffer->queue_mapping, ND_NEIGHBOR_ADVERT,
+								ND_NA_FLAG_SOLICITED | ND_NA_FLAG_OVERRIDE, solicit->target, solicit->target,
+								ip_packet->source_ip, source_mac);
+}
+
+static int icmpv6_neighbor_advert(struct net_dev *dev, struct sk_buff *in_buffer, uint32_t icmp_packet_size) {
+	struct icmpv6_packet *icmp_packet = icmpv6_packet_from_skb(in_buffer);
+	struct icmpv6_neighbor *advert = (struct icmpv6_neighbor *)icmp_packet->data;
+
+	if(icmp_packet_size < sizeof(struct icmpv6_packet) + sizeof(struct icmpv6_neighbor) ||
+	   ipv6_addr_is_multicast(advert->target))
+		return -1;
+
+	// Answers to solicitations sent to the neighbor itself may leave the option out
+	const uint8_t *target_mac = icmpv6_find_lladdr(advert->options, icmp_packet_size - sizeof(struct icmpv6_packet) -
+												   sizeof(struct icmpv6_neighbor), ND_OPT_TARGET_LINKADDR);
+	uint8_t flags = 0;
+	if(advert->flags & ND_NA_FLAG_SOLICITED)
+		flags |= NDP_UPDATE_SOLICITED;
+	if(advert->flags & ND_NA_FLAG_OVERRIDE)
+		flags |= NDP_UPDATE_OVERRIDE;
+
+	return ndp_update(dev, advert->target, target_mac, flags);
+}
+
+
+int icmpv6_process_packet(struct net_dev *dev, struct sk_buff *in_buffer) {
+	struct ipv6_packet *ip_packet = ipv6_packet_from_skb(in_buffer);
+	struct icmpv6_packet *icmp_packet = icmpv6_packet_from_skb(in_buffer);
+
+	uint32_t icmp_packet_size = ip_packet->payload_len;
+	if(icmp_packet_size < sizeof(struct icmpv6_packet) || icmp_packet_size > skb_headlen(in_buffer))
+		return -1;
+
+	if(in_buffer->ip_summed != CHECKSUM_UNNECESSARY &&
+	   icmpv6_checksum(icmp_packet, icmp_packet_size, ip_packet->source_ip, ip_packet->dest_ip) != 0) {
+		fprintf(stderr, "wrong checksum for ICMPv6 packet");
+		return -1;
+	}
+
+	// Neighbor discovery only trusts messages that can't have been forwarded
+	if(icmp_packet->type == ND_NEIGHBOR_SOLICIT || icmp_packet->type == ND_NEIGHBOR_ADVERT) {
+		if(ip_packet->hop_limit != ICMPV6_ND_HOP_LIMIT || icmp_packet->code != 0)
+			return -1;
+
+		if(icmp_packet->type == ND_NEIGHBOR_SOLICIT)
+			return icmpv6_neighbor_solicit(dev, in_buffer, icmp_packet_size);
+		return icmpv6_neighbor_advert(dev, in_buffer, icmp_packet_size);
+	}
+
+	if(icmp_packet->type == ICMP6_ECHO_REQUEST) {
+		struct sock socket = {0};  // no dst cache, the socket lives for one packet
+		socket.family = AF_INET6;
+		socket.dest = sock_addr_ipv6(ip_packet->source_ip);
+		socket.protocol = IPPROTO_ICMPV6;
+		socket.dev = dev;
+		socket.queue = in_buffer->queue_mapping;
+
+		// Requests to a group are answered from one of our own addresses
+		if(ipv6_addr_is_multicast(ip_packet->dest_ip))
+			ipv6_addr_source(dev, ip_packet->source_ip, socket.source.ipv6);
+		else
+			socket.source = sock_addr_ipv6(ip_packet->dest_ip);
+
+		struct sk_buff *buffer = skb_alloc(SKB_MAX_HEADER + icmp_packet_size);
+		skb_reserve(buffer, SKB_MAX_HEADER);
+		skb_reset_transport_header(buffer);
+
+		struct icmpv6_packet *icmp_packet_response = (struct icmpv6_packet *)skb_put(buffer, icmp_packet_size);
+		icmp_packet_response->type = ICMP6_ECHO_REPLY;
+		icmp_packet_response->code = 0;
+		icmp_packet_response->checksum = 0;
+
+		memcpy(icmp_packet_response->data, icmp_packet->data, icmp_packet_size - sizeof(struct icmpv6_packet));
+
+		icmp_packet_response->checksum = icmpv6_checksum(icmp_packet_response, icmp_packet_size,
+														 socket.source.ipv6, socket.dest.ipv6);
+
+		return ipv6_send_packet(&socket, buffer);
+	}
+	else if(icmp_packet->type == ICMP6_ECHO_REPLY) {
+		struct icmpv6_echo *echo = (struct icmpv6_echo *)icmp_packet->data;
+
+		if(icmpv6_echo_reply_handler != NULL && icmp_packet_size >= sizeof(struct icmpv6_packet) + sizeof(*echo))
+			icmpv6_echo_reply_handler(dev, ntohs(echo->id), ntohs(echo->seq));
+		return 0;
+	}
+
+	// Router discovery and multicast listener messages are expected on any link, they are ignored without a word
+	if(icmp_packet->type < ND_ROUTER_SOLICIT || icmp_packet->type > ND_REDIRECT)
+		fprintf(stderr, "unknown ICMPv6 type: %d\n", icmp_packet->type);
+
+	return -1;
+}
+
+// Sends an echo request with data_len bytes of payload, the caller holds the lock of the queue
+int icmpv6_send_echo(struct net_dev *dev, uint16_t queue, const uint8_t *dest_ip, uint16_t id, uint16_t seq,
+					 uint32_t data_len) {
+	uint32_t icmp_packet_size = (uint32_t)(sizeof(struct icmpv6_packet) + sizeof(struct icmpv6_echo)) + data_len;
+
+	struct sock socket = {0};  // no dst cache, the socket lives for one packet
+	socket.family = AF_INET6;
+	ipv6_addr_source(dev, dest_ip, socket.source.ipv6);
+	socket.dest = sock_addr_ipv6(dest_ip);
+	socket.protocol = IPPROTO_ICMPV6;
+	socket.dev = dev;
+	socket.queue = queue;
+
+	struct sk_buff *buffer = skb_alloc(SKB_MAX_HEADER + icmp_packet_size);
+	skb_reserve(buffer, SKB_MAX_HEADER);
+	skb_reset_transport_header(buffer);
+
+	struct icmpv6_packet *icmp_packet = (struct icmpv6_packet *)skb_put(buffer, icmp_packet_size);
+	icmp_packet->type = ICMP6_ECHO_REQUEST;
+	icmp_packet->code = 0;
+	icmp_packet->checksum = 0;
+
+	struct icmpv6_echo *echo = (struct icmpv6_echo *)icmp_packet->data;
+	echo->id = htons(id);
+	echo->seq = htons(seq);
+	memset(echo->data, 0, data_len);
+
+	icmp_packet->checksum = icmpv6_checksum(icmp_packet, icmp_packet_size, socket.source.ipv6, socket.dest.ipv6);
+
+	return ipv6_send_packet(&socket, buffer);
+}
+
+// Called for every echo reply received, from the worker of the queue it arrived on
+void icmpv6_set_echo_reply_handler(void (*handler)(struct net_dev *dev, uint16_t id, uint16_t seq)) {
+	icmpv6_echo_reply_handler = handler;
+}
@@ -1,54 +1,191 @@
 #include <linux/if_ether.h>
 #include <string.h>
+#include <stdatomic.h>
+#include <unistd.h>
 #include "netinet/in.h"
 
 #include "ipv4.h"
 #include "icmp.h"
 #include "tcp.h"
+#include "udp.h"
 #include "utils.h"
 #include "arp.h"
+#include "ipv4_frag.h"
+#include "ipv4_pmtu.h"
+#include "ipv4_route.h"
 
 
-int ipv4_send_packet(struct sock *sock, struct sk_buff *buffer) {
+extern int RUNNING;
+
+// A dst cache holds while the routing table, the next hop's ARP entry and the path MTU slot of the destination are
+// as they were when it was filled in
+static inline int ipv4_dst_valid(struct sock *sock, uint32_t route_generation) {
+	struct dst_cache *dst = &sock->dst;
+
+	return dst->neigh != NULL && dst->route_generation == route_generation &&
+		   neigh_entry_unchanged(dst->neigh, dst->neigh_seq) && ipv4_pmtu_unchanged(sock->dest.ipv4, dst->pmtu_seq);
+}
+
+// Sends the finished packet to the next hop, the route is only looked at without a valid dst cache. A send that
+// finds the neighbor resolved completes the cache with its ARP slot.
+static int ipv4_output(struct sock *sock, const struct ipv4_route *route, int cached, struct sk_buff *buffer) {
+	struct dst_cache *dst = &sock->dst;
+
+	buffer->dev = dst->dev;
+	buffer->queue_mapping = (uint16_t)(sock->queue % dst->dev->queue_count);
+
+	if(cached)
+		return eth_write(dst->mac, ETH_P_IP, buffer);
+
+	uint32_t next_hop = route->gateway ? route->gateway : sock->dest.ipv4;
+	if(arp_lookup(ETH_P_IP, next_hop, dst->mac, &dst->neigh, &dst->neigh_seq) == NEIGH_STATE_REACHABLE)
+		return eth_write(dst->mac, ETH_P_IP, buffer);
+
+	return arp_resolve(dst->dev, next_hop, buffer);
+}
+
+// Cuts a datagram that doesn't fit the path into fragments of at most mtu bytes. Every fragment but the last carries
+// a multiple of 8 payload bytes, copied out of the linear part and frags alike. Consumes the caller's reference.
+static int ipv4_fragment(struct sock *sock, const struct ipv4_route *route, int cached, uint16_t mtu,
+						 struct sk_buff *buffer) {
 	struct ipv4_packet *ip_packet = ipv4_packet_from_skb(buffer);
+	uint32_t payload_len = buffer->len - IP_HEADER_SIZE;
+	uint32_t max_len = (uint32_t)(mtu - IP_HEADER_SIZE) & ~7u;
+	uint16_t id = (uint16_t)lrand48();
+	int res = 0;
+
+	for(uint32_t offset = 0; offset < payload_len; offset += max_len) {
+		uint32_t len = min(payload_len - offset, max_len);
+
+		struct sk_buff *fragment = skb_alloc(SKB_MAX_HEADER + len);
+		skb_reserve(fragment, SKB_MAX_HEADER);
+		skb_copy_bits(buffer, IP_HEADER_SIZE + offset, skb_put(fragment, len), len);
+
+		struct ipv4_packet *fragment_packet = (struct ipv4_packet *)skb_push(fragment, IP_HEADER_SIZE);
+		skb_reset_network_header(fragment);
+		memcpy(fragment_packet, ip_packet, IP_HEADER_SIZE);
+
+		fragment_packet->id = id;
+		fragment_packet->len = htons((uint16_t)(IP_HEADER_SIZE + len));
+		fragment_packet->fragment_offset = htons((uint16_t)(offset / 8 | (offset + len < payload_len ? IP_FLAG_MF : 0)));
+		fragment_packet->checksum = 0;
+		fragment_packet->checksum = checksum_fold(checksum_partial(fragment_packet, IP_HEADER_SIZE, 0));
+
+		if(ipv4_output(sock, route, cached, fragment) < 0)
+			res = -1;
+	}
+
+	skb_free(buffer);
+	return res;
+}
 
-	uint16_t packet_size = (uint16_t)(buffer->size - ETHERNET_HEADER_SIZE);
+// Consumes the caller's reference to the buffer. With a valid dst cache the packet goes out without touching ARP,
+// and the header checksum only has to add the length and ID to the cached sum of the other fields. TCP sizes its
+// segments to the path and sets DF to learn about a smaller one, except on a path locked at IPV4_PMTU_MIN where
+// routers are left to fragment. Everything else is fragmented here if needed.
+int ipv4_send_packet(struct sock *sock, struct sk_buff *buffer) {
+	struct dst_cache *dst = &sock->dst;
+	uint32_t route_generation = ipv4_route_generation();
+	int cached = ipv4_dst_valid(sock, route_generation);
+
+	struct ipv4_route route;
+	if(!cached && ipv4_route_lookup(sock->dest.ipv4, &route) < 0) {
+		skb_free(buffer);
+		return -1;  // no route to the host
+	}
+
+	// Everything but the neighbor is filled in on a miss, ipv4_output() adds it once it is resolved. The route's
+	// generation was read before the lookup and the path MTU's seq along with it, so a change in between
+	// invalidates the cache right away.
+	if(!cached) {
+		uint8_t locked;
+		dst->neigh = NULL;
+		dst->route_generation = route_generation;
+		dst->dev = route.dev;
+		dst->mtu = ipv4_pmtu_get(sock->dest.ipv4, route.dev->mtu, &dst->pmtu_seq, &locked);
+		dst->df = sock->protocol == IPPROTO_TCP && !locked;
+	}
+
+	struct ipv4_packet *ip_packet = (struct ipv4_packet *)skb_push(buffer, IP_HEADER_SIZE);
+	skb_reset_network_header(buffer);
+	uint16_t packet_size = (uint16_t)buffer->len;
 
 	ip_packet->version = 4;
 	ip_packet->protocol = sock->protocol;
-	ip_packet->id = (uint16_t)lrand48();  // TODO: do better than this
-	ip_packet->len = htons(packet_size);
+	ip_packet->id = 0;
+	ip_packet->len = 0;
 	ip_packet->header_len = (uint8_t)(IP_HEADER_SIZE >> 2);
-	ip_packet->fragment_offset = htons(16384);
+	ip_packet->fragment_offset = dst->df ? htons(IP_FLAG_DF) : 0;
 	ip_packet->tos = 0;
 	ip_packet->ttl = IP_DEFAULT_TTL;
 
-	ip_packet->source_ip = sock->source_ip;
-	ip_packet->dest_ip = sock->dest_ip;
-
+	ip_packet->source_ip = sock->source.ipv4;
+	ip_packet->dest_ip = sock->dest.ipv4;
 	ip_packet->checksum = 0;
-	ip_packet->checksum = checksum((uint16_t *) ip_packet, IP_HEADER_SIZE, 0);
 
-	buffer->dev = sock->dev;
+	if(!cached)
+		dst->header_sum = checksum_partial(ip_packet, IP_HEADER_SIZE, 0);
 
-	struct arp_entry *arp_entry = arp_get_entry(ETH_P_IP, sock->dest_ip);
-	if(arp_entry == NULL) {
-		arp_entry = arp_send_request(sock->dev, sock->dest_ip);
-		arp_add_to_buffer(arp_entry, buffer);
-		return -1;
+	if(packet_size > dst->mtu && sock->protocol != IPPROTO_TCP && buffer->gso_size == 0)
+		return ipv4_fragment(sock, &route, cached, dst->mtu, buffer);
+
+	ip_packet->id = (uint16_t)lrand48();  // TODO: do better than this
+	ip_packet->len = htons(packet_size);
+	ip_packet->checksum = checksum_fold(dst->header_sum + ip_packet->id + ip_packet->len);
+
+	return ipv4_output(sock, &route, cached, buffer);
+}
+
+// Runs the expiry of reassembly queues and learned path MTUs, neither needs to be more precise than a second
+void *ipv4_timer(void *args) {
+	while(RUNNING) {
+		ipv4_frag_expire();
+		ipv4_pmtu_expire();
+		usleep(IPV4_TIMER_INTERVAL * 1000);
 	}
-	else if(arp_entry->state == ARP_ENTRY_STATE_WAITING) {
-		arp_add_to_buffer(arp_entry, buffer);
-		return -1;
+
+	skb_pool_flush_local();
+	return NULL;
+}
+
+
+
+// Hands a whole datagram to the protocol above
+static int ipv4_deliver(struct net_dev *dev, struct sk_buff *buffer) {
+	struct ipv4_packet *ip_packet = ipv4_packet_from_skb(buffer);
+
+	skb_pull(buffer, (uint32_t)(ip_packet->header_len * 4));
+	skb_reset_transport_header(buffer);
+
+	if(ip_packet->protocol == IPPROTO_ICMP) {
+		icmp_process_packet(dev, buffer);
+	}
+	else if(ip_packet->protocol == IPPROTO_TCP) {
+		tcp_in(buffer);
 	}
-	else
-		return eth_write(arp_entry->mac, ETH_P_IP, buffer);
+	else if(ip_packet->protocol == IPPROTO_UDP) {
+		udp_in(buffer);
+	}
+	else {
+		fprintf(stderr, "unknown IPv4 protocol encountered: %d\n", ip_packet->protocol);
+	}
+
+	return 0;
 }
 
+int ipv4_process_packet(struct net_dev *dev, struct sk_buff *buffer) {
+	struct ipv4_packet *ip_packet = ipv4_packet_from_skb(buffer);
 
+	if(skb_headlen(buffer) < IP_HEADER_SIZE)
+		return -1;
 
-int ipv4_process_packet(struct net_dev *dev, struct eth_frame *frame) {
-	struct ipv4_packet *ip_packet = (struct ipv4_packet *)frame->payload;
+	// Reassembly and the layers above trust both lengths from here on. The header has to be in the linear part, and
+	// Ethernet padding behind the datagram is cut off.
+	uint32_t header_len = (uint32_t)ip_packet->header_len * 4;
+	uint32_t len = ntohs(ip_packet->len);
+	if(header_len < IP_HEADER_SIZE || header_len > len || header_len > skb_headlen(buffer) || len > buffer->len)
+		return -1;
+	skb_trim(buffer, len);
 
 	uint16_t checksum_orig = ip_packet->checksum;
 	ip_packet->checksum = 0;
@@ -63,24 +200,30 @@ int ipv4_process_packet(struct net_dev *dev, struct eth_frame *frame) {
 	ip_packet->fragment_offset = ntohs(ip_packet->fragment_offset);
 	ip_packet->checksum = checksum_orig;
 
-	if(ip_packet->fragment_offset & IP_FLAG_MF) {
-		fprintf(stderr, "received fragmented ipv4 packet (unsupported yet)\n");
-		return -1;
-	}
+	if(ip_packet->fragment_offset & (IP_FLAG_MF | IPV4_FRAG_OFFSET_MASK)) {
+		if(skb_headlen(buffer) < len)
+			return -1;  // reassembly copies fragments out of the linear part
 
-	if(ip_packet->protocol == IPPROTO_ICMP) {
-		icmp_process_packet(dev, frame);
-	}
-	else if(ip_packet->protocol == IPPROTO_TCP) {
-		tcp_in(frame);
-	}
-	else if(ip_packet->protocol == IPPROTO_UDP) {
-		return -1;
-	}
-	else {
-		fprintf(stderr, "unknown IPv4 protocol encountered: %d\n", ip_packet->protocol);
+		struct sk_buff *datagram = ipv4_frag_add(dev, buffer);
+		if(datagram == NULL)
+			return 0;  // waiting for the rest, or dropped
+
+		// The fragments were handled on the fragment queue, the datagram belongs to its flow's queue. No other lock is
+		// taken while holding a queue's, so nesting under the fragment queue's is safe.
+		struct net_queue *queue = net_dev_ipv4_queue(dev, ipv4_packet_from_skb(datagram), skb_headlen(datagram));
+		if(queue == &dev->queues[NET_DEV_FRAG_QUEUE])
+			queue = NULL;
+
+		if(queue != NULL)
+			pthread_mutex_lock(&queue->lock);
+		int res = ipv4_deliver(dev, datagram);
+		if(queue != NULL)
+			pthread_mutex_unlock(&queue->lock);
+
+		skb_free(datagram);
+		return res;
 	}
 
-	return 0;
+	return ipv4_deliver(dev, buffer);
 }
 
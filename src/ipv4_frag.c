@@ -0,0 +1,252 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "ipv4_frag.h"
+#include "ipv4.h"
+#include "utils.h"
+
+
+// Queues come from a fixed pool, so a datagram in two fragments is reassembled without a single allocation
+static struct ipv4_frag_queue ipv4_frag_pool[IPV4_FRAG_QUEUES];
+static struct ipv4_frag_queue *ipv4_frag_unused;
+static int ipv4_frag_pool_ready;
+
+static struct ipv4_frag_queue *ipv4_frag_hash[IPV4_FRAG_HASH_SIZE];
+static LIST_HEAD(ipv4_frag_queues);
+static uint32_t ipv4_frag_mem;
+static struct ipv4_frag_stats ipv4_frag_stats;
+static pthread_mutex_t ipv4_frag_mutex = PTHREAD_MUTEX_INITIALIZER;  // fragments may arrive on any queue
+
+
+static uint32_t ipv4_frag_time() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint32_t)((uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000);
+}
+
+static inline uint32_t ipv4_frag_bucket(uint32_t source_ip, uint32_t dest_ip, uint16_t id, uint8_t protocol) {
+	uint32_t hash = source_ip ^ dest_ip ^ ((uint32_t)id << 16 | protocol);
+	hash *= 0x9e3779b1;  // golden ratio, spreads the bits
+
+	return (hash >> 16) % IPV4_FRAG_HASH_SIZE;
+}
+
+// Unhashes the queue, drops its fragments and puts it back into the pool. Caller holds ipv4_frag_mutex.
+static void ipv4_frag_queue_drop(struct ipv4_frag_queue *queue) {
+	struct ipv4_frag_queue **link = &ipv4_frag_hash[ipv4_frag_bucket(queue->source_ip, queue->dest_ip, queue->id,
+																	  queue->protocol)];
+	while(*link != queue)
+		link = &(*link)->hash_next;
+	*link = queue->hash_next;
+
+	list_del(&queue->list);
+
+	for(uint8_t i = 0; i < queue->count; i++)
+		skb_free(queue->frags[i].buffer);
+	if(queue->frags != queue->inline_frags)
+		free(queue->frags);
+
+	ipv4_frag_mem -= queue->mem;
+
+	queue->hash_next = ipv4_frag_unused;
+	ipv4_frag_unused = queue;
+}
+
+// Drops the datagram that has been waiting the longest. Caller holds ipv4_frag_mutex.
+static void ipv4_frag_evict_oldest() {
+	ipv4_frag_queue_drop(list_first_entry(&ipv4_frag_queues, struct ipv4_frag_queue, list));
+	ipv4_frag_stats.evicted++;
+}
+
+// Caller holds ipv4_frag_mutex
+static struct ipv4_frag_queue *ipv4_frag_queue_get(struct ipv4_packet *ip_packet) {
+	uint32_t bucket = ipv4_frag_bucket(ip_packet->source_ip, ip_packet->dest_ip, ip_packet->id, ip_packet->protocol);
+
+	for(struct ipv4_frag_queue *queue = ipv4_frag_hash[bucket]; queue != NULL; queue = queue->hash_next) {
+		if(queue->source_ip == ip_packet->source_ip && queue->dest_ip == ip_packet->dest_ip &&
+		   queue->id == ip_packet->id && queue->protocol == ip_packet->protocol)
+			return queue;
+	}
+
+	if(!ipv4_frag_pool_ready) {
+		for(uint32_t i = 0; i < IPV4_FRAG_QUEUES; i++) {
+			ipv4_frag_pool[i].hash_next = ipv4_frag_unused;
+			ipv4_frag_unused = &ipv4_frag_pool[i];
+		}
+		ipv4_frag_pool_ready = 1;
+	}
+
+	if(ipv4_frag_unused == NULL)
+		ipv4_frag_evict_oldest();
+
+	struct ipv4_frag_queue *queue = ipv4_frag_unused;
+	ipv4_frag_unused = queue->hash_next;
+
+	queue->source_ip = ip_packet->source_ip;
+	queue->dest_ip = ip_packet->dest_ip;
+	queue->id = ip_packet->id;
+	queue->protocol = ip_packet->protocol;
+	queue->expires = ipv4_frag_time() + IPV4_FRAG_TIMEOUT;
+	queue->total_len = 0;
+	queue->received = 0;
+	queue->mem = 0;
+	queue->count = 0;
+	queue->capacity = IPV4_FRAG_INLINE;
+	queue->frags = queue->inline_frags;
+
+	queue->hash_next = ipv4_frag_hash[bucket];
+	ipv4_frag_hash[bucket] = queue;
+	list_add_tail(&queue->list, &ipv4_frag_queues);
+
+	return queue;
+}
+
+// Copies the fragments behind the first one's header, the one copy reassembly makes. Caller holds ipv4_frag_mutex.
+static struct sk_buff *ipv4_frag_build(struct ipv4_frag_queue *queue) {
+	struct sk_buff *first = queue->frags[0].buffer;
+	struct ipv4_packet *first_packet = ipv4_packet_from_skb(first);
+	uint16_t header_len = (uint16_t)(first_packet->header_len * 4);
+
+	struct sk_buff *buffer = skb_alloc(header_len + queue->total_len);
+	uint8_t *data = skb_put(buffer, header_len + queue->total_len);
+	skb_reset_network_header(buffer);
+
+	memcpy(data, first_packet, header_len);
+	for(uint8_t i = 0; i < queue->count; i++)
+		memcpy(data + header_len + queue->frags[i].offset, queue->frags[i].data, queue->frags[i].len);
+
+	// Header fields stay in host order, as ipv4_process_packet() left them in the first fragment
+	struct ipv4_packet *ip_packet = (struct ipv4_packet *)data;
+	ip_packet->len = (uint16_t)(header_len + queue->total_len);
+	ip_packet->fragment_offset = 0;
+
+	buffer->dev = first->dev;
+	buffer->queue_mapping = first->queue_mapping;
+	return buffer;
+}
+
+// Takes a fragment whose header ipv4_process_packet() converted to host order, the caller keeps its reference to the
+// buffer. Returns the whole datagram once the last hole is filled, the caller frees it.
+struct sk_buff *ipv4_frag_add(struct net_dev *dev, struct sk_buff *buffer) {
+	struct ipv4_packet *ip_packet = ipv4_packet_from_skb(buffer);
+	uint16_t header_len = (uint16_t)(ip_packet->header_len * 4);
+	uint32_t offset = (uint32_t)(ip_packet->fragment_offset & IPV4_FRAG_OFFSET_MASK) * 8;
+	int last = !(ip_packet->fragment_offset & IP_FLAG_MF);
+
+	pthread_mutex_lock(&ipv4_frag_mutex);
+	ipv4_frag_stats.fragments++;
+
+	// Every fragment but the last carries a multiple of 8 bytes, and nothing may end past 64 KB
+	uint32_t len = ip_packet->len > header_len ? ip_packet->len - header_len : 0;
+	if(len == 0 || (!last && (len & 7)) || header_len + offset + len > 65535) {
+		ipv4_frag_stats.invalid++;
+		pthread_mutex_unlock(&ipv4_frag_mutex);
+		return NULL;
+	}
+
+	struct ipv4_frag_queue *queue = ipv4_frag_queue_get(ip_packet);
+	uint8_t pos = 0;
+	while(pos < queue->count && queue->frags[pos].offset < offset)
+		pos++;
+
+	if(pos < queue->count && queue->frags[pos].offset == offset && queue->frags[pos].len == len) {
+		ipv4_frag_stats.duplicates++;
+		pthread_mutex_unlock(&ipv4_frag_mutex);
+		return NULL;
+	}
+
+	// Overlaps, a second end, or data past the end, are dropped along with the whole datagram
+	struct ipv4_frag *prev = pos > 0 ? &queue->frags[pos - 1] : NULL;
+	struct ipv4_frag *next = pos < queue->count ? &queue->frags[pos] : NULL;
+	uint32_t end = queue->count ? queue->frags[queue->count - 1].offset + queue->frags[queue->count - 1].len : 0;
+	if((prev != NULL && prev->offset + prev->len > offset) || (next != NULL && offset + len > next->offset) ||
+	   (last && (queue->total_len || end > offset + len)) || (queue->total_len && offset + len > queue->total_len) ||
+	   queue->count == IPV4_FRAG_MAX) {
+		ipv4_frag_stats.invalid++;
+		ipv4_frag_queue_drop(queue);
+		pthread_mutex_unlock(&ipv4_frag_mutex);
+		return NULL;
+	}
+
+	if(queue->count == queue->capacity) {
+		uint8_t capacity = (uint8_t)min(queue->capacity * 2, IPV4_FRAG_MAX);
+		struct ipv4_frag *frags = malloc(capacity * sizeof(struct ipv4_frag));
+		if(frags == NULL) {
+			perror("could not allocate memory for IPv4 fragments");
+			exit(1);
+		}
+
+		memcpy(frags, queue->frags, queue->count * sizeof(struct ipv4_frag));
+		if(queue->frags != queue->inline_frags)
+			free(queue->frags);
+		queue->frags = frags;
+		queue->capacity = capacity;
+	}
+
+	struct sk_buff *kept = skb_keep(buffer);
+	memmove(&queue->frags[pos + 1], &queue->frags[pos], (queue->count - pos) * sizeof(struct ipv4_frag));
+	queue->frags[pos].buffer = kept;
+	queue->frags[pos].data = kept->network_header + header_len;
+	queue->frags[pos].offset = (uint16_t)offset;
+	queue->frags[pos].len = (uint16_t)len;
+	queue->count++;
+
+	if(last)
+		queue->total_len = offset + len;
+	queue->received += len;
+
+	uint32_t mem = (uint32_t)(sizeof(struct sk_buff) + (kept->end - kept->head));
+	queue->mem += mem;
+	ipv4_frag_mem += mem;
+
+	struct sk_buff *datagram = NULL;
+	if(queue->total_len && queue->received == queue->total_len) {
+		datagram = ipv4_frag_build(queue);
+		ipv4_frag_queue_drop(queue);
+		ipv4_frag_stats.reassembled++;
+	}
+
+	while(ipv4_frag_mem > IPV4_FRAG_MEM_MAX)
+		ipv4_frag_evict_oldest();
+
+	pthread_mutex_unlock(&ipv4_frag_mutex);
+	return datagram;
+}
+
+// Drops datagrams that didn't complete in time. They are queued in the order they started and all get the same
+// timeout, so the expired ones are at the front.
+void ipv4_frag_expire() {
+	pthread_mutex_lock(&ipv4_frag_mutex);
+	uint32_t now = ipv4_frag_time();
+
+	while(!list_empty(&ipv4_frag_queues)) {
+		struct ipv4_frag_queue *queue = list_first_entry(&ipv4_frag_queues, struct ipv4_frag_queue, list);
+		if((int32_t)(now - queue->expires) < 0)
+			break;
+
+		ipv4_frag_queue_drop(queue);
+		ipv4_frag_stats.timeouts++;
+	}
+
+	pthread_mutex_unlock(&ipv4_frag_mutex);
+}
+
+void ipv4_frag_print_stats() {
+	pthread_mutex_lock(&ipv4_frag_mutex);
+	printf("IPv4 reassembly: fragments %" PRIu64 " | reassembled %" PRIu64 " | timeouts %" PRIu64 " | evicted %"
+		   PRIu64 " | invalid %" PRIu64 " | duplicates %" PRIu64 "\n", ipv4_frag_stats.fragments,
+		   ipv4_frag_stats.reassembled, ipv4_frag_stats.timeouts, ipv4_frag_stats.evicted, ipv4_frag_stats.invalid,
+		   ipv4_frag_stats.duplicates);
+	pthread_mutex_unlock(&ipv4_frag_mutex);
+}
+
+void ipv4_frag_free() {
+	pthread_mutex_lock(&ipv4_frag_mutex);
+	while(!list_empty(&ipv4_frag_queues))
+		ipv4_frag_queue_drop(list_first_entry(&ipv4_frag_queues, struct ipv4_frag_queue, list));
+	pthread_mutex_unlock(&ipv4_frag_mutex);
+}
@@ -0,0 +1,92 @@
+#include <time.h>
+#include <pthread.h>
+
+#include "ipv4_pmtu.h"
+
+
+// Direct mapped, a path whose MTU was pushed out is learned again from the next error
+static struct ipv4_pmtu_entry ipv4_pmtu_cache[IPV4_PMTU_SIZE];
+static pthread_mutex_t ipv4_pmtu_mutex = PTHREAD_MUTEX_INITIALIZER;  // only taken when a dst cache is filled in
+
+
+static uint32_t ipv4_pmtu_time() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint32_t)((uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000);
+}
+
+static inline struct ipv4_pmtu_entry *ipv4_pmtu_slot(uint32_t dest_ip) {
+	return &ipv4_pmtu_cache[(dest_ip * 0x9e3779b1) >> 24];  // golden ratio, the top bits depend on every byte
+}
+
+// Caller holds ipv4_pmtu_mutex
+static inline void ipv4_pmtu_changed_locked(struct ipv4_pmtu_entry *entry) {
+	atomic_store_explicit(&entry->seq, atomic_load_explicit(&entry->seq, memory_order_relaxed) + 1,
+						  memory_order_release);
+}
+
+// MTU of the path to dest_ip, the device's unless an error told us about a smaller one. Unless they are NULL, seq
+// is set to the slot's for ipv4_pmtu_unchanged() and locked to whether the path is locked at IPV4_PMTU_MIN.
+uint16_t ipv4_pmtu_get(uint32_t dest_ip, uint16_t dev_mtu, uint32_t *seq, uint8_t *locked) {
+	struct ipv4_pmtu_entry *entry = ipv4_pmtu_slot(dest_ip);
+	uint16_t mtu = dev_mtu;
+	uint8_t path_locked = 0;
+
+	pthread_mutex_lock(&ipv4_pmtu_mutex);
+	if(entry->dest_ip == dest_ip && entry->mtu < mtu) {
+		mtu = entry->mtu;
+		path_locked = entry->locked;
+	}
+	if(seq != NULL)
+		*seq = atomic_load_explicit(&entry->seq, memory_order_relaxed);
+	pthread_mutex_unlock(&ipv4_pmtu_mutex);
+
+	if(locked != NULL)
+		*locked = path_locked;
+
+	return mtu;
+}
+
+// Whether the MTU ipv4_pmtu_get() returned along with seq still holds. Slots are shared, so a change for another
+// destination hashing to the same one counts too.
+int ipv4_pmtu_unchanged(uint32_t dest_ip, uint32_t seq) {
+	return atomic_load_explicit(&ipv4_pmtu_slot(dest_ip)->seq, memory_order_acquire) == seq;
+}
+
+// Only ever lowers the MTU, raising it again is left to expiry. A report below IPV4_PMTU_MIN isn't believed, the
+// path is locked at the minimum instead like Linux does. Sockets to the slot pick it up on their next send.
+void ipv4_pmtu_update(uint32_t dest_ip, uint16_t mtu) {
+	struct ipv4_pmtu_entry *entry = ipv4_pmtu_slot(dest_ip);
+	uint8_t locked = mtu < IPV4_PMTU_MIN;
+
+	if(locked)
+		mtu = IPV4_PMTU_MIN;
+
+	pthread_mutex_lock(&ipv4_pmtu_mutex);
+	if(entry->dest_ip == dest_ip && (entry->mtu < mtu || (entry->mtu == mtu && entry->locked >= locked))) {
+		pthread_mutex_unlock(&ipv4_pmtu_mutex);
+		return;
+	}
+
+	entry->dest_ip = dest_ip;
+	entry->mtu = mtu;
+	entry->locked = locked;
+	entry->expires = ipv4_pmtu_time() + IPV4_PMTU_EXPIRES;
+	ipv4_pmtu_changed_locked(entry);
+	pthread_mutex_unlock(&ipv4_pmtu_mutex);
+}
+
+// Forgets MTUs learned too long ago, so a path that grew again is used at its full size
+void ipv4_pmtu_expire() {
+	uint32_t now = ipv4_pmtu_time();
+
+	pthread_mutex_lock(&ipv4_pmtu_mutex);
+	for(uint32_t i = 0; i < IPV4_PMTU_SIZE; i++) {
+		struct ipv4_pmtu_entry *entry = &ipv4_pmtu_cache[i];
+		if(entry->dest_ip != 0 && (int32_t)(now - entry->expires) >= 0) {
+			entry->dest_ip = 0;
+			ipv4_pmtu_changed_locked(entry);
+		}
+	}
+	pthread_mutex_unlock(&ipv4_pmtu_mutex);
+}
@@ -0,0 +1,199 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+
+#include "ipv4_route.h"
+#include "ipv4.h"
+
+
+// Sorted by prefix length, so rebuilding the trie in order lets longer prefixes overwrite the shorter ones they
+// are nested in
+static struct ipv4_route ipv4_routes[IPV4_ROUTE_MAX];
+static uint16_t ipv4_route_count;
+static struct ipv4_route_node *ipv4_route_root;
+static pthread_rwlock_t ipv4_route_lock = PTHREAD_RWLOCK_INITIALIZER;  // routes change rarely, lookups run on dst cache misses
+static atomic_uint ipv4_route_gen = 1;  // bumped by every change, one route's can change the longest match for others
+
+
+// Makes the dst caches filled in from an older table look their route up again
+static void ipv4_route_changed() {
+	atomic_fetch_add_explicit(&ipv4_route_gen, 1, memory_order_release);
+}
+
+// Read before the lookup a dst cache is filled in from, so a change in between invalidates it right away
+uint32_t ipv4_route_generation() {
+	return atomic_load_explicit(&ipv4_route_gen, memory_order_acquire);
+}
+
+static inline uint32_t ipv4_route_mask(uint8_t prefix_len) {
+	return prefix_len ? htonl(0xffffffffu << (32 - prefix_len)) : 0;
+}
+
+static struct ipv4_route_node *ipv4_route_node_new() {
+	struct ipv4_route_node *node = calloc(1, sizeof(struct ipv4_route_node));
+	if(node == NULL) {
+		perror("could not allocate memory for route trie node");
+		exit(1);
+	}
+
+	return node;
+}
+
+static void ipv4_route_node_free(struct ipv4_route_node *node) {
+	if(node == NULL)
+		return;
+
+	for(uint32_t i = 0; i < IPV4_ROUTE_FANOUT; i++)
+		ipv4_route_node_free(node->children[i]);
+	free(node);
+}
+
+// Expands the route over the slots its prefix covers. Caller holds the write lock.
+static void ipv4_route_insert_locked(uint16_t index) {
+	struct ipv4_route *route = &ipv4_routes[index];
+	uint32_t prefix = ntohl(route->prefix);
+	uint32_t level = route->prefix_len ? (route->prefix_len - 1u) / IPV4_ROUTE_STRIDE : 0;
+
+	struct ipv4_route_node *node = ipv4_route_root;
+	for(uint32_t i = 0; i < level; i++) {
+		uint8_t slot = (uint8_t)(prefix >> (32 - IPV4_ROUTE_STRIDE * (i + 1)));
+		if(node->children[slot] == NULL)
+			node->children[slot] = ipv4_route_node_new();
+		node = node->children[slot];
+	}
+
+	uint32_t span = 1u << (IPV4_ROUTE_STRIDE * (level + 1) - route->prefix_len);
+	uint32_t first = (prefix >> (32 - IPV4_ROUTE_STRIDE * (level + 1))) & (IPV4_ROUTE_FANOUT - 1) & ~(span - 1);
+	for(uint32_t slot = first; slot < first + span; slot++)
+		node->routes[slot] = (uint16_t)(index + 1);
+}
+
+// Caller holds the write lock
+static void ipv4_route_rebuild_locked() {
+	ipv4_route_node_free(ipv4_route_root);
+	ipv4_route_root = ipv4_route_node_new();
+
+	for(uint16_t i = 0; i < ipv4_route_count; i++)
+		ipv4_route_insert_locked(i);
+}
+
+// Replaces the route to the same prefix if there is one. Returns -1 if the table is full.
+int ipv4_route_add(uint32_t prefix, uint8_t prefix_len, uint32_t gateway, struct net_dev *dev, uint32_t source_ip) {
+	if(prefix_len > 32 || dev == NULL)
+		return -1;
+
+	struct ipv4_route route = {
+		.prefix = prefix & ipv4_route_mask(prefix_len),
+		.prefix_len = prefix_len,
+		.gateway = gateway,
+		.dev = dev,
+		.source_ip = source_ip,
+	};
+
+	pthread_rwlock_wrlock(&ipv4_route_lock);
+
+	uint16_t pos = 0;
+	while(pos < ipv4_route_count && ipv4_routes[pos].prefix_len < prefix_len)
+		pos++;
+	while(pos < ipv4_route_count && ipv4_routes[pos].prefix_len == prefix_len && ipv4_routes[pos].prefix != route.prefix)
+		pos++;
+
+	if(pos == ipv4_route_count || ipv4_routes[pos].prefix_len != prefix_len) {
+		if(ipv4_route_count == IPV4_ROUTE_MAX) {
+			pthread_rwlock_unlock(&ipv4_route_lock);
+			return -1;
+		}
+
+		memmove(&ipv4_routes[pos + 1], &ipv4_routes[pos], (ipv4_route_count - pos) * sizeof(struct ipv4_route));
+		ipv4_route_count++;
+	}
+
+	ipv4_routes[pos] = route;
+	ipv4_route_rebuild_locked();
+	pthread_rwlock_unlock(&ipv4_route_lock);
+
+	ipv4_route_changed();
+	return 0;
+}
+
+// Returns -1 if there is no route to the prefix
+int ipv4_route_remove(uint32_t prefix, uint8_t prefix_len) {
+	if(prefix_len > 32)
+		return -1;
+
+	prefix &= ipv4_route_mask(prefix_len);
+
+	pthread_rwlock_wrlock(&ipv4_route_lock);
+	for(uint16_t i = 0; i < ipv4_route_count; i++) {
+		if(ipv4_routes[i].prefix_len != prefix_len || ipv4_routes[i].prefix != prefix)
+			continue;
+
+		memmove(&ipv4_routes[i], &ipv4_routes[i + 1], (ipv4_route_count - i - 1u) * sizeof(struct ipv4_route));
+		ipv4_route_count--;
+		ipv4_route_rebuild_locked();
+		pthread_rwlock_unlock(&ipv4_route_lock);
+
+		ipv4_route_changed();
+		return 0;
+	}
+
+	pthread_rwlock_unlock(&ipv4_route_lock);
+	return -1;
+}
+
+// Copies the longest matching route, with the source address filled in. Returns -1 if nothing matches.
+int ipv4_route_lookup(uint32_t dest_ip, struct ipv4_route *route) {
+	uint32_t address = ntohl(dest_ip);
+	uint16_t best = 0;
+
+	pthread_rwlock_rdlock(&ipv4_route_lock);
+
+	struct ipv4_route_node *node = ipv4_route_root;
+	for(uint32_t level = 0; node != NULL && level < IPV4_ROUTE_LEVELS; level++) {
+		uint8_t slot = (uint8_t)(address >> (32 - IPV4_ROUTE_STRIDE * (level + 1)));
+		if(node->routes[slot])
+			best = node->routes[slot];
+		node = node->children[slot];
+	}
+
+	if(best)
+		*route = ipv4_routes[best - 1];
+	pthread_rwlock_unlock(&ipv4_route_lock);
+
+	if(!best)
+		return -1;
+
+	if(route->source_ip == 0)
+		route->source_ip = route->dev->ipv4;
+	return 0;
+}
+
+void ipv4_route_print() {
+	char prefix[INET_ADDRSTRLEN], gateway[INET_ADDRSTRLEN];
+
+	pthread_rwlock_rdlock(&ipv4_route_lock);
+	for(uint16_t i = ipv4_route_count; i-- > 0;) {
+		struct ipv4_route *route = &ipv4_routes[i];
+		inet_ntop(AF_INET, &route->prefix, prefix, sizeof(prefix));
+		inet_ntop(AF_INET, &route->gateway, gateway, sizeof(gateway));
+
+		if(route->gateway)
+			printf("Route %s/%u via %s dev %s\n", prefix, route->prefix_len, gateway, route->dev->name);
+		else
+			printf("Route %s/%u dev %s\n", prefix, route->prefix_len, route->dev->name);
+	}
+	pthread_rwlock_unlock(&ipv4_route_lock);
+}
+
+void ipv4_route_free() {
+	pthread_rwlock_wrlock(&ipv4_route_lock);
+	ipv4_route_node_free(ipv4_route_root);
+	ipv4_route_root = NULL;
+	ipv4_route_count = 0;
+	pthread_rwlock_unlock(&ipv4_route_lock);
+
+	ipv4_route_changed();
+}
@@ -0,0 +1,159 @@
+#include <linux/if_ether.h>
+#include <string.h>
+#include <netinet/in.h>
+
+#include "ipv6.h"
+#include "icmpv6.h"
+#include "tcp.h"
+#include "ndp.h"
+
+
+static const uint8_t ipv6_all_nodes[16] = { 0xff, 0x02, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x01 };
+
+
+// fe80::/64 with the interface identifier made from the MAC, modified EUI-64
+void ipv6_addr_link_local(struct net_dev *dev, uint8_t *address) {
+	memset(address, 0, 16);
+	address[0] = 0xfe;
+	address[1] = 0x80;
+	address[8] = dev->hwaddr[0] ^ 0x02;
+	address[9] = dev->hwaddr[1];
+	address[10] = dev->hwaddr[2];
+	address[11] = 0xff;
+	address[12] = 0xfe;
+	address[13] = dev->hwaddr[3];
+	address[14] = dev->hwaddr[4];
+	address[15] = dev->hwaddr[5];
+}
+
+// The device's configured address, or its link-local one
+int ipv6_addr_is_local(struct net_dev *dev, const uint8_t *address) {
+	if(memcmp(address, dev->ipv6, 16) == 0)
+		return 1;
+
+	uint8_t link_local[16];
+	ipv6_addr_link_local(dev, link_local);
+	return memcmp(address, link_local, 16) == 0;
+}
+
+// Link-local destinations are talked to from the link-local address, everything else from the configured one
+void ipv6_addr_source(struct net_dev *dev, const uint8_t *dest_ip, uint8_t *source_ip) {
+	static const uint8_t unspecified[16];
+
+	if(ipv6_addr_is_link_local(dest_ip) || memcmp(dev->ipv6, unspecified, 16) == 0)
+		ipv6_addr_link_local(dev, source_ip);
+	else
+		memcpy(source_ip, dev->ipv6, 16);
+}
+
+// ff02::1:ff00:0/104 with the last 24 bits of the address, where solicitations for it are sent
+void ipv6_addr_solicited_node(const uint8_t *address, uint8_t *solicited) {
+	memset(solicited, 0, 16);
+	solicited[0] = 0xff;
+	solicited[1] = 0x02;
+	solicited[11] = 0x01;
+	solicited[12] = 0xff;
+	memcpy(&solicited[13], &address[13], 3);
+}
+
+// Multicast groups the device is in: all nodes, and the solicited-node groups of its addresses
+static int ipv6_addr_is_joined(struct net_dev *dev, const uint8_t *address) {
+	if(memcmp(address, ipv6_all_nodes, 16) == 0)
+		return 1;
+
+	uint8_t solicited[16];
+	ipv6_addr_solicited_node(address, solicited);
+	if(memcmp(address, solicited, 13) != 0)
+		return 0;
+
+	uint8_t link_local[16];
+	ipv6_addr_link_local(dev, link_local);
+	return memcmp(&address[13], &link_local[13], 3) == 0 || memcmp(&address[13], (uint8_t *)dev->ipv6 + 13, 3) == 0;
+}
+
+// Puts the fixed header in front of the buffer's data, which holds the upper layer packet
+void ipv6_push_header(struct sk_buff *buffer, const uint8_t *source_ip, const uint8_t *dest_ip, uint8_t next_header,
+					  uint8_t hop_limit) {
+	uint32_t payload_len = buffer->len;
+
+	struct ipv6_packet *ip_packet = (struct ipv6_packet *)skb_push(buffer, IPV6_HEADER_SIZE);
+	skb_reset_network_header(buffer);
+
+	ip_packet->version_class_flow = htonl(6u << 28);
+	ip_packet->payload_len = htons((uint16_t)payload_len);
+	ip_packet->next_header = next_header;
+	ip_packet->hop_limit = hop_limit;
+	memcpy(ip_packet->source_ip, source_ip, 16);
+	memcpy(ip_packet->dest_ip, dest_ip, 16);
+}
+
+// Consumes the caller's reference to the buffer. Destinations are on-link, so the neighbor is the destination
+// itself and there is no route to look up. The header has no checksum, with a dst cache whose neighbor slot is
+// unchanged the packet goes out without looking the neighbor up. Nothing is fragmented: TCP sizes its segments to
+// the MTU.
+int ipv6_send_packet(struct sock *sock, struct sk_buff *buffer) {
+	struct dst_cache *dst = &sock->dst;
+
+	ipv6_push_header(buffer, sock->source.ipv6, sock->dest.ipv6, sock->protocol, IPV6_DEFAULT_HOP_LIMIT);
+
+	int cached = dst->neigh != NULL && neigh_entry_unchanged(dst->neigh, dst->neigh_seq);
+	struct net_dev *dev = cached ? dst->dev : sock->dev;
+	buffer->dev = dev;
+	buffer->queue_mapping = (uint16_t)(sock->queue % dev->queue_count);
+
+	if(buffer->len > dev->mtu && buffer->gso_size == 0) {
+		skb_free(buffer);
+		return -1;  // too big, and only the sender may fragment
+	}
+
+	if(cached)
+		return eth_write(dst->mac, ETH_P_IPV6, buffer);
+
+	if(ipv6_addr_is_multicast(sock->dest.ipv6)) {
+		uint8_t mac[6];
+		ipv6_multicast_mac(sock->dest.ipv6, mac);
+		return eth_write(mac, ETH_P_IPV6, buffer);
+	}
+
+	dst->neigh = NULL;
+	int state = ndp_lookup(sock->dest.ipv6, dst->mac, &dst->neigh, &dst->neigh_seq);
+	if(state == NEIGH_STATE_REACHABLE || state == NEIGH_STATE_STALE) {
+		dst->dev = dev;
+		dst->mtu = dev->mtu;
+		return eth_write(dst->mac, ETH_P_IPV6, buffer);
+	}
+
+	return ndp_resolve(dev, sock->dest.ipv6, buffer);
+}
+
+
+// No extension headers are understood, a packet carrying one is dropped like an unknown protocol
+int ipv6_process_packet(struct net_dev *dev, struct sk_buff *buffer) {
+	struct ipv6_packet *ip_packet = ipv6_packet_from_skb(buffer);
+
+	if(skb_headlen(buffer) < IPV6_HEADER_SIZE || (ntohl(ip_packet->version_class_flow) >> 28) != 6)
+		return -1;
+
+	// Short frames are padded, the payload length is what counts
+	ip_packet->payload_len = ntohs(ip_packet->payload_len);
+	if(IPV6_HEADER_SIZE + ip_packet->payload_len > buffer->len)
+		return -1;
+
+	if(ipv6_addr_is_multicast(ip_packet->dest_ip) ? !ipv6_addr_is_joined(dev, ip_packet->dest_ip)
+												  : !ipv6_addr_is_local(dev, ip_packet->dest_ip))
+		return -1;
+
+	skb_pull(buffer, IPV6_HEADER_SIZE);
+	skb_reset_transport_header(buffer);
+
+	if(ip_packet->next_header == IPPROTO_ICMPV6) {
+		return icmpv6_process_packet(dev, buffer);
+	}
+	else if(ip_packet->next_header == IPPROTO_TCP && !ipv6_addr_is_multicast(ip_packet->dest_ip)) {
+		tcp_in(buffer);
+		return 0;
+	}
+
+	fprintf(stderr, "unknown IPv6 next header encountered: %d\n", ip_packet->next_header);
+	return -1;
+}
@@ -9,85 +9,48 @@
 #include <linux/if_ether.h>
 #include <time.h>
 #include <pthread.h>
-#include <poll.h>
 #include <errno.h>
 
 #include "tap.h"
+#include "tap_uring.h"
+#include "packet.h"
+#include "bench.h"
 #include "eth.h"
 #include "arp.h"
 #include "ipv4.h"
+#include "ipv4_frag.h"
+#include "ipv4_route.h"
+#include "ndp.h"
 #include "tcp.h"
+#include "udp.h"
 
 
-#define POLL_RATE_NS 1
-
-#define THREAD_COUNT 3
-#define THREAD_MAIN 0
-#define THREAD_TCP_SLOW 1
-#define THREAD_TCP_FAST 2
+#define THREAD_MAX 5  // TCP slow and fast timers, ARP, IPv4 and NDP timers
 
 
 int RUNNING = 1;
-struct net_dev* device = NULL;
-pthread_t threads[THREAD_COUNT];
-pthread_mutex_t threads_mutex = PTHREAD_MUTEX_INITIALIZER;
-
-
-int handle_eth_frame(struct net_dev *dev, struct eth_frame *eth_frame) {
-	if(eth_frame->eth_type == ETH_P_ARP) {
-		return arp_process_packet(dev, eth_frame);
-	}
-
-	else if(eth_frame->eth_type == ETH_P_IP) {
-		return ipv4_process_packet(dev, eth_frame);
-	}
-
-	else if(eth_frame->eth_type == ETH_P_IPV6)
-		return -1;
-
-	else {
-		printf("unknown Ethernet type: %d\n", eth_frame->eth_type);
-		return -1;
-	}
-}
-
-void *main_loop(void *args) {
-	pthread_mutex_t *threads_mutex = (pthread_mutex_t *)args;
-
-	struct pollfd poll_fd = { .fd = device->sock_fd, .events = POLLIN | POLLNVAL | POLLERR | POLLHUP };
-	struct timespec poll_interval = { .tv_sec = 0, .tv_nsec = POLL_RATE_NS };
-
-	while(RUNNING) {
-		int res = ppoll(&poll_fd, 1, &poll_interval, NULL);
-		if(res < 0) {
-			perror("main loop: poll error");
-			break;
-		}
-
-		if(poll_fd.revents & POLLIN) {
-			struct eth_frame *eth_frame = malloc(ETHERNET_MAX_PAYLOAD_SIZE);
-			if(eth_frame == NULL) {
-				perror("could not allocate memory for ethernet frame");
-				exit(1);
-			}
-			memset(eth_frame, 0, ETHERNET_MAX_PAYLOAD_SIZE);
-
-			uint16_t num_bytes = eth_read(device, eth_frame);
-			pthread_mutex_lock(threads_mutex);
-			handle_eth_frame(device, eth_frame);
-			pthread_mutex_unlock(threads_mutex);
-
-			free(eth_frame);
-		}
-		else if(poll_fd.revents & POLLNVAL || poll_fd.revents & POLLERR || poll_fd.revents & POLLHUP)
-			break;
+uint32_t rx_batch_size = ETH_RX_BATCH_DEFAULT;
+uint16_t queue_count = 1;
+int offload = 0;
+uint16_t mtu = 0;  // keep the interface's
+uint32_t gateway = 0;  // default route on-link without one
+char *packet_ifname = NULL;  // AF_PACKET on this interface instead of the TAP device
+int uring = 0;  // TAP I/O through io_uring
+struct tap_uring_config uring_config = {0};
+char *bench_name = NULL;
+struct bench_options bench_options = { .loops = 1 };
+pthread_t threads[THREAD_MAX];
+int thread_count = 0;
+
+
+void create_thread(void *(*func) (void *), void *args) {
+	if(thread_count == THREAD_MAX) {
+		fprintf(stderr, "no room for another thread, raise THREAD_MAX\n");
+		exit(1);
 	}
 
-	return NULL;
-}
-
-void create_thread(int id, void *(*func) (void *) ) {
-	int res = pthread_create(&threads[id], NULL, (void*)func, (void*)&threads_mutex);
+	int id = thread_count++;
+	int res = pthread_create(&threads[id], NULL, (void*)func, args);
 	if(res != 0) {
 		fprintf(stderr, "failed to create thread #%d: %s", id, strerror(errno));
 		perror("Failed to create thread");
@@ -95,34 +58,71 @@ void create_thread(int id, void *(*func) (void *) ) {
 	}
 }
 
-void setup() {
-	// TAP device
-	char dev_name[IFNAMSIZ];
-	strcpy(dev_name, "tap0");
-	device = tap_init_dev(dev_name);
-	if(device == NULL) {
-		printf("Failed to create TAP device, exiting...\n");
+struct net_dev *setup() {
+	// AF_PACKET on the given interface, or the TAP device
+	const struct net_dev_ops *ops = packet_ifname != NULL ? &packet_ops : uring ? &tap_uring_ops : &tap_ops;
+	const char *dev_name = packet_ifname != NULL ? packet_ifname : "tap0";
+
+	struct net_dev *dev = net_dev_open(ops, dev_name, queue_count, offload ? NETIF_F_VNET_HDR : 0, mtu,
+									   ops == &tap_uring_ops ? &uring_config : NULL);
+	if(dev == NULL) {
+		printf("Failed to open %s device %s, exiting...\n", ops->name, dev_name);
 		exit(1);
 	}
-	printf("Using TAP device %s\n", dev_name);
-
-	// Main thread
-	create_thread(THREAD_MAIN, main_loop);
-	create_thread(THREAD_TCP_SLOW, tcp_timer_slow);
-	create_thread(THREAD_TCP_FAST, tcp_timer_fast);
-
+	inet_pton(AF_INET, TAP_DEVICE_IP, &dev->ipv4);
+	inet_pton(AF_INET6, TAP_DEVICE_IPV6, dev->ipv6);
+
+	// The device's subnet is on-link, everything else goes through the gateway
+	ipv4_route_add(dev->ipv4, TAP_DEVICE_PREFIX_LEN, 0, dev, 0);
+	ipv4_route_add(0, 0, gateway, dev, 0);
+
+	printf("Using %s device %s with %d queue(s), MTU %u\n", dev->ops->name, dev->name, dev->queue_count, dev->mtu);
+
+	uint8_t link_local[16];
+	char ipv6_str[INET6_ADDRSTRLEN], link_local_str[INET6_ADDRSTRLEN];
+	ipv6_addr_link_local(dev, link_local);
+	printf("IPv6 %s, link-local %s\n", inet_ntop(AF_INET6, dev->ipv6, ipv6_str, sizeof(ipv6_str)),
+		   inet_ntop(AF_INET6, link_local, link_local_str, sizeof(link_local_str)));
+	if(offload)
+		printf("Offloads:%s%s%s\n", dev->features & NETIF_F_HW_CSUM ? " checksum" : "",
+			   dev->features & NETIF_F_TSO ? " tso" : "", dev->features & NETIF_F_GRO ? " gro" : "");
+
+	// One worker per queue
+	net_dev_start(dev, rx_batch_size);
+
+	create_thread(tcp_timer_slow, dev);
+	create_thread(tcp_timer_fast, dev);
+	create_thread(arp_timer, NULL);
+	create_thread(ipv4_timer, NULL);
+	create_thread(ndp_timer, NULL);
+
+	ipv4_route_print();
 	printf("Created threads\n\n");
+	return dev;
 }
 
-void finish() {
+void finish(struct net_dev *dev) {
 	RUNNING = 0;
 
-	free_tap_device();
-	for(int i = 0; i < THREAD_COUNT; i++) {
+	for(int i = 0; i < thread_count; i++) {
 		pthread_join(threads[i], NULL);
 	}
+	net_dev_stop(dev);
 
+	arp_print_stats();
 	arp_free_cache();
+	ndp_print_stats();
+	ndp_free_cache();
+	ipv4_frag_print_stats();
+	udp_print_stats();
+	ipv4_frag_free();
+	ipv4_route_free();
+
+	net_dev_print_stats(dev);
+	net_dev_close(dev);
+
+	skb_pool_print_stats();
+	skb_pool_free();
 }
 
 
@@ -130,17 +130,39 @@ void finish() {
 #define TEST_SOCKET_TIMEOUT 15000  // timeout in 5 seconds if we are still not connected
 #define TEST_DATA_LEN 2000
 
-struct tcp_socket *test_connect(char *dest_ip_str, uint16_t dest_port) {
-	uint32_t dest_ip;
-	inet_pton(AF_INET, dest_ip_str, &dest_ip);
+// IPv6 destinations are on-link, IPv4 ones are routed
+struct tcp_socket *test_connect(struct net_dev *dev, char *dest_ip_str, uint16_t dest_port) {
+	struct sock_addr source = {0}, dest = {0};
+	uint8_t family = strchr(dest_ip_str, ':') != NULL ? AF_INET6 : AF_INET;
+	if(inet_pton(family, dest_ip_str, dest.ipv6) != 1) {
+		printf("Invalid address %s\n", dest_ip_str);
+		return NULL;
+	}
 
 	srand48(time(NULL));
 	uint16_t port = (uint16_t)lrand48();
 
-	pthread_mutex_lock(&threads_mutex);
-	struct tcp_socket *tcp_socket = tcp_socket_new(device, dest_ip, port, dest_port);
+	// The socket belongs to the device and source address of its route
+	if(family == AF_INET6)
+		ipv6_addr_source(dev, dest.ipv6, source.ipv6);
+	else {
+		struct ipv4_route route;
+		if(ipv4_route_lookup(dest.ipv4, &route) < 0) {
+			printf("No route to %s\n", dest_ip_str);
+			return NULL;
+		}
+
+		dev = route.dev;
+		source.ipv4 = route.source_ip;
+	}
+
+	struct net_queue *queue = net_dev_flow_queue(dev, sock_addr_fold(&source), sock_addr_fold(&dest), port, dest_port);
+
+	pthread_mutex_lock(&queue->lock);
+	struct tcp_socket *tcp_socket = tcp_socket_new(dev, family, &source, &dest, port, dest_port);
 	tcp_out_syn(tcp_socket);
-	pthread_mutex_unlock(&threads_mutex);
+	pthread_mutex_unlock(&queue->lock);
+	eth_flush(dev, queue->index);
 
 	uint32_t ticks = 0;
 	while(1) {
@@ -163,9 +185,10 @@ int test_send(struct tcp_socket *tcp_socket) {
 	char *test_data_header = "POST / HTTP/1.1\r\n\r\n";
 	strcpy(test_data, test_data_header);
 
-	pthread_mutex_lock(&threads_mutex);
+	pthread_mutex_lock(&sock_queue(&tcp_socket->sock)->lock);
 	tcp_out_data(tcp_socket, (uint8_t *) test_data, TEST_DATA_LEN);
-	pthread_mutex_unlock(&threads_mutex);
+	pthread_mutex_unlock(&sock_queue(&tcp_socket->sock)->lock);
+	eth_flush(tcp_socket->sock.dev, tcp_socket->sock.queue);
 	return 0;
 }
 
@@ -174,7 +197,7 @@ int main(int argc, char *argv[]) {
 	int dest_port = -1;
 
 	int opt;
-	while((opt = getopt(argc, argv, ":h:p:")) != -1) {
+	while((opt = getopt(argc, argv, ":h:p:g:b:q:m:oi:uUB:r:w:tl:")) != -1) {
 		switch(opt) {
 			case 'h':
 				dest_ip = malloc((strlen(optarg)+1) * sizeof(char));
@@ -187,11 +210,80 @@ int main(int argc, char *argv[]) {
 			case 'p':
 				dest_port = atoi(optarg);
 				break;
+			case 'g':
+				if(inet_pton(AF_INET, optarg, &gateway) != 1) {
+					printf("gateway has to be an IPv4 address\n");
+					exit(1);
+				}
+				break;
+			case 'b':
+				rx_batch_size = (uint32_t)atoi(optarg);
+				if(rx_batch_size < 1 || rx_batch_size > ETH_RX_BATCH_MAX) {
+					printf("RX batch size has to be between 1 and %d\n", ETH_RX_BATCH_MAX);
+					exit(1);
+				}
+				break;
+			case 'q':
+				queue_count = (uint16_t)atoi(optarg);
+				if(queue_count < 1 || queue_count > NET_DEV_MAX_QUEUES) {
+					printf("queue count has to be between 1 and %d\n", NET_DEV_MAX_QUEUES);
+					exit(1);
+				}
+				break;
+			case 'm': {
+				int value = atoi(optarg);
+				if(value < NET_DEV_MIN_MTU || value > NET_DEV_MAX_MTU) {
+					printf("MTU has to be between %d and %d\n", NET_DEV_MIN_MTU, NET_DEV_MAX_MTU);
+					exit(1);
+				}
+				mtu = (uint16_t)value;
+				break;
+			}
+			case 'o':
+				offload = 1;
+				break;
+			case 'i':
+				packet_ifname = optarg;
+				break;
+			case 'U':
+				uring_config.sqpoll = 1;
+				// fall through
+			case 'u':
+				uring = 1;
+				break;
+			case 'B':
+				bench_name = optarg;
+				break;
+			case 'r':
+				bench_options.replay_path = optarg;
+				break;
+			case 'w':
+				bench_options.record_path = optarg;
+				break;
+			case 't':
+				bench_options.timed = 1;
+				break;
+			case 'l':
+				bench_options.loops = (uint32_t)atoi(optarg);
+				if(bench_options.loops < 1) {
+					printf("replay loop count has to be at least 1\n");
+					exit(1);
+				}
+				break;
 			default:
 				break;
 		}
 	}
 
+	if(bench_name != NULL) {
+		bench_options.rx_batch = rx_batch_size;
+		bench_options.mtu = mtu;
+		int res = bench_run(bench_name, &bench_options);
+		skb_pool_print_stats();
+		skb_pool_free();
+		return res == 0 ? 0 : 1;
+	}
+
 	if(dest_ip == NULL) {
 		printf("Destination IP is missing, please use -h\n");
 		exit(1);
@@ -203,29 +295,38 @@ int main(int argc, char *argv[]) {
 
 	printf("Connecting to %s:%d...\n", dest_ip, dest_port);
 
-	setup();
+	struct net_dev *dev = setup();
 
 	// test tcp_socket
-	struct tcp_socket * tcp_socket = test_connect(dest_ip, (uint16_t)dest_port);
+	struct tcp_socket * tcp_socket = test_connect(dev, dest_ip, (uint16_t)dest_port);
 	free(dest_ip);
 
 	if(tcp_socket) {
 		printf("Connected!\n");
 		test_send(tcp_socket);
 
+		uint8_t response[TEST_DATA_LEN];
 		while(1) {
 			if(tcp_socket->state == TCPS_CLOSED)  // TODO: Socket is more than likely already free'd here
 				break;
 
+			pthread_mutex_lock(&sock_queue(&tcp_socket->sock)->lock);
+			uint32_t response_len = tcp_socket_read(tcp_socket, response, sizeof(response));
+			pthread_mutex_unlock(&sock_queue(&tcp_socket->sock)->lock);
+
+			if(response_len > 0)
+				printf("\nReceived (%u bytes):\n--------------------\n%.*s\n--------------------\n",
+					   response_len, (int)response_len, response);
+
 			usleep(TEST_SOCKET_POLL_INTERVAL * 1000);
 		}
 
 		usleep(600 * 1000);  // Wait before closing
-		finish();
+		finish(dev);
 	}
 	else {
 		printf("Could not connect!\n");
-		finish();
+		finish(dev);
 	}
 
 }
\ No newline at end of file
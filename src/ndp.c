@@ -0,0 +1,143 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <linux/if_ether.h>
+
+#include "ndp.h"
+#include "ipv6.h"
+#include "icmpv6.h"
+
+
+extern int RUNNING;
+
+// Neighbors on a link share the prefix, the interface identifier in the last 64 bits is what differs
+static inline uint32_t ndp_hash(const uint8_t *address) {
+	uint32_t words[2];
+	memcpy(words, &address[8], sizeof(words));
+
+	return (words[0] ^ words[1]) * 2654435761u;
+}
+
+static void ndp_solicit(struct net_dev *dev, uint16_t queue, const uint8_t *address) {
+	icmpv6_send_neighbor_solicit(dev, queue, address);
+}
+
+static struct neigh_entry ndp_entries[NDP_TABLE_SIZE];
+static struct neigh_table ndp_table = {
+	.name = "NDP",
+	.eth_type = ETH_P_IPV6,
+	.key_size = 16,
+	.bits = NDP_TABLE_BITS,
+	.entries = ndp_entries,
+	.hash = ndp_hash,
+	.request = ndp_solicit,
+	.reachable_time = NDP_REACHABLE_TIME,
+	.refresh_time = NDP_REFRESH_TIME,
+	.retrans_time = NDP_RETRANS_TIME,
+	.backoff = 0,
+	.max_retries = NDP_MAX_RETRIES,
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+
+void ndp_free_cache() {
+	neigh_free(&ndp_table);
+}
+
+// State of the address, NEIGH_STATE_FREE if it isn't known, see neigh_lookup()
+int ndp_lookup(const uint8_t *address, uint8_t *mac, struct neigh_entry **entry, uint32_t *seq) {
+	return neigh_lookup(&ndp_table, address, 16, ndp_hash(address), mac, entry, seq);
+}
+
+// Learns what a solicitation or advertisement tells about the neighbor. Only solicitations add unknown neighbors,
+// and only as STALE since nothing confirmed them. An advertisement makes the neighbor REACHABLE when it answers a
+// solicitation, and a different MAC than the cached one is only taken with the override flag, otherwise it just
+// casts doubt on the cached one. mac is NULL for an advertisement without the option. Packets that waited for the
+// MAC are sent. Returns -1 if the cache is full.
+int ndp_update(struct net_dev *dev, const uint8_t *address, const uint8_t *mac, uint8_t flags) {
+	struct sk_buff *pending[NEIGH_PENDING_MAX];
+	uint8_t pending_count = 0;
+	uint8_t dest_mac[6];
+	int res = 0;
+
+	pthread_mutex_lock(&ndp_table.mutex);
+
+	struct neigh_entry *slot;
+	struct neigh_entry *entry = neigh_find_locked(&ndp_table, address, &slot);
+
+	if(entry == NULL) {
+		if(flags & NDP_UPDATE_CREATE && mac != NULL) {
+			entry = neigh_insert_locked(&ndp_table, slot, dev, address, NEIGH_STATE_STALE, mac);
+			if(entry != NULL)
+				entry->expires = neigh_time() + NDP_REACHABLE_TIME;
+			else
+				res = -1;
+		}
+
+		pthread_mutex_unlock(&ndp_table.mutex);
+		return res;
+	}
+
+	uint8_t incomplete = entry->state == NEIGH_STATE_INCOMPLETE;
+	if(incomplete && mac == NULL) {
+		pthread_mutex_unlock(&ndp_table.mutex);
+		return 0;  // nothing to send the waiting packets to
+	}
+
+	uint8_t differs = mac != NULL && memcmp(entry->mac, mac, sizeof(entry->mac)) != 0;
+	uint8_t take_mac = incomplete || (differs && flags & NDP_UPDATE_OVERRIDE);
+	uint8_t previous = entry->state;
+	uint8_t state = previous;
+
+	if(incomplete)
+		state = flags & NDP_UPDATE_SOLICITED ? NEIGH_STATE_REACHABLE : NEIGH_STATE_STALE;
+	else if(differs && !take_mac) {
+		if(state == NEIGH_STATE_REACHABLE)
+			state = NEIGH_STATE_STALE;
+	}
+	else if(flags & NDP_UPDATE_SOLICITED)
+		state = NEIGH_STATE_REACHABLE;
+	else if(take_mac)
+		state = NEIGH_STATE_STALE;
+
+	if(take_mac || state != previous)
+		neigh_set_locked(entry, state, take_mac ? mac : NULL);
+
+	// Confirmed or changed, the timers start over
+	if(take_mac || state != previous || (flags & NDP_UPDATE_SOLICITED && state == NEIGH_STATE_REACHABLE))
+		neigh_confirm_locked(&ndp_table, entry);
+
+	if(incomplete) {
+		pending_count = neigh_pending_take_locked(entry, pending);
+		memcpy(dest_mac, entry->mac, sizeof(dest_mac));
+	}
+
+	pthread_mutex_unlock(&ndp_table.mutex);
+
+	for(uint8_t i = 0; i < pending_count; i++)
+		eth_write(dest_mac, ETH_P_IPV6, pending[i]);
+
+	return 0;
+}
+
+// Slow path of ipv6_send_packet() when ndp_lookup() found no MAC, takes over the caller's reference to the buffer
+int ndp_resolve(struct net_dev *dev, const uint8_t *address, struct sk_buff *buffer) {
+	return neigh_resolve(&ndp_table, dev, address, buffer);
+}
+
+void *ndp_timer(void *args) {
+	while(RUNNING) {
+		neigh_timer_run(&ndp_table);
+		usleep(NDP_TIMER_INTERVAL * 1000);
+	}
+
+	skb_pool_flush_local();
+	return NULL;
+}
+
+void ndp_print_stats() {
+	neigh_print_stats(&ndp_table);
+}
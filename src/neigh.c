@@ -0,0 +1,310 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <inttypes.h>
+
+#include "neigh.h"
+#include "eth.h"
+#include "skbuff.h"
+
+
+// Milliseconds on a monotonic clock, compared with neigh_time_after() so wrapping around doesn't matter
+uint32_t neigh_time() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint32_t)((uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000);
+}
+
+static inline int neigh_time_after(uint32_t now, uint32_t time) {
+	return (int32_t)(now - time) >= 0;
+}
+
+static inline uint32_t neigh_index(const struct neigh_table *table, const uint8_t *key) {
+	return table->hash(key) >> (32 - table->bits);
+}
+
+// Slot holding the key. If there is none, free_slot is set to where it would be inserted, or NULL if the probe
+// sequence has no room.
+struct neigh_entry *neigh_find_locked(struct neigh_table *table, const uint8_t *key, struct neigh_entry **free_slot) {
+	uint32_t mask = neigh_table_size(table) - 1;
+	uint32_t index = neigh_index(table, key);
+	*free_slot = NULL;
+
+	for(uint32_t probes = 0; probes <= mask; probes++) {
+		struct neigh_entry *entry = &table->entries[index];
+
+		if(entry->state == NEIGH_STATE_FREE) {
+			if(*free_slot == NULL)
+				*free_slot = entry;
+			return NULL;
+		}
+
+		if(entry->state == NEIGH_STATE_DELETED) {
+			if(*free_slot == NULL)
+				*free_slot = entry;
+		}
+		else if(memcmp(entry->key, key, table->key_size) == 0)
+			return entry;
+
+		index = (index + 1) & mask;
+	}
+
+	return NULL;
+}
+
+// Fills a slot found by neigh_find_locked(), returns NULL when the table is full
+struct neigh_entry *neigh_insert_locked(struct neigh_table *table, struct neigh_entry *slot, struct net_dev *dev,
+										const uint8_t *key, uint8_t state, const uint8_t *mac) {
+	if(slot == NULL)
+		return NULL;
+
+	if(slot->state == NEIGH_STATE_FREE) {
+		if(table->used >= neigh_table_max_load(table))
+			return NULL;
+		table->used++;
+	}
+
+	neigh_write_begin(slot);
+	slot->state = state;
+	memcpy(slot->key, key, table->key_size);
+	if(mac != NULL)
+		memcpy(slot->mac, mac, sizeof(slot->mac));
+	else
+		memset(slot->mac, 0, sizeof(slot->mac));
+	neigh_write_end(slot);
+
+	atomic_store_explicit(&slot->used, 0, memory_order_relaxed);
+	slot->dev = dev;
+	slot->retries = 0;
+	slot->stale = 0;
+	slot->pending_head = 0;
+	slot->pending_count = 0;
+
+	return slot;
+}
+
+// Changes state and, unless NULL, the MAC. A neighbor that moved invalidates the dst caches filled in from the slot.
+void neigh_set_locked(struct neigh_entry *entry, uint8_t state, const uint8_t *mac) {
+	neigh_write_begin(entry);
+	if(mac != NULL)
+		memcpy(entry->mac, mac, sizeof(entry->mac));
+	entry->state = state;
+	neigh_write_end(entry);
+}
+
+// The neighbor was heard from, its timers start over
+void neigh_confirm_locked(struct neigh_table *table, struct neigh_entry *entry) {
+	atomic_store_explicit(&entry->used, 0, memory_order_relaxed);
+	entry->expires = neigh_time() + table->reachable_time;
+	entry->retries = 0;
+	entry->stale = 0;
+}
+
+// Moves the packets waiting on the entry to pending, oldest first, to be sent once the mutex is released
+uint8_t neigh_pending_take_locked(struct neigh_entry *entry, struct sk_buff **pending) {
+	uint8_t count = entry->pending_count;
+
+	for(uint8_t i = 0; i < count; i++)
+		pending[i] = entry->pending[(entry->pending_head + i) % NEIGH_PENDING_MAX];
+	entry->pending_count = 0;
+
+	return count;
+}
+
+// Drops whatever waits on the entry
+static void neigh_pending_drop_locked(struct neigh_table *table, struct neigh_entry *entry) {
+	for(uint8_t i = 0; i < entry->pending_count; i++)
+		skb_free(entry->pending[(entry->pending_head + i) % NEIGH_PENDING_MAX]);
+
+	table->stats.pending_drops += entry->pending_count;
+	entry->pending_count = 0;
+}
+
+// Queues a buffer on an entry waiting for its answer, making room by dropping the oldest one
+static void neigh_pending_add_locked(struct neigh_table *table, struct neigh_entry *entry, struct sk_buff *buffer) {
+	if(entry->pending_count == NEIGH_PENDING_MAX) {
+		skb_free(entry->pending[entry->pending_head]);
+		entry->pending_head = (uint8_t)((entry->pending_head + 1) % NEIGH_PENDING_MAX);
+		entry->pending_count--;
+		table->stats.pending_drops++;
+	}
+
+	entry->pending[(entry->pending_head + entry->pending_count) % NEIGH_PENDING_MAX] = buffer;
+	entry->pending_count++;
+}
+
+// Frees the slot. A deleted slot only has to stay a tombstone while it is in the middle of a probe sequence, so a
+// run of them in front of a free slot becomes free again.
+static void neigh_delete_locked(struct neigh_table *table, struct neigh_entry *entry) {
+	uint32_t mask = neigh_table_size(table) - 1;
+
+	neigh_pending_drop_locked(table, entry);
+
+	neigh_write_begin(entry);
+	entry->state = NEIGH_STATE_DELETED;
+	neigh_write_end(entry);
+
+	uint32_t index = (uint32_t)(entry - table->entries);
+	if(table->entries[(index + 1) & mask].state != NEIGH_STATE_FREE)
+		return;
+
+	while(table->entries[index].state == NEIGH_STATE_DELETED) {
+		table->entries[index].state = NEIGH_STATE_FREE;  // no probe sequence goes past it, readers stopping here miss nothing
+		table->used--;
+		index = (index - 1) & mask;
+	}
+}
+
+void neigh_free(struct neigh_table *table) {
+	pthread_mutex_lock(&table->mutex);
+
+	for(uint32_t i = 0; i < neigh_table_size(table); i++) {
+		struct neigh_entry *entry = &table->entries[i];
+		if(entry->state == NEIGH_STATE_FREE)
+			continue;
+
+		neigh_pending_drop_locked(table, entry);
+
+		neigh_write_begin(entry);
+		entry->state = NEIGH_STATE_FREE;
+		neigh_write_end(entry);
+	}
+	table->used = 0;
+
+	pthread_mutex_unlock(&table->mutex);
+}
+
+// Slow path of a send when neigh_lookup() found no MAC, takes over the caller's reference to the buffer. It is sent
+// right away if the key got resolved in the meantime, otherwise once the answer arrives. The request goes out on the
+// buffer's queue, with the sender's next flush.
+int neigh_resolve(struct neigh_table *table, struct net_dev *dev, const uint8_t *key, struct sk_buff *buffer) {
+	pthread_mutex_lock(&table->mutex);
+
+	struct neigh_entry *slot;
+	struct neigh_entry *entry = neigh_find_locked(table, key, &slot);
+
+	if(entry != NULL && (entry->state == NEIGH_STATE_REACHABLE || entry->state == NEIGH_STATE_STALE)) {
+		uint8_t mac[6];
+		memcpy(mac, entry->mac, sizeof(mac));
+		pthread_mutex_unlock(&table->mutex);
+
+		return eth_write(mac, table->eth_type, buffer);
+	}
+
+	int request = 0;
+	if(entry == NULL) {
+		entry = neigh_insert_locked(table, slot, dev, key, NEIGH_STATE_INCOMPLETE, NULL);
+		if(entry == NULL) {
+			table->stats.pending_drops++;
+			pthread_mutex_unlock(&table->mutex);
+			fprintf(stderr, "%s table full, dropping packet\n", table->name);
+			skb_free(buffer);
+			return -1;
+		}
+
+		entry->next_request = neigh_time() + table->retrans_time;
+		table->stats.requests++;
+		request = 1;
+	}
+
+	uint16_t queue = buffer->queue_mapping;
+	neigh_pending_add_locked(table, entry, buffer);
+	pthread_mutex_unlock(&table->mutex);
+
+	if(request)
+		table->request(dev, queue, key);
+
+	return -1;
+}
+
+// Requests are sent with the mutex held, the timer only runs a few times a second
+static void neigh_request_locked(struct neigh_table *table, struct neigh_entry *entry, uint32_t now) {
+	entry->retries++;
+	entry->next_request = now + (table->backoff ? table->retrans_time << entry->retries : table->retrans_time);
+
+	table->request(entry->dev, 0, entry->key);
+	eth_flush(entry->dev, 0);
+}
+
+// One round of retransmitting unanswered requests, refreshing entries in use before they expire and aging out the
+// rest. Nothing on the packet path looks at the clock. Stale entries that get used are asked for right away, a
+// simpler take on RFC 4861's DELAY and PROBE states.
+void neigh_timer_run(struct neigh_table *table) {
+	pthread_mutex_lock(&table->mutex);
+	uint32_t now = neigh_time();
+
+	for(uint32_t i = 0; i < neigh_table_size(table); i++) {
+		struct neigh_entry *entry = &table->entries[i];
+
+		if(entry->state == NEIGH_STATE_INCOMPLETE) {
+			if(!neigh_time_after(now, entry->next_request))
+				continue;
+
+			if(entry->retries >= table->max_retries) {
+				table->stats.failed++;
+				neigh_delete_locked(table, entry);
+				continue;
+			}
+
+			table->stats.retries++;
+			neigh_request_locked(table, entry, now);
+		}
+		else if(entry->state == NEIGH_STATE_REACHABLE) {
+			if(neigh_time_after(now, entry->expires)) {
+				table->stats.expired++;
+				neigh_delete_locked(table, entry);
+				continue;
+			}
+
+			if(!neigh_time_after(now, entry->expires - table->refresh_time))
+				continue;
+
+			// Only sends from here on decide, dst cache hits mark the entry as well
+			if(!entry->stale) {
+				atomic_store_explicit(&entry->used, 0, memory_order_relaxed);
+				entry->stale = 1;
+				continue;
+			}
+
+			// Hot neighbors are asked again while their MAC is still used, so traffic never waits on them
+			if(atomic_load_explicit(&entry->used, memory_order_relaxed) &&
+			   (entry->retries == 0 || neigh_time_after(now, entry->next_request))) {
+				table->stats.refreshes++;
+				neigh_request_locked(table, entry, now);
+			}
+		}
+		else if(entry->state == NEIGH_STATE_STALE) {
+			if(neigh_time_after(now, entry->expires)) {
+				table->stats.expired++;
+				neigh_delete_locked(table, entry);
+				continue;
+			}
+
+			if(!atomic_load_explicit(&entry->used, memory_order_relaxed) ||
+			   (entry->retries > 0 && !neigh_time_after(now, entry->next_request)))
+				continue;
+
+			if(entry->retries >= table->max_retries) {
+				table->stats.failed++;
+				neigh_delete_locked(table, entry);
+				continue;
+			}
+
+			table->stats.refreshes++;
+			neigh_request_locked(table, entry, now);
+		}
+	}
+
+	pthread_mutex_unlock(&table->mutex);
+}
+
+void neigh_print_stats(struct neigh_table *table) {
+	pthread_mutex_lock(&table->mutex);
+	printf("%s: %u slots used | requests %" PRIu64 " | retries %" PRIu64 " | refreshes %" PRIu64 " | failed %"
+		   PRIu64 " | expired %" PRIu64 " | pending drops %" PRIu64 "\n", table->name, table->used,
+		   table->stats.requests, table->stats.retries, table->stats.refreshes, table->stats.failed,
+		   table->stats.expired, table->stats.pending_drops);
+	pthread_mutex_unlock(&table->mutex);
+}
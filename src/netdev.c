@@ -0,0 +1,340 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/if_ether.h>
+#include <linux/icmp.h>
+
+#include "netdev.h"
+#include "eth.h"
+#include "arp.h"
+#include "ipv4.h"
+#include "ipv4_frag.h"
+#include "ipv6.h"
+
+#define NET_DEV_POLL_RATE_NS 1
+
+
+struct net_dev *net_dev_open(const struct net_dev_ops *ops, const char *name, uint16_t queue_count, uint32_t features,
+							 uint16_t mtu, const void *arg) {
+	struct net_dev *dev = malloc(sizeof(struct net_dev));
+	if(dev == NULL) {
+		perror("could not allocate memory for network device");
+		exit(1);
+	}
+	memset(dev, 0, sizeof(struct net_dev));
+
+	dev->ops = ops;
+	strncpy(dev->name, name, IFNAMSIZ - 1);
+	dev->mtu = mtu;
+	dev->rx_batch = ETH_RX_BATCH_DEFAULT;
+
+	for(uint16_t i = 0; i < queue_count; i++) {
+		struct net_queue *queue = &dev->queues[i];
+
+		queue->dev = dev;
+		queue->index = i;
+		queue->fd = -1;
+		pthread_mutex_init(&queue->lock, NULL);
+		pthread_mutex_init(&queue->tx_lock, NULL);
+		INIT_LIST_HEAD(&queue->sockets);
+	}
+	dev->queue_count = queue_count;
+
+	if(ops->open(dev, features, arg) < 0) {
+		for(uint16_t i = 0; i < queue_count; i++) {
+			pthread_mutex_destroy(&dev->queues[i].lock);
+			pthread_mutex_destroy(&dev->queues[i].tx_lock);
+		}
+
+		free(dev);
+		return NULL;
+	}
+
+	if(dev->mtu == 0)
+		dev->mtu = NET_DEV_DEFAULT_MTU;
+
+	return dev;
+}
+
+// The queue workers have to be stopped
+void net_dev_close(struct net_dev *dev) {
+	dev->ops->close(dev);
+
+	for(uint16_t i = 0; i < dev->queue_count; i++) {
+		pthread_mutex_destroy(&dev->queues[i].lock);
+		pthread_mutex_destroy(&dev->queues[i].tx_lock);
+	}
+
+	free(dev);
+}
+
+
+// Sets the MTU of a kernel interface unless mtu is 0, returns the MTU in effect or -1
+int net_dev_if_mtu(const char *ifname, uint16_t mtu) {
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if(fd < 0) {
+		perror("cannot open socket for interface MTU");
+		return -1;
+	}
+
+	struct ifreq ifr = {0};
+	strncpy(ifr.ifr_name, ifname, IFNAMSIZ - 1);
+
+	if(mtu != 0) {
+		ifr.ifr_mtu = mtu;
+		if(ioctl(fd, SIOCSIFMTU, &ifr) < 0)
+			perror("could not set interface MTU");
+	}
+
+	int res = ioctl(fd, SIOCGIFMTU, &ifr);
+	close(fd);
+	if(res < 0) {
+		perror("could not get interface MTU");
+		return -1;
+	}
+
+	return ifr.ifr_mtu;
+}
+
+
+// Picks the queue of a flow, the same for both directions as long as local and remote are kept in order
+struct net_queue *net_dev_flow_queue(struct net_dev *dev, uint32_t local_ip, uint32_t remote_ip, uint16_t local_port,
+									 uint16_t remote_port) {
+	uint32_t hash = local_ip ^ remote_ip ^ ((uint32_t)local_port << 16 | remote_port);
+	hash *= 0x9e3779b1;  // golden ratio, spreads the bits
+
+	return &dev->queues[(hash >> 16) % dev->queue_count];
+}
+
+
+static int net_dev_handle_frame(struct net_dev *dev, struct sk_buff *buffer) {
+	struct eth_frame *eth_frame = eth_frame_from_skb(buffer);
+
+	skb_pull(buffer, ETHERNET_HEADER_SIZE);
+	skb_reset_network_header(buffer);
+
+	if(eth_frame->eth_type == ETH_P_ARP) {
+		return arp_process_packet(dev, buffer);
+	}
+
+	else if(eth_frame->eth_type == ETH_P_IP) {
+		return ipv4_process_packet(dev, buffer);
+	}
+
+	else if(eth_frame->eth_type == ETH_P_IPV6) {
+		return ipv6_process_packet(dev, buffer);
+	}
+
+	else {
+		printf("unknown Ethernet type: %d\n", eth_frame->eth_type);
+		return -1;
+	}
+}
+
+// Queue of the TCP flow an unfragmented IPv4 datagram carries, or quotes in an ICMP error, NULL if it has none. len
+// is how much of the datagram can be read.
+struct net_queue *net_dev_ipv4_queue(struct net_dev *dev, const struct ipv4_packet *ip_packet, uint32_t len) {
+	if(len < IP_HEADER_SIZE)
+		return NULL;
+
+	uint32_t header_len = (uint32_t)ip_packet->header_len * 4;
+	const uint8_t *payload = (const uint8_t *)ip_packet + header_len;
+
+	if(ip_packet->protocol == IPPROTO_TCP && len >= header_len + 4) {
+		const uint16_t *ports = (const uint16_t *)payload;
+		return net_dev_flow_queue(dev, ip_packet->dest_ip, ip_packet->source_ip, ntohs(ports[1]), ntohs(ports[0]));
+	}
+
+	// Errors quoting one of our TCP segments go to that flow, its socket's MSS may have to shrink
+	if(ip_packet->protocol == IPPROTO_ICMP && len >= header_len + 8 + IP_HEADER_SIZE + 4) {
+		const struct ipv4_packet *quoted = (const struct ipv4_packet *)(payload + 8);
+
+		if(payload[0] == ICMP_DEST_UNREACH && quoted->protocol == IPPROTO_TCP &&
+		   len >= header_len + 8 + quoted->header_len * 4 + 4) {
+			const uint16_t *ports = (const uint16_t *)((const uint8_t *)quoted + quoted->header_len * 4);
+			return net_dev_flow_queue(dev, quoted->source_ip, quoted->dest_ip, ntohs(ports[0]), ntohs(ports[1]));
+		}
+	}
+
+	return NULL;
+}
+
+// Queue whose lock covers the frame: TCP segments belong to the queue of their flow, IPv4 fragments to the one
+// reassembling them, everything else to the queue it was received on
+static struct net_queue *net_dev_frame_queue(struct net_dev *dev, struct sk_buff *buffer) {
+	struct eth_frame *eth_frame = eth_frame_from_skb(buffer);
+
+	struct ipv4_packet *ip_packet = (struct ipv4_packet *)eth_frame->payload;
+	if(eth_frame->eth_type == ETH_P_IP && buffer->len >= ETHERNET_HEADER_SIZE + IP_HEADER_SIZE) {
+		// Only the first fragment has the ports, ipv4_process_packet() steers the datagram again once it's whole
+		if(ip_packet->fragment_offset & htons(IP_FLAG_MF | IPV4_FRAG_OFFSET_MASK))
+			return &dev->queues[NET_DEV_FRAG_QUEUE];
+
+		struct net_queue *queue = net_dev_ipv4_queue(dev, ip_packet, buffer->len - ETHERNET_HEADER_SIZE);
+		if(queue != NULL)
+			return queue;
+	}
+
+	struct ipv6_packet *ipv6_packet = (struct ipv6_packet *)eth_frame->payload;
+	if(eth_frame->eth_type == ETH_P_IPV6 && buffer->len >= ETHERNET_HEADER_SIZE + IPV6_HEADER_SIZE + 4 &&
+	   ipv6_packet->next_header == IPPROTO_TCP) {
+		uint16_t *ports = (uint16_t *)ipv6_packet->data;
+		struct sock_addr local = sock_addr_ipv6(ipv6_packet->dest_ip), remote = sock_addr_ipv6(ipv6_packet->source_ip);
+		return net_dev_flow_queue(dev, sock_addr_fold(&local), sock_addr_fold(&remote), ntohs(ports[1]),
+								  ntohs(ports[0]));
+	}
+
+	return &dev->queues[buffer->queue_mapping];
+}
+
+// RX worker of one device queue
+static void *net_dev_queue_loop(void *args) {
+	struct net_queue *queue = (struct net_queue *)args;
+	struct net_dev *dev = queue->dev;
+
+	struct pollfd poll_fd = { .fd = queue->fd, .events = POLLIN | POLLNVAL | POLLERR | POLLHUP };
+	struct timespec poll_interval = { .tv_sec = 0, .tv_nsec = NET_DEV_POLL_RATE_NS };
+
+	struct eth_rx_ring rx_ring;
+	eth_rx_ring_init(&rx_ring, dev);
+
+	while(atomic_load_explicit(&dev->running, memory_order_relaxed)) {
+		int ready;
+		if(dev->ops->rx_wait != NULL)
+			ready = dev->ops->rx_wait(dev, queue->index);
+		else if(queue->fd < 0) {
+			// Nothing to wait on, the driver is polled on every round
+			ready = 1;
+		}
+		else {
+			int res = ppoll(&poll_fd, 1, &poll_interval, NULL);
+			if(res < 0) {
+				perror("main loop: poll error");
+				break;
+			}
+
+			if(poll_fd.revents & POLLIN)
+				ready = 1;
+			else
+				ready = poll_fd.revents & (POLLNVAL | POLLERR | POLLHUP) ? -1 : 0;
+		}
+
+		if(ready < 0)
+			break;
+
+		if(ready) {
+			// Drain the queue, then process the batch under one lock. The kernel delivers a flow on the queue we
+			// last sent it through, so frames steered to another queue are rare and take that queue's lock.
+			struct sk_buff *buffers[ETH_RX_BATCH_MAX];
+			struct net_queue *targets[ETH_RX_BATCH_MAX];
+			uint32_t count = eth_read_batch(dev, queue->index, &rx_ring, buffers, dev->rx_batch);
+
+			// A polled driver with nothing to hand over leaves the CPU to the threads feeding it
+			if(count == 0 && queue->fd < 0)
+				sched_yield();
+
+			pthread_mutex_lock(&queue->lock);
+			for(uint32_t i = 0; i < count; i++) {
+				targets[i] = net_dev_frame_queue(dev, buffers[i]);
+				if(targets[i] == queue)
+					net_dev_handle_frame(dev, buffers[i]);
+			}
+			pthread_mutex_unlock(&queue->lock);
+
+			for(uint32_t i = 0; i < count; i++) {
+				if(targets[i] == queue)
+					continue;
+
+				pthread_mutex_lock(&targets[i]->lock);
+				net_dev_handle_frame(dev, buffers[i]);
+				pthread_mutex_unlock(&targets[i]->lock);
+			}
+
+			for(uint32_t i = 0; i < count; i++)
+				eth_rx_ring_recycle(&rx_ring, buffers[i]);
+		}
+
+		// Frames sent during the batch, or by other threads since the last wakeup, go out together
+		eth_flush(dev, queue->index);
+	}
+
+	eth_rx_ring_free(&rx_ring);
+	skb_pool_flush_local();
+	return NULL;
+}
+
+// Starts one RX worker per queue
+void net_dev_start(struct net_dev *dev, uint32_t rx_batch) {
+	dev->rx_batch = rx_batch;
+	atomic_store(&dev->running, 1);
+
+	for(uint16_t i = 0; i < dev->queue_count; i++) {
+		int res = pthread_create(&dev->queues[i].thread, NULL, net_dev_queue_loop, &dev->queues[i]);
+		if(res != 0) {
+			fprintf(stderr, "failed to create worker of queue #%d: %s\n", i, strerror(res));
+			exit(1);
+		}
+	}
+}
+
+// Frames still queued when the workers are gone are sent right away
+void net_dev_stop(struct net_dev *dev) {
+	atomic_store(&dev->running, 0);
+
+	for(uint16_t i = 0; i < dev->queue_count; i++)
+		pthread_join(dev->queues[i].thread, NULL);
+
+	net_dev_flush(dev);
+}
+
+// Flush point for senders outside of the queue workers, like timers
+void net_dev_flush(struct net_dev *dev) {
+	for(uint16_t i = 0; i < dev->queue_count; i++)
+		eth_flush(dev, i);
+}
+
+
+void net_batch_stats_add(struct net_batch_stats *stats, uint32_t count) {
+	stats->batches++;
+	stats->frames += count;
+	if(count > stats->max_batch)
+		stats->max_batch = count;
+
+	uint32_t bucket = 0;
+	while((count >> (bucket + 1)) && bucket < NET_BATCH_HISTOGRAM_SIZE - 1)
+		bucket++;
+	stats->histogram[bucket]++;
+}
+
+static void net_batch_stats_print(struct net_dev *dev, uint16_t queue, const char *dir,
+								  const struct net_batch_stats *stats) {
+	printf("%s queue #%d %s batches: %" PRIu64 " | frames: %" PRIu64 " | avg batch: %.2f | max batch: %u\n",
+		   dev->name, queue, dir, stats->batches, stats->frames,
+		   stats->batches ? (double)stats->frames / stats->batches : 0.0, stats->max_batch);
+
+	for(uint32_t j = 0; j < NET_BATCH_HISTOGRAM_SIZE; j++) {
+		if(j < NET_BATCH_HISTOGRAM_SIZE - 1)
+			printf("  %3u-%-3u %" PRIu64 "\n", 1u << j, (2u << j) - 1, stats->histogram[j]);
+		else
+			printf("  %3u+    %" PRIu64 "\n", 1u << j, stats->histogram[j]);
+	}
+}
+
+void net_dev_print_stats(struct net_dev *dev) {
+	for(uint16_t i = 0; i < dev->queue_count; i++) {
+		net_batch_stats_print(dev, i, "RX", &dev->queues[i].rx_stats);
+		net_batch_stats_print(dev, i, "TX", &dev->queues[i].tx_stats);
+	}
+
+	if(dev->ops->print_stats != NULL)
+		dev->ops->print_stats(dev);
+}
@@ -0,0 +1,343 @@
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/if_ether.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include "packet.h"
+#include "eth.h"
+
+
+static struct tpacket_block_desc *packet_rx_block(struct packet_ring *ring, uint32_t index) {
+	return (struct tpacket_block_desc *)(ring->rx_ring + (size_t)index * ring->rx_req.tp_block_size);
+}
+
+static struct tpacket3_hdr *packet_tx_slot(struct packet_ring *ring, uint32_t index) {
+	return (struct tpacket3_hdr *)(ring->tx_ring + (size_t)index * ring->tx_req.tp_frame_size);
+}
+
+// The kernel changes status words behind our back, everything they guard is read after them
+static uint32_t packet_load_status(uint32_t *status) {
+	uint32_t value = *(volatile uint32_t *)status;
+	atomic_thread_fence(memory_order_acquire);
+	return value;
+}
+
+static void packet_store_status(uint32_t *status, uint32_t value) {
+	atomic_thread_fence(memory_order_release);
+	*(volatile uint32_t *)status = value;
+}
+
+// Called when no sk_buff points into the block anymore
+static void packet_block_release(struct skb_page *page) {
+	struct tpacket_block_desc *block = page->private;
+	packet_store_status(&block->hdr.bh1.block_status, TP_STATUS_KERNEL);
+}
+
+
+static int packet_open_queue(struct net_queue *queue, int ifindex, int fanout, uint32_t tx_frame_size) {
+	// No protocol until bound, or frames of every interface would be queued
+	int fd = socket(AF_PACKET, SOCK_RAW, 0);
+	if(fd < 0) {
+		perror("cannot open AF_PACKET socket");
+		return -1;
+	}
+
+	struct packet_ring *ring = calloc(1, sizeof(struct packet_ring));
+	if(ring == NULL) {
+		perror("could not allocate memory for packet ring");
+		exit(1);
+	}
+	pthread_mutex_init(&ring->tx_lock, NULL);
+	queue->fd = fd;
+	queue->priv = ring;
+
+	int version = TPACKET_V3;
+	if(setsockopt(fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) {
+		perror("TPACKET_V3 is not supported");
+		return -1;
+	}
+
+	ring->rx_req.tp_block_size = PACKET_BLOCK_SIZE;
+	ring->rx_req.tp_block_nr = PACKET_RX_BLOCKS;
+	ring->rx_req.tp_frame_size = PACKET_FRAME_SIZE;
+	ring->rx_req.tp_frame_nr = PACKET_RX_BLOCKS * (PACKET_BLOCK_SIZE / PACKET_FRAME_SIZE);
+	ring->rx_req.tp_retire_blk_tov = PACKET_RX_BLOCK_TIMEOUT;
+	if(setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &ring->rx_req, sizeof(ring->rx_req)) < 0) {
+		perror("could not set up packet RX ring");
+		return -1;
+	}
+
+	ring->tx_req.tp_block_size = PACKET_BLOCK_SIZE;
+	ring->tx_req.tp_block_nr = PACKET_TX_BLOCKS;
+	ring->tx_req.tp_frame_size = tx_frame_size;
+	ring->tx_req.tp_frame_nr = PACKET_TX_BLOCKS * (PACKET_BLOCK_SIZE / tx_frame_size);
+	if(setsockopt(fd, SOL_PACKET, PACKET_TX_RING, &ring->tx_req, sizeof(ring->tx_req)) < 0) {
+		perror("could not set up packet TX ring");
+		return -1;
+	}
+
+	// RX ring first, TX ring right behind it
+	size_t rx_size = (size_t)ring->rx_req.tp_block_size * ring->rx_req.tp_block_nr;
+	size_t tx_size = (size_t)ring->tx_req.tp_block_size * ring->tx_req.tp_block_nr;
+	ring->map = mmap(NULL, rx_size + tx_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+	if(ring->map == MAP_FAILED) {
+		ring->map = NULL;
+		perror("could not map packet rings");
+		return -1;
+	}
+	ring->map_size = rx_size + tx_size;
+	ring->rx_ring = ring->map;
+	ring->tx_ring = ring->map + rx_size;
+
+	struct sockaddr_ll addr = {0};
+	addr.sll_family = AF_PACKET;
+	addr.sll_protocol = htons(ETH_P_ALL);
+	addr.sll_ifindex = ifindex;
+	if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("could not bind packet socket");
+		return -1;
+	}
+
+	// Our own frames are not for us, and there's no point in queueing them in the qdisc
+	int one = 1;
+#ifdef PACKET_IGNORE_OUTGOING
+	setsockopt(fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &one, sizeof(one));
+#endif
+	setsockopt(fd, SOL_PACKET, PACKET_QDISC_BYPASS, &one, sizeof(one));
+
+	// Queues of the device share the interface's frames by flow hash
+	if(fanout >= 0) {
+		int arg = fanout | (PACKET_FANOUT_HASH << 16);
+		if(setsockopt(fd, SOL_PACKET, PACKET_FANOUT, &arg, sizeof(arg)) < 0) {
+			perror("could not join packet fanout group");
+			return -1;
+		}
+	}
+
+	return fd;
+}
+
+static void packet_close(struct net_dev *dev);
+
+static int packet_open(struct net_dev *dev, uint32_t features, const void *arg) {
+	int ifindex = (int)if_nametoindex(dev->name);
+	if(ifindex == 0) {
+		perror("unknown interface");
+		return -1;
+	}
+
+	int mtu = net_dev_if_mtu(dev->name, dev->mtu);
+	dev->mtu = mtu > 0 ? (uint16_t)mtu : 0;
+
+	// TX slots take a full sized frame, block size is a multiple of them
+	uint32_t tx_frame_size = PACKET_FRAME_SIZE;
+	while(tx_frame_size < PACKET_TX_DATA_OFFSET + eth_max_frame_size(dev) && tx_frame_size < PACKET_BLOCK_SIZE)
+		tx_frame_size *= 2;
+
+	int fanout = dev->queue_count > 1 ? getpid() & 0xffff : -1;
+	for(uint16_t i = 0; i < dev->queue_count; i++) {
+		if(packet_open_queue(&dev->queues[i], ifindex, fanout, tx_frame_size) < 0) {
+			packet_close(dev);
+			return -1;
+		}
+	}
+
+	struct ifreq ifr = {0};
+	strncpy(ifr.ifr_name, dev->name, IFNAMSIZ - 1);
+	if(ioctl(dev->queues[0].fd, SIOCGIFHWADDR, &ifr) < 0) {
+		perror("could not get interface address");
+		packet_close(dev);
+		return -1;
+	}
+	memcpy(dev->hwaddr, ifr.ifr_hwaddr.sa_data, sizeof(dev->hwaddr));
+
+	return 0;
+}
+
+static void packet_close(struct net_dev *dev) {
+	for(uint16_t i = 0; i < dev->queue_count; i++) {
+		struct packet_ring *ring = dev->queues[i].priv;
+
+		if(ring != NULL) {
+			if(ring->rx_page != NULL)
+				skb_page_put(ring->rx_page);
+			if(ring->map != NULL)
+				munmap(ring->map, ring->map_size);
+			pthread_mutex_destroy(&ring->tx_lock);
+			free(ring);
+			dev->queues[i].priv = NULL;
+		}
+
+		if(dev->queues[i].fd >= 0)
+			close(dev->queues[i].fd);
+		dev->queues[i].fd = -1;
+	}
+}
+
+
+// Steps to the next frame, the block is handed back once its last frame was taken
+static struct tpacket3_hdr *packet_rx_next(struct packet_ring *ring) {
+	if(ring->rx_page == NULL) {
+		struct tpacket_block_desc *block = packet_rx_block(ring, ring->rx_block);
+		if(!(packet_load_status(&block->hdr.bh1.block_status) & TP_STATUS_USER))
+			return NULL;
+
+		ring->rx_page = skb_page_wrap((uint8_t *)block, ring->rx_req.tp_block_size, packet_block_release, block);
+		ring->rx_frame = (struct tpacket3_hdr *)((uint8_t *)block + block->hdr.bh1.offset_to_first_pkt);
+		ring->rx_frames_left = block->hdr.bh1.num_pkts;
+	}
+
+	struct tpacket3_hdr *frame = NULL;
+	if(ring->rx_frames_left > 0) {
+		frame = ring->rx_frame;
+		ring->rx_frame = (struct tpacket3_hdr *)((uint8_t *)frame + frame->tp_next_offset);
+		ring->rx_frames_left--;
+	}
+
+	return frame;
+}
+
+static void packet_rx_block_done(struct packet_ring *ring) {
+	skb_page_put(ring->rx_page);
+	ring->rx_page = NULL;
+	ring->rx_block = (ring->rx_block + 1) % ring->rx_req.tp_block_nr;
+}
+
+// Wraps up to max received frames without copying them, the RX ring of the stack isn't needed
+static uint32_t packet_rx_batch(struct net_dev *dev, uint16_t queue, struct eth_rx_ring *ring_unused,
+								struct sk_buff **buffers, uint32_t max) {
+	struct packet_ring *ring = dev->queues[queue].priv;
+	uint32_t count = 0;
+
+	while(count < max) {
+		struct tpacket3_hdr *frame = packet_rx_next(ring);
+		if(frame == NULL) {
+			if(ring->rx_page == NULL)
+				break;  // the kernel still owns the block
+
+			packet_rx_block_done(ring);
+			continue;
+		}
+
+		// Frames cut short by the block size are useless to us
+		if(frame->tp_snaplen == frame->tp_len && frame->tp_snaplen >= ETHERNET_HEADER_SIZE) {
+			uint32_t offset = (uint32_t)((uint8_t *)frame - ring->rx_page->data) + frame->tp_mac;
+			struct sk_buff *buffer = skb_wrap(ring->rx_page, offset, frame->tp_snaplen);
+
+			buffer->dev = dev;
+			buffer->queue_mapping = queue;
+
+			// Frames from the local host may only have the pseudo header summed, they never touched a wire
+			if(frame->tp_status & (TP_STATUS_CSUMNOTREADY | TP_STATUS_CSUM_VALID))
+				buffer->ip_summed = CHECKSUM_UNNECESSARY;
+
+			buffers[count++] = buffer;
+		}
+
+		if(ring->rx_frames_left == 0)
+			packet_rx_block_done(ring);
+	}
+
+	return count;
+}
+
+
+static void packet_kick(int fd, int flags) {
+	if(send(fd, NULL, 0, flags) < 0 && errno != EAGAIN && errno != ENOBUFS)
+		perror("failed to kick packet TX ring");
+}
+
+static int packet_tx_slot_busy(struct tpacket3_hdr *slot) {
+	return (packet_load_status(&slot->tp_status) & (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING)) != 0;
+}
+
+// Copies the frame into the next TX slot, the caller holds the TX lock
+static int packet_tx_one(struct net_queue *queue, struct packet_ring *ring, struct sk_buff *buffer) {
+	uint32_t len = buffer->len;
+	if(len > ring->tx_req.tp_frame_size - PACKET_TX_DATA_OFFSET) {
+		fprintf(stderr, "frame of %u bytes does not fit a packet TX slot\n", len);
+		return -1;
+	}
+
+	struct tpacket3_hdr *slot = packet_tx_slot(ring, ring->tx_frame);
+	if(packet_tx_slot_busy(slot)) {
+		// Ring is full, wait until the kernel sent what's queued
+		packet_kick(queue->fd, 0);
+		ring->tx_pending = 0;
+
+		if(packet_tx_slot_busy(slot)) {
+			fprintf(stderr, "packet TX ring is full, dropping frame\n");
+			return -1;
+		}
+	}
+
+	uint8_t *data = (uint8_t *)slot + PACKET_TX_DATA_OFFSET;
+	memcpy(data, buffer->data, skb_headlen(buffer));
+	data += skb_headlen(buffer);
+	for(int i = 0; i < buffer->nr_frags; i++) {
+		memcpy(data, skb_frag_address(&buffer->frags[i]), buffer->frags[i].len);
+		data += buffer->frags[i].len;
+	}
+
+	slot->tp_len = len;
+	slot->tp_next_offset = 0;
+	packet_store_status(&slot->tp_status, TP_STATUS_SEND_REQUEST);
+
+	ring->tx_frame = (ring->tx_frame + 1) % ring->tx_req.tp_frame_nr;
+
+	// Don't let a long burst wait for the flush
+	if(++ring->tx_pending >= ring->tx_req.tp_frame_nr / 2) {
+		packet_kick(queue->fd, MSG_DONTWAIT);
+		ring->tx_pending = 0;
+	}
+
+	return 0;
+}
+
+// Fills TX slots, the frames are sent by the next packet_flush()
+static uint32_t packet_tx_batch(struct net_dev *dev, uint16_t queue, struct sk_buff **buffers, uint32_t count) {
+	struct packet_ring *ring = dev->queues[queue].priv;
+	uint32_t sent = 0;
+
+	pthread_mutex_lock(&ring->tx_lock);
+	for(uint32_t i = 0; i < count; i++) {
+		if(packet_tx_one(&dev->queues[queue], ring, buffers[i]) == 0)
+			sent++;
+	}
+	pthread_mutex_unlock(&ring->tx_lock);
+
+	for(uint32_t i = 0; i < count; i++)
+		skb_free(buffers[i]);
+
+	return sent;
+}
+
+// Sends every frame queued since the last flush with a single syscall
+static void packet_flush(struct net_dev *dev, uint16_t queue) {
+	struct packet_ring *ring = dev->queues[queue].priv;
+
+	pthread_mutex_lock(&ring->tx_lock);
+	if(ring->tx_pending > 0) {
+		packet_kick(dev->queues[queue].fd, MSG_DONTWAIT);
+		ring->tx_pending = 0;
+	}
+	pthread_mutex_unlock(&ring->tx_lock);
+}
+
+
+const struct net_dev_ops packet_ops = {
+	.name = "packet",
+	.open = packet_open,
+	.close = packet_close,
+	.rx_batch = packet_rx_batch,
+	.tx_batch = packet_tx_batch,
+	.flush = packet_flush,
+};
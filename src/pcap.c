@@ -0,0 +1,420 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <byteswap.h>
+
+#include "pcap.h"
+#include "eth.h"
+
+
+struct pcapng_interface {
+	uint16_t linktype;
+	uint64_t units;  // timestamp units per second
+};
+
+
+static uint64_t pcap_now_ns(clockid_t clock) {
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// Fields are read with memcpy, pcapng only guarantees 4 byte alignment relative to the file start
+static uint16_t pcap_u16(const uint8_t *p, int swapped) {
+	uint16_t value;
+	memcpy(&value, p, sizeof(value));
+	return swapped ? bswap_16(value) : value;
+}
+
+static uint32_t pcap_u32(const uint8_t *p, int swapped) {
+	uint32_t value;
+	memcpy(&value, p, sizeof(value));
+	return swapped ? bswap_32(value) : value;
+}
+
+static uint64_t pcap_ts_to_ns(uint64_t ts, uint64_t units) {
+	return ts / units * 1000000000ull + ts % units * 1000000000ull / units;
+}
+
+static void pcap_add_frame(struct pcap_replay *replay, const uint8_t *data, uint32_t len, uint64_t ts_ns) {
+	// Truncated records without a whole Ethernet header would trip up the stack
+	if(len < ETHERNET_HEADER_SIZE) {
+		replay->skipped++;
+		return;
+	}
+
+	if(replay->frame_count == replay->frame_capacity) {
+		replay->frame_capacity = replay->frame_capacity == 0 ? 1024 : replay->frame_capacity * 2;
+		replay->frames = realloc(replay->frames, replay->frame_capacity * sizeof(struct pcap_frame));
+		if(replay->frames == NULL) {
+			perror("could not allocate memory for capture index");
+			exit(1);
+		}
+	}
+
+	struct pcap_frame *frame = &replay->frames[replay->frame_count++];
+	frame->data = data;
+	frame->len = len;
+	frame->ts_ns = ts_ns;
+	replay->frame_bytes += len;
+}
+
+
+static int pcap_index_classic(struct pcap_replay *replay, const char *path) {
+	const uint8_t *file = replay->file;
+	uint32_t magic = pcap_u32(file, 0);
+	int swapped = magic == bswap_32(PCAP_MAGIC_US) || magic == bswap_32(PCAP_MAGIC_NS);
+	int nano = magic == PCAP_MAGIC_NS || magic == bswap_32(PCAP_MAGIC_NS);
+
+	if(replay->file_size < sizeof(struct pcap_file_header)) {
+		fprintf(stderr, "%s: truncated pcap header\n", path);
+		return -1;
+	}
+
+	uint32_t linktype = pcap_u32(file + offsetof(struct pcap_file_header, linktype), swapped);
+	if((linktype & 0xffff) != PCAP_LINKTYPE_ETHERNET) {
+		fprintf(stderr, "%s: link type %u is not Ethernet\n", path, linktype);
+		return -1;
+	}
+
+	size_t offset = sizeof(struct pcap_file_header);
+	while(offset + sizeof(struct pcap_record_header) <= replay->file_size) {
+		const uint8_t *record = file + offset;
+		uint32_t ts_sec = pcap_u32(record + offsetof(struct pcap_record_header, ts_sec), swapped);
+		uint32_t ts_frac = pcap_u32(record + offsetof(struct pcap_record_header, ts_frac), swapped);
+		uint32_t caplen = pcap_u32(record + offsetof(struct pcap_record_header, caplen), swapped);
+
+		offset += sizeof(struct pcap_record_header);
+		if(caplen > replay->file_size - offset) {
+			fprintf(stderr, "%s: last record is truncated, ignoring it\n", path);
+			break;
+		}
+
+		pcap_add_frame(replay, file + offset, caplen, ts_sec * 1000000000ull + ts_frac * (nano ? 1ull : 1000ull));
+		offset += caplen;
+	}
+
+	return 0;
+}
+
+static void pcapng_parse_idb(const uint8_t *block, uint32_t block_len, int swapped,
+							 struct pcapng_interface *interface) {
+	interface->linktype = pcap_u16(block + 8, swapped);
+	interface->units = 1000000;
+
+	// Options follow the fixed part, each padded to 4 bytes
+	uint32_t offset = 16;
+	while(offset + 4 <= block_len - 4) {
+		uint16_t code = pcap_u16(block + offset, swapped);
+		uint16_t len = pcap_u16(block + offset + 2, swapped);
+		if(code == 0 || offset + 4 + len > block_len - 4)
+			break;
+
+		if(code == PCAPNG_OPT_IF_TSRESOL && len >= 1) {
+			uint8_t resol = block[offset + 4];
+			uint8_t exponent = resol & 0x7f;
+			if(exponent < 64 && ((resol & 0x80) || exponent <= 19)) {
+				interface->units = 1;
+				for(uint8_t i = 0; i < exponent; i++)
+					interface->units *= resol & 0x80 ? 2 : 10;
+			}
+		}
+
+		offset += 4 + ((len + 3u) & ~3u);
+	}
+}
+
+static int pcap_index_pcapng(struct pcap_replay *replay, const char *path) {
+	const uint8_t *file = replay->file;
+	struct pcapng_interface interfaces[PCAPNG_MAX_INTERFACES];
+	uint32_t interface_count = 0;
+	int swapped = 0;
+
+	size_t offset = 0;
+	while(offset + 12 <= replay->file_size) {
+		const uint8_t *block = file + offset;
+
+		// The section header type reads the same in both byte orders, its magic tells which one the section uses
+		if(pcap_u32(block, 0) == PCAPNG_BLOCK_SHB) {
+			uint32_t magic = pcap_u32(block + 8, 0);
+			if(magic != PCAPNG_BYTE_ORDER_MAGIC && magic != bswap_32(PCAPNG_BYTE_ORDER_MAGIC)) {
+				fprintf(stderr, "%s: bad pcapng byte order magic\n", path);
+				return -1;
+			}
+			swapped = magic != PCAPNG_BYTE_ORDER_MAGIC;
+			interface_count = 0;
+		}
+
+		uint32_t type = pcap_u32(block, swapped);
+		uint32_t block_len = pcap_u32(block + 4, swapped);
+		if(block_len < 12 || block_len % 4 != 0 || block_len > replay->file_size - offset) {
+			fprintf(stderr, "%s: bad or truncated block at offset %zu, ignoring the rest\n", path, offset);
+			break;
+		}
+
+		if(type == PCAPNG_BLOCK_IDB && block_len >= 20) {
+			if(interface_count < PCAPNG_MAX_INTERFACES)
+				pcapng_parse_idb(block, block_len, swapped, &interfaces[interface_count]);
+			interface_count++;
+		}
+
+		else if(type == PCAPNG_BLOCK_EPB && block_len >= 32) {
+			uint32_t id = pcap_u32(block + 8, swapped);
+			uint64_t ts = (uint64_t)pcap_u32(block + 12, swapped) << 32 | pcap_u32(block + 16, swapped);
+			uint32_t caplen = pcap_u32(block + 20, swapped);
+
+			if(id < interface_count && id < PCAPNG_MAX_INTERFACES && caplen <= block_len - 32 &&
+			   interfaces[id].linktype == PCAP_LINKTYPE_ETHERNET)
+				pcap_add_frame(replay, block + 28, caplen, pcap_ts_to_ns(ts, interfaces[id].units));
+		}
+
+		// No timestamp, and only as much of the packet as the block holds
+		else if(type == PCAPNG_BLOCK_SPB && block_len >= 16) {
+			uint32_t len = pcap_u32(block + 8, swapped);
+			uint32_t caplen = len < block_len - 16 ? len : block_len - 16;
+
+			if(interface_count > 0 && interfaces[0].linktype == PCAP_LINKTYPE_ETHERNET)
+				pcap_add_frame(replay, block + 12, caplen, 0);
+		}
+
+		offset += block_len;
+	}
+
+	return 0;
+}
+
+static int pcap_load(struct pcap_replay *replay, const char *path) {
+	int fd = open(path, O_RDONLY);
+	if(fd < 0) {
+		perror(path);
+		return -1;
+	}
+
+	struct stat st;
+	if(fstat(fd, &st) < 0 || st.st_size < 4) {
+		fprintf(stderr, "%s: not a capture file\n", path);
+		close(fd);
+		return -1;
+	}
+
+	// Populated up front, page faults would show up in the replay timing
+	replay->file_size = (size_t)st.st_size;
+	replay->file = mmap(NULL, replay->file_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+	close(fd);
+	if(replay->file == MAP_FAILED) {
+		perror("mmap capture file");
+		replay->file = NULL;
+		return -1;
+	}
+
+	uint32_t magic = pcap_u32(replay->file, 0);
+	if(magic == PCAPNG_BLOCK_SHB)
+		return pcap_index_pcapng(replay, path);
+
+	if(magic == PCAP_MAGIC_US || magic == PCAP_MAGIC_NS || magic == bswap_32(PCAP_MAGIC_US) ||
+	   magic == bswap_32(PCAP_MAGIC_NS))
+		return pcap_index_classic(replay, path);
+
+	fprintf(stderr, "%s: unknown capture format, magic 0x%08x\n", path, magic);
+	return -1;
+}
+
+static void pcap_free(struct pcap_replay *replay) {
+	if(replay->file != NULL)
+		munmap(replay->file, replay->file_size);
+	if(replay->record != NULL)
+		fclose(replay->record);
+
+	pthread_mutex_destroy(&replay->record_lock);
+	free(replay->frames);
+	free(replay);
+}
+
+
+static int pcap_open(struct net_dev *dev, uint32_t features, const void *arg) {
+	const struct pcap_config *config = arg;
+	if(config == NULL || config->replay_path == NULL) {
+		fprintf(stderr, "pcap device needs a capture file to replay\n");
+		return -1;
+	}
+	if(dev->queue_count != 1) {
+		fprintf(stderr, "pcap device has a single queue\n");
+		return -1;
+	}
+
+	struct pcap_replay *replay = malloc(sizeof(struct pcap_replay));
+	if(replay == NULL) {
+		perror("could not allocate memory for pcap device");
+		exit(1);
+	}
+	memset(replay, 0, sizeof(struct pcap_replay));
+	pthread_mutex_init(&replay->record_lock, NULL);
+	replay->timed = config->timed;
+	replay->loops = config->loops > 0 ? config->loops : 1;
+
+	if(pcap_load(replay, config->replay_path) < 0) {
+		pcap_free(replay);
+		return -1;
+	}
+	if(replay->frame_count == 0) {
+		fprintf(stderr, "%s: no Ethernet frames to replay\n", config->replay_path);
+		pcap_free(replay);
+		return -1;
+	}
+
+	if(config->record_path != NULL) {
+		replay->record = fopen(config->record_path, "wb");
+		if(replay->record == NULL) {
+			perror(config->record_path);
+			pcap_free(replay);
+			return -1;
+		}
+
+		struct pcap_file_header header = {
+			.magic = PCAP_MAGIC_NS,
+			.version_major = 2,
+			.version_minor = 4,
+			.snaplen = PCAP_SNAPLEN,
+			.linktype = PCAP_LINKTYPE_ETHERNET,
+		};
+		fwrite(&header, sizeof(header), 1, replay->record);
+	}
+
+	// Locally administered address, the capture decides who we talk to anyway
+	uint8_t hwaddr[6] = { 0x02, 0x00, 0x00, 0x00, 0xca, 0xfe };
+	memcpy(dev->hwaddr, hwaddr, sizeof(hwaddr));
+	dev->priv = replay;
+
+	return 0;
+}
+
+static void pcap_close(struct net_dev *dev) {
+	pcap_free(dev->priv);
+}
+
+
+static uint32_t pcap_rx_batch(struct net_dev *dev, uint16_t queue, struct eth_rx_ring *ring, struct sk_buff **buffers,
+							  uint32_t max) {
+	struct pcap_replay *replay = dev->priv;
+	if(atomic_load_explicit(&replay->done, memory_order_relaxed))
+		return 0;
+
+	uint64_t now = pcap_now_ns(CLOCK_MONOTONIC);
+	if(replay->start_ns == 0) {
+		replay->start_ns = now;
+		replay->loop_start_ns = now;
+	}
+
+	uint32_t count = 0;
+	while(count < max && replay->loop < replay->loops) {
+		// Frames captured out of order are due right away
+		struct pcap_frame *frame = &replay->frames[replay->next];
+		if(replay->timed && (int64_t)(frame->ts_ns - replay->frames[0].ts_ns) > (int64_t)(now - replay->loop_start_ns))
+			break;  // not due yet
+
+		// Frames bigger than a ring buffer, GRO merged ones say, get a buffer of their own
+		struct sk_buff *buffer = eth_rx_ring_get(ring, dev, queue);
+		if(skb_tailroom(buffer) < frame->len) {
+			eth_rx_ring_recycle(ring, buffer);
+			buffer = skb_alloc(frame->len);
+			buffer->dev = dev;
+			buffer->queue_mapping = queue;
+		}
+
+		memcpy(skb_put(buffer, frame->len), frame->data, frame->len);
+		buffer->ip_summed = CHECKSUM_NONE;
+		buffers[count++] = buffer;
+
+		if(++replay->next == replay->frame_count) {
+			replay->next = 0;
+			replay->loop++;
+			replay->loop_start_ns = now;
+		}
+	}
+
+	// Called again after the last batch was processed, so the replay is over
+	if(count == 0 && replay->loop == replay->loops) {
+		replay->end_ns = now;
+		atomic_store_explicit(&replay->done, 1, memory_order_release);
+	}
+
+	return count;
+}
+
+static void pcap_record(struct pcap_replay *replay, struct sk_buff *buffer) {
+	uint64_t now = pcap_now_ns(CLOCK_REALTIME);
+	struct pcap_record_header header = {
+		.ts_sec = (uint32_t)(now / 1000000000ull),
+		.ts_frac = (uint32_t)(now % 1000000000ull),
+		.caplen = buffer->len,
+		.len = buffer->len,
+	};
+
+	fwrite(&header, sizeof(header), 1, replay->record);
+	fwrite(buffer->data, 1, skb_headlen(buffer), replay->record);
+	for(uint8_t i = 0; i < buffer->nr_frags; i++)
+		fwrite(skb_frag_address(&buffer->frags[i]), 1, buffer->frags[i].len, replay->record);
+
+	replay->recorded++;
+}
+
+// Frames go nowhere, they are only written to the record file if there is one
+static uint32_t pcap_tx_batch(struct net_dev *dev, uint16_t queue, struct sk_buff **buffers, uint32_t count) {
+	struct pcap_replay *replay = dev->priv;
+
+	if(replay->record != NULL) {
+		pthread_mutex_lock(&replay->record_lock);
+		for(uint32_t i = 0; i < count; i++)
+			pcap_record(replay, buffers[i]);
+		pthread_mutex_unlock(&replay->record_lock);
+	}
+
+	for(uint32_t i = 0; i < count; i++)
+		skb_free(buffers[i]);
+
+	return count;
+}
+
+
+// Set once every frame of every loop was received and processed
+int pcap_replay_done(struct net_dev *dev) {
+	struct pcap_replay *replay = dev->priv;
+	return atomic_load_explicit(&replay->done, memory_order_acquire);
+}
+
+void pcap_print_stats(struct net_dev *dev) {
+	struct pcap_replay *replay = dev->priv;
+	uint64_t frames = (uint64_t)replay->frame_count * replay->loop;
+	uint64_t elapsed = replay->end_ns - replay->start_ns;
+
+	if(!pcap_replay_done(dev) || frames == 0 || elapsed == 0) {
+		printf("%s: replay did not finish\n", dev->name);
+		return;
+	}
+
+	printf("%s: replayed %" PRIu64 " frames (%u x %u), %" PRIu64 " bytes in %.3f ms%s | %.0f packets/s | "
+		   "%.1f ns/packet | %.2f Gbit/s\n", dev->name, frames, replay->frame_count, replay->loop,
+		   replay->frame_bytes * replay->loop, elapsed / 1e6, replay->timed ? " at original timing" : "",
+		   frames * 1e9 / elapsed, (double)elapsed / frames, replay->frame_bytes * replay->loop * 8.0 / elapsed);
+
+	if(replay->skipped)
+		printf("%s: skipped %u records shorter than an Ethernet header\n", dev->name, replay->skipped);
+	if(replay->record != NULL)
+		printf("%s: recorded %" PRIu64 " frames\n", dev->name, replay->recorded);
+}
+
+
+const struct net_dev_ops pcap_ops = {
+	.name = "pcap",
+	.open = pcap_open,
+	.close = pcap_close,
+	.rx_batch = pcap_rx_batch,
+	.tx_batch = pcap_tx_batch,
+};
@@ -1,26 +1,438 @@
 #include <string.h>
 #include <stdio.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <inttypes.h>
 #include "skbuff.h"
 
 
-struct sk_buff* skb_alloc(uint32_t size) {
-	struct sk_buff* buff = (struct sk_buff*)malloc(sizeof(struct sk_buff));
+// The sk_buff struct and its data live in the same block, data starts on the next cache line
+#define SKB_STRUCT_SIZE ((sizeof(struct sk_buff) + SKB_CACHE_LINE - 1) & ~(SKB_CACHE_LINE - 1))
+
+struct skb_free_list {
+	struct sk_buff *head;
+	uint32_t count;
+};
+
+// Data capacity of each class
+static const uint32_t skb_class_size[SKB_CLASS_COUNT] = {
+	[SKB_CLASS_SMALL] = 256,
+	[SKB_CLASS_MTU] = 2048,
+	[SKB_CLASS_LARGE] = 16384,
+	[SKB_CLASS_HUGE] = 65536 + 128,
+};
+
+static __thread struct skb_free_list skb_local_cache[SKB_CLASS_COUNT];
+static struct skb_free_list skb_global_cache[SKB_CLASS_COUNT];
+static pthread_mutex_t skb_global_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static atomic_uint_fast64_t skb_hits[SKB_CLASS_COUNT + 1];
+static atomic_uint_fast64_t skb_misses[SKB_CLASS_COUNT + 1];
+
+
+static uint8_t skb_size_class(uint32_t size) {
+	for(uint8_t i = 0; i < SKB_CLASS_COUNT; i++) {
+		if(size <= skb_class_size[i])
+			return i;
+	}
+
+	return SKB_CLASS_NONE;
+}
+
+static struct sk_buff *skb_alloc_block(uint8_t size_class, uint32_t size) {
+	uint32_t capacity = size_class == SKB_CLASS_NONE ? size : skb_class_size[size_class];
+	size_t block_size = (SKB_STRUCT_SIZE + capacity + SKB_CACHE_LINE - 1) & ~(SKB_CACHE_LINE - 1);
+
+	struct sk_buff *buff = aligned_alloc(SKB_CACHE_LINE, block_size);
 	if(buff == NULL) {
 		perror("could not allocate memory for socket buffer");
 		exit(1);
 	}
-	memset(buff, 0, sizeof(struct sk_buff));
 
-	buff->size = size;
-	buff->data = malloc(size);
-	buff->manual_free = 0;
+	buff->size_class = size_class;
+
+	return buff;
+}
+
+// Moves at most `count` buffers from one free list to the other
+static void skb_free_list_move(struct skb_free_list *from, struct skb_free_list *to, uint32_t count) {
+	while(count-- > 0 && from->head != NULL) {
+		struct sk_buff *buff = from->head;
+		from->head = buff->next_free;
+		from->count--;
+
+		buff->next_free = to->head;
+		to->head = buff;
+		to->count++;
+	}
+}
+
+static struct sk_buff *skb_pool_get(uint8_t size_class) {
+	struct skb_free_list *local = &skb_local_cache[size_class];
+
+	if(local->head == NULL) {
+		// Refill from the global list
+		pthread_mutex_lock(&skb_global_mutex);
+		skb_free_list_move(&skb_global_cache[size_class], local, SKB_CACHE_BATCH);
+		pthread_mutex_unlock(&skb_global_mutex);
+
+		if(local->head == NULL)
+			return NULL;
+	}
+
+	struct sk_buff *buff = local->head;
+	local->head = buff->next_free;
+	local->count--;
+
+	return buff;
+}
+
+static void skb_pool_put(struct sk_buff *buff) {
+	struct skb_free_list *local = &skb_local_cache[buff->size_class];
+
+	buff->next_free = local->head;
+	local->head = buff;
+	local->count++;
+
+	if(local->count <= SKB_LOCAL_CACHE_MAX)
+		return;
+
+	// Hand a batch back to the global list, so buffers freed by another thread than the allocating one don't pile up
+	struct skb_free_list *global = &skb_global_cache[buff->size_class];
+
+	pthread_mutex_lock(&skb_global_mutex);
+	if(global->count < SKB_GLOBAL_CACHE_MAX) {
+		skb_free_list_move(local, global, SKB_CACHE_BATCH);
+		pthread_mutex_unlock(&skb_global_mutex);
+		return;
+	}
+	pthread_mutex_unlock(&skb_global_mutex);
+
+	// Global list is full as well, release memory
+	for(int i = 0; i < SKB_CACHE_BATCH && local->head != NULL; i++) {
+		struct sk_buff *tmp = local->head;
+		local->head = tmp->next_free;
+		local->count--;
+		free(tmp);
+	}
+}
+
+
+struct sk_buff* skb_alloc(uint32_t size) {
+	uint8_t size_class = skb_size_class(size);
+
+	struct sk_buff *buff = NULL;
+	if(size_class != SKB_CLASS_NONE)
+		buff = skb_pool_get(size_class);
+
+	if(buff != NULL)
+		atomic_fetch_add_explicit(&skb_hits[size_class], 1, memory_order_relaxed);
+	else {
+		atomic_fetch_add_explicit(&skb_misses[size_class], 1, memory_order_relaxed);
+		buff = skb_alloc_block(size_class, size);
+	}
+
+	buff->next_free = NULL;
+	buff->head = (uint8_t *)buff + SKB_STRUCT_SIZE;
+	buff->head_page = NULL;
+	buff->rx_ring = NULL;
+	atomic_init(&buff->users, 1);
+	buff->dev = NULL;
+	buff->queue_mapping = 0;
+	buff->len = 0;
+	buff->data_len = 0;
+	buff->nr_frags = 0;
+	buff->payload_size = 0;
+	buff->ip_summed = CHECKSUM_NONE;
+	buff->gso_size = 0;
 
-	memset(buff->data, 0, size);
+	// No zeroing here, every layer initializes the header it pushes
+	buff->data = buff->head;
+	buff->tail = buff->head;
+	buff->end = buff->head + size;
+	buff->mac_header = NULL;
+	buff->network_header = NULL;
+	buff->transport_header = NULL;
 
 	return buff;
 }
 
+// Drops a reference, the last one returns the buffer to the pool
 void skb_free(struct sk_buff *skb) {
-	free(skb->data);
-	free(skb);
-}
\ No newline at end of file
+	if(atomic_fetch_sub_explicit(&skb->users, 1, memory_order_acq_rel) != 1)
+		return;
+
+	for(int i = 0; i < skb->nr_frags; i++)
+		skb_page_put(skb->frags[i].page);
+
+	if(skb->head_page != NULL)
+		skb_page_put(skb->head_page);
+
+	if(skb->size_class == SKB_CLASS_NONE)
+		free(skb);
+	else
+		skb_pool_put(skb);
+}
+
+void skb_over_panic(struct sk_buff *skb, uint32_t len, const char *func) {
+	fprintf(stderr, "%s: sk_buff overflow, len %u | headroom %u | tailroom %u | data len %u\n",
+			func, len, skb_headroom(skb), skb_tailroom(skb), skb->len);
+	abort();
+}
+
+// Appends len bytes of the page to the payload, the sk_buff takes its own reference to the page
+void skb_add_frag(struct sk_buff *skb, struct skb_page *page, uint32_t offset, uint32_t len) {
+	if(skb->nr_frags == SKB_MAX_FRAGS || offset + len > page->size)
+		skb_over_panic(skb, len, __func__);
+
+	struct skb_frag *frag = &skb->frags[skb->nr_frags++];
+	frag->page = skb_page_get(page);
+	frag->offset = offset;
+	frag->len = len;
+
+	skb->len += len;
+	skb->data_len += len;
+}
+
+// Builds a received frame around len bytes of driver memory without copying them, the sk_buff takes its own
+// reference to the page. The frame can't grow, it has no headroom or tailroom.
+struct sk_buff *skb_wrap(struct skb_page *page, uint32_t offset, uint32_t len) {
+	if(offset + len > page->size) {
+		fprintf(stderr, "%s: frame of %u bytes at %u exceeds page of %u bytes\n", __func__, len, offset, page->size);
+		abort();
+	}
+
+	struct sk_buff *skb = skb_alloc(0);
+	skb->head_page = skb_page_get(page);
+	skb->head = page->data + offset;
+	skb->data = skb->head;
+	skb->tail = skb->head + len;
+	skb->end = skb->tail;
+	skb->len = len;
+
+	return skb;
+}
+
+static uint8_t *skb_copy_header(struct sk_buff *to, struct sk_buff *from, uint8_t *header) {
+	return header == NULL ? NULL : to->head + (header - from->head);
+}
+
+// Private copy of the data and the metadata, fragments end up in the linear part
+struct sk_buff *skb_copy(struct sk_buff *skb) {
+	struct sk_buff *copy = skb_alloc((uint32_t)(skb->end - skb->head) + skb->data_len);
+	memcpy(copy->head, skb->head, (size_t)(skb->tail - skb->head));
+
+	uint8_t *tail = copy->head + (skb->tail - skb->head);
+	for(int i = 0; i < skb->nr_frags; i++) {
+		memcpy(tail, skb_frag_address(&skb->frags[i]), skb->frags[i].len);
+		tail += skb->frags[i].len;
+	}
+
+	copy->dev = skb->dev;
+	copy->queue_mapping = skb->queue_mapping;
+	copy->len = skb->len;
+	copy->payload_size = skb->payload_size;
+	copy->ip_summed = skb->ip_summed;
+	copy->csum = skb->csum;
+	copy->csum_offset = skb->csum_offset;
+	copy->gso_size = skb->gso_size;
+
+	copy->data = copy->head + (skb->data - skb->head);
+	copy->tail = tail;
+	copy->mac_header = skb_copy_header(copy, skb, skb->mac_header);
+	copy->network_header = skb_copy_header(copy, skb, skb->network_header);
+	copy->transport_header = skb_copy_header(copy, skb, skb->transport_header);
+
+	return copy;
+}
+
+// Private copy of the linear part with the metadata, the frags are shared with the original. Whatever the copy's
+// headers go through on their way out leaves the original alone, and the payload isn't copied.
+struct sk_buff *skb_copy_head(struct sk_buff *skb) {
+	if(skb->head_page != NULL)
+		return skb_copy(skb);
+
+	struct sk_buff *copy = skb_alloc((uint32_t)(skb->end - skb->head));
+	memcpy(copy->head, skb->head, (size_t)(skb->tail - skb->head));
+
+	for(int i = 0; i < skb->nr_frags; i++) {
+		copy->frags[i] = skb->frags[i];
+		skb_page_get(skb->frags[i].page);
+	}
+	copy->nr_frags = skb->nr_frags;
+
+	copy->dev = skb->dev;
+	copy->queue_mapping = skb->queue_mapping;
+	copy->len = skb->len;
+	copy->data_len = skb->data_len;
+	copy->payload_size = skb->payload_size;
+	copy->ip_summed = skb->ip_summed;
+	copy->csum = skb->csum;
+	copy->csum_offset = skb->csum_offset;
+	copy->gso_size = skb->gso_size;
+
+	copy->data = copy->head + (skb->data - skb->head);
+	copy->tail = copy->head + (skb->tail - skb->head);
+	copy->mac_header = skb_copy_header(copy, skb, skb->mac_header);
+	copy->network_header = skb_copy_header(copy, skb, skb->network_header);
+	copy->transport_header = skb_copy_header(copy, skb, skb->transport_header);
+
+	return copy;
+}
+
+// Cuts the buffer down to len bytes, from the end of the frags first. Frags left empty are dropped.
+void skb_trim(struct sk_buff *skb, uint32_t len) {
+	if(len >= skb->len)
+		return;
+
+	uint32_t headlen = skb_headlen(skb);
+	uint32_t offset = headlen;
+	uint8_t kept = 0;
+
+	for(uint8_t i = 0; i < skb->nr_frags; i++) {
+		struct skb_frag *frag = &skb->frags[i];
+		if(offset >= len) {
+			skb_page_put(frag->page);
+			continue;
+		}
+
+		if(offset + frag->len > len)
+			frag->len = len - offset;
+		offset += frag->len;
+		kept++;
+	}
+
+	skb->nr_frags = kept;
+	if(len < headlen)
+		skb->tail = skb->data + len;
+	skb->data_len = len > headlen ? len - headlen : 0;
+	skb->len = len;
+}
+
+// Copies len bytes starting offset bytes past data, wherever they are between the linear part and the frags
+void skb_copy_bits(struct sk_buff *skb, uint32_t offset, uint8_t *to, uint32_t len) {
+	if(offset + len > skb->len)
+		skb_over_panic(skb, len, __func__);
+
+	uint32_t headlen = skb_headlen(skb);
+	if(offset < headlen) {
+		uint32_t copy = len < headlen - offset ? len : headlen - offset;
+		memcpy(to, skb->data + offset, copy);
+		to += copy;
+		len -= copy;
+		offset = 0;
+	}
+	else
+		offset -= headlen;
+
+	for(int i = 0; i < skb->nr_frags && len > 0; i++) {
+		struct skb_frag *frag = &skb->frags[i];
+		if(offset >= frag->len) {
+			offset -= frag->len;
+			continue;
+		}
+
+		uint32_t copy = len < frag->len - offset ? len : frag->len - offset;
+		memcpy(to, skb_frag_address(frag) + offset, copy);
+		to += copy;
+		len -= copy;
+		offset = 0;
+	}
+}
+
+// Returns a reference the caller may hold past the receive path. A buffer wrapping driver memory is copied, the
+// driver wants its memory back once the frame has been processed.
+struct sk_buff *skb_keep(struct sk_buff *skb) {
+	if(skb->head_page != NULL)
+		return skb_copy(skb);
+
+	return skb_get(skb);
+}
+
+
+// Allocates a page with a reference already held by the caller
+struct skb_page *skb_page_alloc(uint32_t size) {
+	struct skb_page *page = malloc(sizeof(struct skb_page) + size);
+	if(page == NULL) {
+		perror("could not allocate memory for socket buffer page");
+		exit(1);
+	}
+
+	atomic_init(&page->refcnt, 1);
+	page->data = (uint8_t *)(page + 1);
+	page->size = size;
+	page->release = NULL;
+	page->private = NULL;
+
+	return page;
+}
+
+// Wraps user memory without copying, the memory has to stay valid until release() is called
+struct skb_page *skb_page_wrap(uint8_t *data, uint32_t size, void (*release)(struct skb_page *), void *private) {
+	struct skb_page *page = malloc(sizeof(struct skb_page));
+	if(page == NULL) {
+		perror("could not allocate memory for socket buffer page");
+		exit(1);
+	}
+
+	atomic_init(&page->refcnt, 1);
+	page->data = data;
+	page->size = size;
+	page->release = release;
+	page->private = private;
+
+	return page;
+}
+
+void skb_page_put(struct skb_page *page) {
+	if(atomic_fetch_sub_explicit(&page->refcnt, 1, memory_order_acq_rel) != 1)
+		return;
+
+	if(page->release != NULL)
+		page->release(page);
+
+	free(page);
+}
+
+
+void skb_pool_get_stats(struct skb_pool_stats *stats) {
+	for(int i = 0; i <= SKB_CLASS_COUNT; i++) {
+		stats->hits[i] = atomic_load_explicit(&skb_hits[i], memory_order_relaxed);
+		stats->misses[i] = atomic_load_explicit(&skb_misses[i], memory_order_relaxed);
+	}
+}
+
+void skb_pool_print_stats() {
+	static const char *class_names[SKB_CLASS_COUNT + 1] = {"small", "mtu", "large", "huge", "oversized"};
+
+	struct skb_pool_stats stats;
+	skb_pool_get_stats(&stats);
+
+	printf("sk_buff pool:\n");
+	for(int i = 0; i <= SKB_CLASS_COUNT; i++)
+		printf("  %-10s hits %" PRIu64 " | misses %" PRIu64 "\n", class_names[i], stats.hits[i], stats.misses[i]);
+}
+
+// Hands the calling thread's cached buffers to the global lists, threads should call it before exiting
+void skb_pool_flush_local() {
+	pthread_mutex_lock(&skb_global_mutex);
+	for(int i = 0; i < SKB_CLASS_COUNT; i++)
+		skb_free_list_move(&skb_local_cache[i], &skb_global_cache[i], UINT32_MAX);
+	pthread_mutex_unlock(&skb_global_mutex);
+}
+
+// Releases every pooled buffer
+void skb_pool_free() {
+	skb_pool_flush_local();
+
+	pthread_mutex_lock(&skb_global_mutex);
+	for(int i = 0; i < SKB_CLASS_COUNT; i++) {
+		while(skb_global_cache[i].head != NULL) {
+			struct sk_buff *tmp = skb_global_cache[i].head;
+			skb_global_cache[i].head = tmp->next_free;
+			free(tmp);
+		}
+		skb_global_cache[i].count = 0;
+	}
+	pthread_mutex_unlock(&skb_global_mutex);
+}
@@ -1,6 +1,8 @@
 #include <fcntl.h>
+#include <errno.h>
 #include <linux/if.h>
 #include <linux/if_tun.h>
+#include <linux/virtio_net.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdio.h>
@@ -10,11 +12,13 @@
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 
 #include "tap.h"
+#include "eth.h"
 
 
-int tap_alloc(char *dev) {
+int tap_alloc(char *dev, int multi_queue, int vnet_hdr) {
 	struct ifreq ifr = {0};
 	int fd, err;
 
@@ -27,55 +31,209 @@ int tap_alloc(char *dev) {
 	 *        IFF_TAP   - TAP device
 	 *
 	 *        IFF_NO_PI - Do not provide packet information
+	 *        IFF_MULTI_QUEUE - Every call attaches one more queue to the same device
+	 *        IFF_VNET_HDR - Prepend a struct virtio_net_hdr to every frame
 	 */
 	ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+	if(multi_queue)
+		ifr.ifr_flags |= IFF_MULTI_QUEUE;
+	if(vnet_hdr)
+		ifr.ifr_flags |= IFF_VNET_HDR;
 	if(*dev)
 		strncpy(ifr.ifr_name, dev, IFNAMSIZ);
 
-	if(ioctl(fd, TUNSETIFF, (void *) &ifr) < 0){
+	int res = ioctl(fd, TUNSETIFF, (void *) &ifr);
+	if(res < 0 && errno == EINVAL && !multi_queue) {
+		// A device created as multi_queue has to be attached that way even for a single queue
+		ifr.ifr_flags |= IFF_MULTI_QUEUE;
+		res = ioctl(fd, TUNSETIFF, (void *) &ifr);
+	}
+
+	if(res < 0){
 		close(fd);
 		perror("ioctl failed");
 		return -1;
 	}
 
+	// RX drains the queue in batches until read() would block
+	if(fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0) {
+		close(fd);
+		perror("could not set TAP device non-blocking");
+		return -1;
+	}
+
 	strcpy(dev, ifr.ifr_name);
 	return fd;
 }
 
-void tap_get_mac(int dev_fd, uint8_t *hwaddr) {
+// Asks the kernel for checksum offload and TSO, returns the features the device ended up with
+static uint32_t tap_set_offload(int fd) {
+	int hdr_len = sizeof(struct virtio_net_hdr);
+	if(ioctl(fd, TUNSETVNETHDRSZ, &hdr_len) < 0) {
+		perror("could not set virtio-net header size");
+		return 0;
+	}
+
+	// The flags tell what we can receive: partially checksummed frames and TSO (GRO merged) frames
+	if(ioctl(fd, TUNSETOFFLOAD, TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6) == 0)
+		return NETIF_F_VNET_HDR | NETIF_F_HW_CSUM | NETIF_F_TSO | NETIF_F_GRO;
+
+	if(ioctl(fd, TUNSETOFFLOAD, TUN_F_CSUM) == 0)
+		return NETIF_F_VNET_HDR | NETIF_F_HW_CSUM;
+
+	perror("could not set TAP offloads");
+	return NETIF_F_VNET_HDR;
+}
+
+static void tap_get_mac(int dev_fd, uint8_t *hwaddr) {
 	struct ifreq ifr = {};
 	ioctl(dev_fd, SIOCGIFHWADDR, &ifr);
 	memcpy(hwaddr, ifr.ifr_hwaddr.sa_data, IFHWADDRLEN);
 }
 
 
-struct net_dev *tap_init_dev(char *dev) {
-	int sock_fd = tap_alloc(dev);
-	if(sock_fd < 0)
-		return NULL;
+static int tap_open(struct net_dev *dev, uint32_t features, const void *arg) {
+	int vnet_hdr = (features & NETIF_F_VNET_HDR) != 0;
+
+	// One file descriptor per queue
+	for(uint16_t i = 0; i < dev->queue_count; i++) {
+		struct net_queue *queue = &dev->queues[i];
+
+		queue->fd = tap_alloc(dev->name, dev->queue_count > 1, vnet_hdr);
+		if(queue->fd < 0)
+			return -1;
+
+		if(vnet_hdr) {
+			uint32_t queue_features = tap_set_offload(queue->fd);
+			dev->features = i == 0 ? queue_features : dev->features & queue_features;
+		} else {
+			// Offloads stick to a persistent device, without a virtio-net header frames have to arrive complete
+			ioctl(queue->fd, TUNSETOFFLOAD, 0);
+		}
+	}
+
+	dev->vnet_hdr_len = vnet_hdr ? sizeof(struct virtio_net_hdr) : 0;
+	tap_get_mac(dev->queues[0].fd, dev->hwaddr);
+
+	int mtu = net_dev_if_mtu(dev->name, dev->mtu);
+	dev->mtu = mtu > 0 ? (uint16_t)mtu : 0;
+
+	return 0;
+}
+
+static void tap_close(struct net_dev *dev) {
+	for(uint16_t i = 0; i < dev->queue_count; i++) {
+		if(dev->queues[i].fd >= 0)
+			close(dev->queues[i].fd);
+	}
+}
+
+
+// Takes the offload information of a received frame from its virtio-net header
+int tap_read_vnet_hdr(struct net_dev *dev, struct sk_buff *buffer) {
+	if(buffer->len < dev->vnet_hdr_len + ETHERNET_HEADER_SIZE)
+		return -1;
+
+	struct virtio_net_hdr *hdr = (struct virtio_net_hdr *)buffer->data;
 
-	// file descriptor
-	device = malloc(sizeof(struct net_dev));
-	if(device == NULL) {
-		perror("could not allocate memory for TAP device");
-		exit(1);
+	// Frames from the local host may only have the pseudo header summed, they never touched a wire
+	if(hdr->flags & (VIRTIO_NET_HDR_F_DATA_VALID | VIRTIO_NET_HDR_F_NEEDS_CSUM))
+		buffer->ip_summed = CHECKSUM_UNNECESSARY;
+
+	skb_pull(buffer, dev->vnet_hdr_len);
+	return 0;
+}
+
+// Reads a frame into an empty buffer, data is left at the Ethernet header
+static uint32_t tap_read(struct net_dev *dev, struct sk_buff *buffer) {
+	ssize_t bytes = read(dev->queues[buffer->queue_mapping].fd, buffer->data, skb_tailroom(buffer));
+	if (bytes == -1) {
+		if(errno != EAGAIN && errno != EWOULDBLOCK)
+			perror("failed to read data");
+		return 0;
 	}
 
-	device->sock_fd = sock_fd;
-	device->mtu = TAP_DEVICE_MTU;
-	tap_get_mac(sock_fd, device->hwaddr);
+	skb_put(buffer, (uint32_t)bytes);
+	if(dev->vnet_hdr_len && tap_read_vnet_hdr(dev, buffer) < 0)
+		return 0;
+
+	return (uint32_t)bytes;
+}
 
-	// IPv4 address
-	inet_pton(AF_INET, TAP_DEVICE_IP, &device->ipv4);
+// Reads frames until the queue runs dry or max frames were read, the queue is non-blocking
+static uint32_t tap_rx_batch(struct net_dev *dev, uint16_t queue, struct eth_rx_ring *ring, struct sk_buff **buffers,
+							 uint32_t max) {
+	uint32_t count = 0;
 
-	return device;
+	while(count < max) {
+		struct sk_buff *buffer = eth_rx_ring_get(ring, dev, queue);
+		if(tap_read(dev, buffer) == 0) {
+			eth_rx_ring_recycle(ring, buffer);
+			break;
+		}
+
+		buffers[count++] = buffer;
+	}
+
+	return count;
 }
 
-void free_tap_device() {
-	close(device->sock_fd);
-	free(device);
+
+// Tells the kernel what's left to do for the frame
+void tap_push_vnet_hdr(struct net_dev *dev, struct sk_buff *buffer) {
+	uint8_t *mac_header = buffer->data;
+	struct virtio_net_hdr *hdr = (struct virtio_net_hdr *)skb_push(buffer, dev->vnet_hdr_len);
+	memset(hdr, 0, dev->vnet_hdr_len);
+
+	if(buffer->ip_summed == CHECKSUM_PARTIAL) {
+		hdr->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+		hdr->csum_start = (uint16_t)(buffer->transport_header - mac_header);
+		hdr->csum_offset = buffer->csum_offset;
+	}
+
+	if(buffer->gso_size) {
+		hdr->gso_type = (*buffer->network_header >> 4) == 6 ? VIRTIO_NET_HDR_GSO_TCPV6 : VIRTIO_NET_HDR_GSO_TCPV4;
+		hdr->gso_size = buffer->gso_size;
+		hdr->hdr_len = (uint16_t)(skb_headlen(buffer) - dev->vnet_hdr_len);
+	}
+}
+
+// A write() per frame, TAP has no way to take more at once
+static uint32_t tap_tx_batch(struct net_dev *dev, uint16_t queue, struct sk_buff **buffers, uint32_t count) {
+	uint32_t sent = 0;
+
+	for(uint32_t i = 0; i < count; i++) {
+		struct sk_buff *buffer = buffers[i];
+
+		if(dev->vnet_hdr_len)
+			tap_push_vnet_hdr(dev, buffer);
+
+		// Linear part first, then the fragments as they are
+		struct iovec iov[1 + SKB_MAX_FRAGS];
+		iov[0].iov_base = buffer->data;
+		iov[0].iov_len = skb_headlen(buffer);
+		for(int j = 0; j < buffer->nr_frags; j++) {
+			iov[j + 1].iov_base = skb_frag_address(&buffer->frags[j]);
+			iov[j + 1].iov_len = buffer->frags[j].len;
+		}
+
+		ssize_t bytes = writev(dev->queues[queue].fd, iov, 1 + buffer->nr_frags);
+		skb_free(buffer);
+
+		if(bytes == -1)
+			perror("failed to write data");
+		else
+			sent++;
+	}
+
+	return sent;
 }
 
-struct net_dev *get_tap_device() {
-	return device;
-}
\ No newline at end of file
+
+const struct net_dev_ops tap_ops = {
+	.name = "tap",
+	.open = tap_open,
+	.close = tap_close,
+	.rx_batch = tap_rx_batch,
+	.tx_batch = tap_tx_batch,
+};
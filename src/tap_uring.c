@@ -0,0 +1,556 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+
+#include "tap_uring.h"
+#include "tap.h"
+#include "eth.h"
+
+
+// No liburing, the three system calls are all there is to it
+static int tap_uring_setup(uint32_t entries, struct io_uring_params *params) {
+	return (int)syscall(SYS_io_uring_setup, entries, params);
+}
+
+static int tap_uring_enter(int fd, uint32_t to_submit, uint32_t min_complete, uint32_t flags, const void *arg,
+						   size_t arg_size) {
+	return (int)syscall(SYS_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+static int tap_uring_register(int fd, uint32_t opcode, const void *arg, uint32_t nr_args) {
+	return (int)syscall(SYS_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+
+// Publishes the SQEs filled in so far. Without SQPOLL they are submitted with io_uring_enter(), with SQPOLL the
+// kernel thread picks them up and only needs a call if it went to sleep. wait blocks for that many completions.
+static int tap_uring_submit(struct tap_uring *ring, uint32_t wait) {
+	uint32_t to_submit = ring->sq_local_tail - ring->sq_submitted;
+	uint32_t flags = wait ? IORING_ENTER_GETEVENTS : 0;
+
+	__atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+
+	if(ring->sqpoll) {
+		// The tail store has to be visible before the flag is checked, or a wakeup could be missed
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if(to_submit && __atomic_load_n(ring->sq_flags, __ATOMIC_RELAXED) & IORING_SQ_NEED_WAKEUP)
+			flags |= IORING_ENTER_SQ_WAKEUP;
+
+		ring->sq_submitted = ring->sq_local_tail;
+		if(flags == 0)
+			return 0;
+	}
+	else if(to_submit == 0 && wait == 0)
+		return 0;
+
+	int res = tap_uring_enter(ring->fd, to_submit, wait, flags, NULL, 0);
+	ring->stats.enters++;
+	if(res < 0) {
+		// A full completion queue clears up once it's reaped
+		if(errno != EAGAIN && errno != EBUSY && errno != EINTR)
+			perror("io_uring_enter");
+		return -1;
+	}
+
+	if(!ring->sqpoll)
+		ring->sq_submitted += (uint32_t)res;
+	return 0;
+}
+
+static struct io_uring_sqe *tap_uring_get_sqe(struct tap_uring *ring) {
+	if(ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == ring->sq_entries) {
+		tap_uring_submit(ring, 0);
+		if(ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == ring->sq_entries)
+			return NULL;
+	}
+
+	struct io_uring_sqe *sqe = &ring->sqes[ring->sq_local_tail++ & ring->sq_mask];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	ring->stats.sqes++;
+	return sqe;
+}
+
+
+// Reads straight into the registered area, the TAP fd is registered file #0
+static int tap_uring_post_rx(struct tap_uring *ring, uint32_t index) {
+	struct io_uring_sqe *sqe = tap_uring_get_sqe(ring);
+	if(sqe == NULL)
+		return -1;
+
+	sqe->opcode = IORING_OP_READ_FIXED;
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->fd = 0;
+	sqe->addr = (uint64_t)(uintptr_t)(ring->rx_area + (size_t)index * ring->rx_stride + ring->rx_reserve);
+	sqe->len = ring->rx_stride - ring->rx_reserve;
+	sqe->buf_index = 0;
+	sqe->user_data = TAP_URING_RX_TAG | index;
+	return 0;
+}
+
+// Posts the buffers the stack is done with, those that don't fit in the SQ wait for the next round
+static void tap_uring_post_free(struct tap_uring *ring) {
+	uint32_t free_list[TAP_URING_RX_BUFFERS];
+
+	pthread_mutex_lock(&ring->rx_free_lock);
+	uint32_t count = ring->rx_free_count;
+	memcpy(free_list, ring->rx_free, count * sizeof(uint32_t));
+	ring->rx_free_count = 0;
+	pthread_mutex_unlock(&ring->rx_free_lock);
+
+	for(uint32_t i = 0; i < count; i++) {
+		if(tap_uring_post_rx(ring, free_list[i]) == 0)
+			continue;
+
+		pthread_mutex_lock(&ring->rx_free_lock);
+		memcpy(&ring->rx_free[ring->rx_free_count], &free_list[i], (count - i) * sizeof(uint32_t));
+		ring->rx_free_count += count - i;
+		pthread_mutex_unlock(&ring->rx_free_lock);
+		break;
+	}
+}
+
+static void tap_uring_rx_free(struct tap_uring *ring, uint32_t index) {
+	pthread_mutex_lock(&ring->rx_free_lock);
+	ring->rx_free[ring->rx_free_count++] = index;
+	pthread_mutex_unlock(&ring->rx_free_lock);
+}
+
+// The last sk_buff pointing into an RX buffer is gone, may run on any thread
+static void tap_uring_rx_release(struct skb_page *page) {
+	struct tap_uring_rx *rx = page->private;
+	tap_uring_rx_free(rx->ring, rx->index);
+}
+
+
+static void tap_uring_reap(struct tap_uring *ring) {
+	uint32_t head = *ring->cq_head;
+	uint32_t tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+	for(; head != tail; head++) {
+		struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+		uint32_t index = (uint32_t)(cqe->user_data & TAP_URING_INDEX_MASK);
+
+		if(cqe->user_data & TAP_URING_RX_TAG) {
+			ring->stats.rx_completions++;
+
+			if(cqe->res <= 0) {
+				ring->stats.errors++;
+				tap_uring_rx_free(ring, index);
+				continue;
+			}
+
+			ring->rx[index].len = (uint32_t)cqe->res;
+			ring->rx_ready[ring->rx_ready_tail++ % TAP_URING_RX_BUFFERS] = index;
+		}
+		else {
+			ring->stats.tx_completions++;
+			if(cqe->res < 0)
+				ring->stats.errors++;
+
+			skb_free(ring->tx[index].buffer);
+			ring->tx[index].buffer = NULL;
+			ring->tx_free[ring->tx_free_count++] = index;
+		}
+	}
+
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+
+static void tap_uring_free(struct tap_uring *ring) {
+	// Closing the ring cancels the posted reads, registered buffers stay pinned until the kernel is done
+	if(ring->fd >= 0)
+		close(ring->fd);
+
+	if(ring->sqes != NULL)
+		munmap(ring->sqes, ring->sqes_size);
+	if(ring->cq_map != NULL && ring->cq_map != ring->sq_map)
+		munmap(ring->cq_map, ring->cq_map_size);
+	if(ring->sq_map != NULL)
+		munmap(ring->sq_map, ring->sq_map_size);
+	if(ring->rx_area != NULL)
+		munmap(ring->rx_area, ring->rx_area_size);
+
+	for(uint32_t i = 0; i < TAP_URING_TX_SLOTS; i++) {
+		if(ring->tx[i].buffer != NULL)
+			skb_free(ring->tx[i].buffer);
+	}
+
+	pthread_mutex_destroy(&ring->lock);
+	pthread_mutex_destroy(&ring->rx_free_lock);
+	free(ring);
+}
+
+static void *tap_uring_map(int fd, size_t size, off_t offset) {
+	void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+	return map == MAP_FAILED ? NULL : map;
+}
+
+// Sets up the ring of a queue and posts every RX buffer, returns NULL if io_uring can't be used
+static struct tap_uring *tap_uring_new(struct net_dev *dev, int tap_fd, int sqpoll) {
+	struct tap_uring *ring = malloc(sizeof(struct tap_uring));
+	if(ring == NULL) {
+		perror("could not allocate memory for io_uring");
+		exit(1);
+	}
+	memset(ring, 0, sizeof(struct tap_uring));
+	pthread_mutex_init(&ring->lock, NULL);
+	pthread_mutex_init(&ring->rx_free_lock, NULL);
+	ring->tap_fd = tap_fd;
+	ring->sqpoll = sqpoll;
+
+	struct io_uring_params params = {0};
+	params.flags = IORING_SETUP_CQSIZE;
+	params.cq_entries = TAP_URING_ENTRIES * 2;
+	if(sqpoll) {
+		params.flags |= IORING_SETUP_SQPOLL;
+		params.sq_thread_idle = TAP_URING_SQ_IDLE_MS;
+	}
+
+	ring->fd = tap_uring_setup(TAP_URING_ENTRIES, &params);
+	if(ring->fd < 0) {
+		perror("io_uring_setup");
+		goto err;
+	}
+
+	ring->ext_arg = (params.features & IORING_FEAT_EXT_ARG) != 0;
+
+	ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+	ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if(params.features & IORING_FEAT_SINGLE_MMAP) {
+		if(ring->cq_map_size > ring->sq_map_size)
+			ring->sq_map_size = ring->cq_map_size;
+		ring->cq_map_size = ring->sq_map_size;
+	}
+
+	ring->sq_map = tap_uring_map(ring->fd, ring->sq_map_size, IORING_OFF_SQ_RING);
+	ring->cq_map = params.features & IORING_FEAT_SINGLE_MMAP ? ring->sq_map :
+				   tap_uring_map(ring->fd, ring->cq_map_size, IORING_OFF_CQ_RING);
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = tap_uring_map(ring->fd, ring->sqes_size, IORING_OFF_SQES);
+	if(ring->sq_map == NULL || ring->cq_map == NULL || ring->sqes == NULL) {
+		perror("could not map io_uring");
+		goto err;
+	}
+
+	ring->sq_head = (uint32_t *)(ring->sq_map + params.sq_off.head);
+	ring->sq_tail = (uint32_t *)(ring->sq_map + params.sq_off.tail);
+	ring->sq_flags = (uint32_t *)(ring->sq_map + params.sq_off.flags);
+	ring->sq_mask = *(uint32_t *)(ring->sq_map + params.sq_off.ring_mask);
+	ring->sq_entries = params.sq_entries;
+	ring->sq_local_tail = *ring->sq_tail;
+	ring->sq_submitted = ring->sq_local_tail;
+
+	// SQE i always sits in slot i
+	uint32_t *sq_array = (uint32_t *)(ring->sq_map + params.sq_off.array);
+	for(uint32_t i = 0; i < params.sq_entries; i++)
+		sq_array[i] = i;
+
+	ring->cq_head = (uint32_t *)(ring->cq_map + params.cq_off.head);
+	ring->cq_tail = (uint32_t *)(ring->cq_map + params.cq_off.tail);
+	ring->cq_mask = *(uint32_t *)(ring->cq_map + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(ring->cq_map + params.cq_off.cqes);
+
+	// RX buffers, sized like the ones of an eth_rx_ring
+	uint32_t frame_size = dev->features & NETIF_F_GRO ? ETH_RX_LARGE_SIZE : eth_max_frame_size(dev);
+	ring->rx_reserve = (4 - (dev->vnet_hdr_len + ETHERNET_HEADER_SIZE) % 4) % 4;
+	ring->rx_stride = (ring->rx_reserve + dev->vnet_hdr_len + frame_size + SKB_CACHE_LINE - 1) & ~(SKB_CACHE_LINE - 1);
+	ring->rx_area_size = (size_t)ring->rx_stride * TAP_URING_RX_BUFFERS;
+
+	ring->rx_area = mmap(NULL, ring->rx_area_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(ring->rx_area == MAP_FAILED) {
+		ring->rx_area = NULL;
+		perror("could not map io_uring RX buffers");
+		goto err;
+	}
+
+	struct iovec rx_iov = { .iov_base = ring->rx_area, .iov_len = ring->rx_area_size };
+	if(tap_uring_register(ring->fd, IORING_REGISTER_BUFFERS, &rx_iov, 1) < 0) {
+		perror("could not register io_uring RX buffers");
+		goto err;
+	}
+	if(tap_uring_register(ring->fd, IORING_REGISTER_FILES, &tap_fd, 1) < 0) {
+		perror("could not register TAP fd with io_uring");
+		goto err;
+	}
+
+	// A read on a non-blocking fd fails with EAGAIN instead of waiting for a frame
+	if(fcntl(tap_fd, F_SETFL, fcntl(tap_fd, F_GETFL) & ~O_NONBLOCK) < 0) {
+		perror("could not set TAP device blocking");
+		goto err;
+	}
+
+	for(uint32_t i = 0; i < TAP_URING_RX_BUFFERS; i++) {
+		ring->rx[i].ring = ring;
+		ring->rx[i].index = i;
+		tap_uring_post_rx(ring, i);
+	}
+	for(uint32_t i = 0; i < TAP_URING_TX_SLOTS; i++)
+		ring->tx_free[i] = TAP_URING_TX_SLOTS - 1 - i;
+	ring->tx_free_count = TAP_URING_TX_SLOTS;
+
+	tap_uring_submit(ring, 0);
+	return ring;
+
+err:
+	tap_uring_free(ring);
+	return NULL;
+}
+
+
+// Opens the TAP queues as usual and puts a ring in front of each. Without io_uring the device falls back to
+// plain read() and write().
+static int tap_uring_open(struct net_dev *dev, uint32_t features, const void *arg) {
+	const struct tap_uring_config *config = arg;
+
+	if(tap_ops.open(dev, features, NULL) < 0)
+		return -1;
+
+	for(uint16_t i = 0; i < dev->queue_count; i++) {
+		struct net_queue *queue = &dev->queues[i];
+		struct tap_uring *ring = tap_uring_new(dev, queue->fd, config != NULL && config->sqpoll);
+
+		if(ring == NULL) {
+			for(uint16_t j = 0; j < i; j++) {
+				struct tap_uring *ring = dev->queues[j].priv;
+				dev->queues[j].fd = ring->tap_fd;
+				fcntl(ring->tap_fd, F_SETFL, fcntl(ring->tap_fd, F_GETFL) | O_NONBLOCK);
+				tap_uring_free(ring);
+				dev->queues[j].priv = NULL;
+			}
+
+			printf("io_uring unavailable, falling back to read() and write()\n");
+			dev->ops = &tap_ops;
+			return 0;
+		}
+
+		// The worker waits on the ring, it turns readable when completions come in
+		queue->priv = ring;
+		queue->fd = ring->fd;
+	}
+
+	return 0;
+}
+
+static void tap_uring_close(struct net_dev *dev) {
+	for(uint16_t i = 0; i < dev->queue_count; i++) {
+		struct tap_uring *ring = dev->queues[i].priv;
+		if(ring == NULL)
+			continue;
+
+		dev->queues[i].fd = ring->tap_fd;
+		tap_uring_free(ring);
+		dev->queues[i].priv = NULL;
+	}
+
+	tap_ops.close(dev);
+}
+
+
+// Work for rx_batch() that doesn't show on the ring's fd: frames left over from the last batch, or reaped by a
+// sender, and buffers the stack is done with that aren't posted yet. Read without the locks, a stale answer only
+// costs a round.
+static int tap_uring_rx_work(struct tap_uring *ring) {
+	return __atomic_load_n(&ring->rx_ready_head, __ATOMIC_RELAXED) !=
+		   __atomic_load_n(&ring->rx_ready_tail, __ATOMIC_RELAXED) ||
+		   __atomic_load_n(&ring->rx_free_count, __ATOMIC_RELAXED) > 0;
+}
+
+static uint64_t tap_uring_now_us() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+// The fd turns readable when completions come in
+static int tap_uring_poll(struct tap_uring *ring) {
+	struct pollfd poll_fd = { .fd = ring->fd, .events = POLLIN };
+	struct timespec timeout = { .tv_sec = 0, .tv_nsec = TAP_URING_POLL_NS };
+	if(ppoll(&poll_fd, 1, &timeout, NULL) < 0) {
+		perror("io_uring poll error");
+		return -1;
+	}
+
+	if(poll_fd.revents & (POLLNVAL | POLLERR | POLLHUP))
+		return -1;
+	return (poll_fd.revents & POLLIN) != 0;
+}
+
+// With SQPOLL neither side makes system calls while busy: completions are seen on the CQ tail, and only after
+// spinning idle for a while does the worker block in io_uring_enter() until one comes in, or the wait times out.
+static int tap_uring_spin(struct tap_uring *ring) {
+	if(__atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE) != __atomic_load_n(ring->cq_head, __ATOMIC_RELAXED)) {
+		ring->idle_since = 0;
+		return 1;
+	}
+
+	uint64_t now = tap_uring_now_us();
+	if(ring->idle_since == 0)
+		ring->idle_since = now;
+	if(now - ring->idle_since < TAP_URING_SPIN_US)
+		return 0;
+	if(!ring->ext_arg)
+		return tap_uring_poll(ring);
+
+	struct __kernel_timespec timeout = { .tv_sec = 0, .tv_nsec = TAP_URING_WAIT_MS * 1000000ll };
+	struct io_uring_getevents_arg arg = { .ts = (uint64_t)(uintptr_t)&timeout };
+	int res = tap_uring_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+
+	pthread_mutex_lock(&ring->lock);
+	ring->stats.enters++;
+	ring->stats.waits++;
+	pthread_mutex_unlock(&ring->lock);
+
+	if(res < 0) {
+		if(errno == ETIME || errno == EINTR)
+			return 0;
+		perror("io_uring wait");
+		return -1;
+	}
+
+	ring->idle_since = 0;
+	return 1;
+}
+
+// Everything rx_batch() has to do besides reaping is checked for first
+static int tap_uring_rx_wait(struct net_dev *dev, uint16_t queue) {
+	struct tap_uring *ring = dev->queues[queue].priv;
+
+	if(tap_uring_rx_work(ring)) {
+		ring->idle_since = 0;
+		return 1;
+	}
+
+	return ring->sqpoll ? tap_uring_spin(ring) : tap_uring_poll(ring);
+}
+
+// Reaps completions, posts freed buffers again and hands over the frames that came in. Frames stay in the
+// registered buffers, wrapped in sk_buffs.
+static uint32_t tap_uring_rx_batch(struct net_dev *dev, uint16_t queue, struct eth_rx_ring *ring_unused,
+								   struct sk_buff **buffers, uint32_t max) {
+	struct tap_uring *ring = dev->queues[queue].priv;
+	uint32_t ready[TAP_URING_RX_BUFFERS];
+	uint32_t count = 0;
+
+	pthread_mutex_lock(&ring->lock);
+	tap_uring_reap(ring);
+	tap_uring_post_free(ring);
+	tap_uring_submit(ring, 0);
+
+	while(count < max && ring->rx_ready_head != ring->rx_ready_tail)
+		ready[count++] = ring->rx_ready[ring->rx_ready_head++ % TAP_URING_RX_BUFFERS];
+	pthread_mutex_unlock(&ring->lock);
+
+	uint32_t received = 0;
+	for(uint32_t i = 0; i < count; i++) {
+		struct tap_uring_rx *rx = &ring->rx[ready[i]];
+		uint8_t *data = ring->rx_area + (size_t)rx->index * ring->rx_stride;
+
+		struct skb_page *page = skb_page_wrap(data, ring->rx_stride, tap_uring_rx_release, rx);
+		struct sk_buff *buffer = skb_wrap(page, ring->rx_reserve, rx->len);
+		skb_page_put(page);  // the sk_buff holds the buffer now
+
+		buffer->dev = dev;
+		buffer->queue_mapping = queue;
+		if(dev->vnet_hdr_len && tap_read_vnet_hdr(dev, buffer) < 0) {
+			skb_free(buffer);
+			continue;
+		}
+
+		buffers[received++] = buffer;
+	}
+
+	return received;
+}
+
+// Queues a write per frame, submitted on flush. The buffers stay referenced until their writes complete.
+static uint32_t tap_uring_tx_batch(struct net_dev *dev, uint16_t queue, struct sk_buff **buffers, uint32_t count) {
+	struct tap_uring *ring = dev->queues[queue].priv;
+	uint32_t sent = 0;
+
+	pthread_mutex_lock(&ring->lock);
+
+	for(uint32_t i = 0; i < count; i++) {
+		struct sk_buff *buffer = buffers[i];
+
+		if(ring->tx_free_count == 0)
+			tap_uring_reap(ring);
+		if(ring->tx_free_count == 0) {
+			tap_uring_submit(ring, 1);
+			tap_uring_reap(ring);
+		}
+
+		struct io_uring_sqe *sqe = ring->tx_free_count > 0 ? tap_uring_get_sqe(ring) : NULL;
+		if(sqe == NULL) {
+			ring->stats.errors++;
+			skb_free(buffer);
+			continue;
+		}
+
+		if(dev->vnet_hdr_len)
+			tap_push_vnet_hdr(dev, buffer);
+
+		uint32_t index = ring->tx_free[--ring->tx_free_count];
+		struct tap_uring_tx *tx = &ring->tx[index];
+		tx->buffer = buffer;
+
+		// Linear part first, then the fragments as they are
+		tx->iov[0].iov_base = buffer->data;
+		tx->iov[0].iov_len = skb_headlen(buffer);
+		for(int j = 0; j < buffer->nr_frags; j++) {
+			tx->iov[j + 1].iov_base = skb_frag_address(&buffer->frags[j]);
+			tx->iov[j + 1].iov_len = buffer->frags[j].len;
+		}
+
+		sqe->opcode = IORING_OP_WRITEV;
+		sqe->flags = IOSQE_FIXED_FILE;
+		sqe->fd = 0;
+		sqe->addr = (uint64_t)(uintptr_t)tx->iov;
+		sqe->len = 1 + buffer->nr_frags;
+		sqe->user_data = TAP_URING_TX_TAG | index;
+		sent++;
+	}
+
+	pthread_mutex_unlock(&ring->lock);
+	return sent;
+}
+
+// One submission for everything queued since the last flush
+static void tap_uring_flush(struct net_dev *dev, uint16_t queue) {
+	struct tap_uring *ring = dev->queues[queue].priv;
+
+	pthread_mutex_lock(&ring->lock);
+	tap_uring_submit(ring, 0);
+	pthread_mutex_unlock(&ring->lock);
+}
+
+static void tap_uring_print_stats(struct net_dev *dev) {
+	for(uint16_t i = 0; i < dev->queue_count; i++) {
+		struct tap_uring *ring = dev->queues[i].priv;
+
+		printf("%s queue #%d io_uring%s: %" PRIu64 " SQEs in %" PRIu64 " io_uring_enter() calls, %" PRIu64
+			   " idle waits | RX completions: %" PRIu64 " | TX completions: %" PRIu64 " | errors: %" PRIu64 "\n",
+			   dev->name, i, ring->sqpoll ? " (SQPOLL)" : "", ring->stats.sqes, ring->stats.enters,
+			   ring->stats.waits, ring->stats.rx_completions, ring->stats.tx_completions, ring->stats.errors);
+	}
+}
+
+
+const struct net_dev_ops tap_uring_ops = {
+	.name = "tap (io_uring)",
+	.open = tap_uring_open,
+	.close = tap_uring_close,
+	.rx_batch = tap_uring_rx_batch,
+	.rx_wait = tap_uring_rx_wait,
+	.tx_batch = tap_uring_tx_batch,
+	.flush = tap_uring_flush,
+	.print_stats = tap_uring_print_stats,
+};
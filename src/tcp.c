@@ -12,66 +12,82 @@ uint32_t tcp_timer_get_ticks() {
 }
 
 void *tcp_timer_fast(void *args) {
-	pthread_mutex_t *threads_mutex = (pthread_mutex_t *)args;
+	struct net_dev *dev = (struct net_dev *)args;
 
 	while(RUNNING) {
-		pthread_mutex_lock(threads_mutex);
+		for(uint16_t i = 0; i < dev->queue_count; i++) {
+			struct net_queue *queue = &dev->queues[i];
+			pthread_mutex_lock(&queue->lock);
 
-		struct list_head *list_item;
-		struct tcp_socket *tcp_socket;
+			struct list_head *list_item;
+			struct tcp_socket *tcp_socket;
 
-		list_for_each(list_item, &tcp_socket_list) {
-			tcp_socket = list_entry(list_item, struct tcp_socket, list);
+			list_for_each(list_item, &queue->sockets) {
+				tcp_socket = list_entry(list_item, struct tcp_socket, list);
 
-			if(tcp_socket == NULL || tcp_socket->state != TCPS_ESTABLISHED)
-				continue;
+				if(tcp_socket == NULL || tcp_socket->state != TCPS_ESTABLISHED)
+					continue;
 
-			if(tcp_socket->delayed_ack)
-				tcp_out_ack(tcp_socket);
+				if(tcp_socket->delayed_ack)
+					tcp_out_ack(tcp_socket);
+			}
+
+			pthread_mutex_unlock(&queue->lock);
+
+			// Everything sent during the tick goes out in one batch
+			eth_flush(dev, i);
 		}
 
 		timer_ticks += TCP_T_FAST_INTERVAL;
 
-		pthread_mutex_unlock(threads_mutex);
-
 		usleep(TCP_T_FAST_INTERVAL * 1000);
 	}
+
+	skb_pool_flush_local();
 	return NULL;
 }
 
 void *tcp_timer_slow(void *args) {
-	pthread_mutex_t *threads_mutex = (pthread_mutex_t *)args;
+	struct net_dev *dev = (struct net_dev *)args;
 
 	while(RUNNING) {
-		pthread_mutex_lock(threads_mutex);
+		for(uint16_t i = 0; i < dev->queue_count; i++) {
+			struct net_queue *queue = &dev->queues[i];
+			pthread_mutex_lock(&queue->lock);
 
-		struct list_head *list_item;
-		struct tcp_socket *tcp_socket;
+			struct list_head *list_item;
+			struct tcp_socket *tcp_socket;
 
-		list_for_each(list_item, &tcp_socket_list) {
-			tcp_socket = list_entry(list_item, struct tcp_socket, list);
+			list_for_each(list_item, &queue->sockets) {
+				tcp_socket = list_entry(list_item, struct tcp_socket, list);
 
-			if(tcp_socket == NULL || (tcp_socket->state != TCPS_ESTABLISHED && tcp_socket->state != TCPS_SYN_SENT))
-				continue;
+				if(tcp_socket == NULL || (tcp_socket->state != TCPS_ESTABLISHED && tcp_socket->state != TCPS_SYN_SENT))
+					continue;
 
-			// Check if RTO expired
-			if(tcp_socket->rto_expires && tcp_socket->rto_expires < timer_ticks) {
-				if(tcp_socket->state == TCPS_SYN_SENT || tcp_socket->state == TCPS_SYN_RCVD) {
-					tcp_socket->cwnd = tcp_socket->mss;
-				}
+				// Check if RTO expired
+				if(tcp_socket->rto_expires && tcp_socket->rto_expires < timer_ticks) {
+					if(tcp_socket->state == TCPS_SYN_SENT || tcp_socket->state == TCPS_SYN_RCVD) {
+						tcp_socket->cwnd = tcp_socket->mss;
+					}
 
-				tcp_socket->rto = min(tcp_socket->rto * 2, TCP_RTO_MAX);
-				tcp_socket->rto_expires = timer_ticks + tcp_socket->rto;
+					tcp_socket->rto = min(tcp_socket->rto * 2, TCP_RTO_MAX);
+					tcp_socket->rto_expires = timer_ticks + tcp_socket->rto;
 
-				printf("Resending segment, RTO=%u\n", tcp_socket->rto);
-				tcp_out_queue_send(tcp_socket);
+					printf("Resending segment, RTO=%u\n", tcp_socket->rto);
+					tcp_out_queue_send(tcp_socket);
+				}
 			}
-		}
 
-		pthread_mutex_unlock(threads_mutex);
+			pthread_mutex_unlock(&queue->lock);
+
+			// Everything sent during the tick goes out in one batch
+			eth_flush(dev, i);
+		}
 
 		usleep(TCP_T_SLOW_INTERVAL * 1000);
 	}
+
+	skb_pool_flush_local();
 	return NULL;
 }
 
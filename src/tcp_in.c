@@ -8,6 +8,25 @@
 #include "utils.h"
 
 
+// Appends a buffer holding received payload to the receive queue and shrinks the window accordingly
+void tcp_in_queue_push(struct tcp_socket *tcp_socket, struct sk_buff *sk_buff) {
+	struct tcp_buffer_queue_entry *buffer_queue_entry = malloc(sizeof(struct tcp_buffer_queue_entry));
+	buffer_queue_entry->next = NULL;
+	buffer_queue_entry->sk_buff = sk_buff;
+
+	if(tcp_socket->in_queue_head == NULL)
+		tcp_socket->in_queue_head = buffer_queue_entry;
+	else {
+		struct tcp_buffer_queue_entry *tail = tcp_socket->in_queue_head;
+		while(tail->next != NULL)
+			tail = tail->next;
+
+		tail->next = buffer_queue_entry;
+	}
+
+	tcp_socket->rcv_wnd -= min(tcp_socket->rcv_wnd, sk_buff->payload_size);
+}
+
 uint8_t tcp_in_options(struct tcp_segment *tcp_segment, struct tcp_options *opts) {
 	uint8_t options_size = (uint8_t) ((tcp_segment->data_offset - 5) << 2);
 	if (options_size == 0)
@@ -161,27 +180,48 @@ int tcp_accept_test(struct tcp_socket *tcp_socket, struct tcp_segment *tcp_segme
 	return 0;
 }
 
-void tcp_in(struct eth_frame *frame) {
-	struct ipv4_packet *ip_packet = (struct ipv4_packet *) frame->payload;
-	struct tcp_segment *tcp_segment = (struct tcp_segment *) (ip_packet->data +
-														((ip_packet->header_len * 4) - sizeof(struct ipv4_packet)));
+void tcp_in(struct sk_buff *buffer) {
+	struct tcp_segment *tcp_segment = tcp_segment_from_skb(buffer);
+
+	// The family is in the version nibble both headers start with
+	uint8_t family;
+	struct sock_addr source, dest;
+	uint16_t tcp_segment_size;
+	uint32_t sum;
+	if((*buffer->network_header >> 4) == 6) {
+		struct ipv6_packet *ip_packet = ipv6_packet_from_skb(buffer);
+		family = AF_INET6;
+		source = sock_addr_ipv6(ip_packet->source_ip);
+		dest = sock_addr_ipv6(ip_packet->dest_ip);
+		tcp_segment_size = ip_packet->payload_len;
+		sum = ipv6_pseudo_header_sum(IPPROTO_TCP, tcp_segment_size, ip_packet->source_ip, ip_packet->dest_ip);
+	}
+	else {
+		struct ipv4_packet *ip_packet = ipv4_packet_from_skb(buffer);
+		family = AF_INET;
+		source = sock_addr_ipv4(ip_packet->source_ip);
+		dest = sock_addr_ipv4(ip_packet->dest_ip);
+		tcp_segment_size = (uint16_t)(ip_packet->len - ip_packet->header_len * 4);
+		sum = tcp_pseudo_header_sum(tcp_segment_size, ip_packet->source_ip, ip_packet->dest_ip);
+	}
 
 	uint16_t checksum = tcp_segment->checksum;
-	uint16_t tcp_segment_size = (uint16_t)(ip_packet->len - ip_packet->header_len * 4);
 	uint16_t tcp_data_size = (uint16_t)(tcp_segment_size - TCP_HEADER_SIZE);
 
-	// Compare checksums
-	tcp_segment->checksum = 0;
-	if (checksum != tcp_checksum((void *)tcp_segment, tcp_segment_size, ip_packet->source_ip, ip_packet->dest_ip)) {
-		fprintf(stderr, "TCP segment has mismatching checksum!\n");
-		return;
+	// Compare checksums, unless the device did it already
+	if (buffer->ip_summed != CHECKSUM_UNNECESSARY) {
+		tcp_segment->checksum = 0;
+		if (checksum != checksum_fold(checksum_partial(tcp_segment, tcp_segment_size, sum))) {
+			fprintf(stderr, "TCP segment has mismatching checksum!\n");
+			return;
+		}
 	}
 
 	// ntoh
 	tcp_segment_ntoh(tcp_segment);
 
 	// Get tcp_socket
-	struct tcp_socket *tcp_socket = tcp_socket_get(ip_packet->dest_ip, ip_packet->source_ip, tcp_segment->dest_port,
+	struct tcp_socket *tcp_socket = tcp_socket_get(buffer->dev, family, &dest, &source, tcp_segment->dest_port,
 											   tcp_segment->source_port);
 	if (!tcp_socket || tcp_socket->state == TCPS_CLOSED) {
 		// TODO: If there is no RST flag present, send RST
@@ -348,7 +388,7 @@ check_urg:
 		case TCPS_ESTABLISHED:
 		case TCPS_FIN_WAIT1:
 		case TCPS_FIN_WAIT2: {
-			uint16_t payload_size = ip_packet->len - sizeof(struct ipv4_packet) - sizeof(struct tcp_segment) - options_size;
+			uint16_t payload_size = (uint16_t)(tcp_segment_size - sizeof(struct tcp_segment) - options_size);
 
 			if (payload_size > 0) {
 				// Get payload
@@ -361,6 +401,11 @@ check_urg:
 //				printf("\nReceived (%d bytes):\n--------------------\n%.*s\n--------------------\n",
 //					   payload_size, payload_size, payload);
 
+				// Keep the RX buffer on the receive queue instead of copying the payload out
+				skb_pull(buffer, (uint32_t)(payload - buffer->data));
+				buffer->payload_size = payload_size;
+				tcp_in_queue_push(tcp_socket, skb_keep(buffer));
+
 				if(tcp_socket->delayed_ack)  // RFC1122 states there should be ACK for at least every 2nd incoming segment
 					tcp_out_ack(tcp_socket);
 				else
@@ -1,16 +1,25 @@
 #include <memory.h>
+#include <stddef.h>
 #include <malloc.h>
 #include "tcp.h"
 #include "skbuff.h"
 #include "ipv4.h"
+#include "ipv6.h"
 
 
 
-struct sk_buff *tcp_out_create_buffer(uint16_t payload_size) {
-	struct sk_buff *buffer = skb_alloc(ETHERNET_HEADER_SIZE + IP_HEADER_SIZE + TCP_HEADER_SIZE + payload_size);
-	struct tcp_segment *tcp_segment = tcp_segment_from_skb(buffer);
+// Creates a buffer with the TCP header (and room for options) in place, payload can be appended with skb_put()
+struct sk_buff *tcp_out_create_buffer(uint16_t payload_size, uint8_t options_size) {
+	uint8_t header_size = (uint8_t)(TCP_HEADER_SIZE + options_size);
+
+	struct sk_buff *buffer = skb_alloc(SKB_MAX_HEADER + payload_size);
+	skb_reserve(buffer, SKB_MAX_HEADER - header_size);
 
-	tcp_segment->data_offset = TCP_HEADER_SIZE >> 2;
+	struct tcp_segment *tcp_segment = (struct tcp_segment *)skb_put(buffer, header_size);
+	skb_reset_transport_header(buffer);
+	memset(tcp_segment, 0, header_size);
+
+	tcp_segment->data_offset = header_size >> 2;
 
 	return buffer;
 }
@@ -27,60 +36,152 @@ void tcp_out_set_seqnums(struct tcp_socket *tcp_socket, struct sk_buff *buffer)
 
 // Converts header variables to network endianness and fills checksum
 void tcp_out_header(struct tcp_socket *tcp_socket, struct sk_buff *buffer) {
-	struct ipv4_packet *ip_packet = ipv4_packet_from_skb(buffer);
 	struct tcp_segment *tcp_segment = tcp_segment_from_skb(buffer);
 
-	ip_packet->protocol = IPPROTO_TCP;
-
 	tcp_segment->seq = htonl(tcp_segment->seq);
 	tcp_segment->ack_seq = htonl(tcp_segment->ack_seq);
 	tcp_segment->source_port = htons(tcp_socket->sock.source_port);
 	tcp_segment->dest_port = htons(tcp_socket->sock.dest_port);
 	tcp_segment->window_size = htons((uint16_t)tcp_socket->rcv_wnd);
 
+	uint16_t tcp_segment_len = (uint16_t)(buffer->tail - buffer->transport_header + buffer->data_len);
+	struct sock *sock = &tcp_socket->sock;
+	uint32_t sum = sock->family == AF_INET6
+				   ? ipv6_pseudo_header_sum(IPPROTO_TCP, tcp_segment_len, sock->source.ipv6, sock->dest.ipv6)
+				   : tcp_pseudo_header_sum(tcp_segment_len, sock->source.ipv4, sock->dest.ipv4);
+
+	if(tcp_socket->sock.dev->features & NETIF_F_HW_CSUM) {
+		// The kernel sums the segment itself, it only needs the pseudo header
+		tcp_segment->checksum = (uint16_t)~checksum_fold(sum);
+		buffer->ip_summed = CHECKSUM_PARTIAL;
+		buffer->csum_offset = offsetof(struct tcp_segment, checksum);
+		return;
+	}
+
 	tcp_segment->checksum = 0;
-	tcp_segment->checksum = tcp_checksum((void *)tcp_segment, (uint16_t)(buffer->size - ETHERNET_HEADER_SIZE - IP_HEADER_SIZE),
-										 tcp_socket->sock.source_ip, tcp_socket->sock.dest_ip);
+	tcp_segment->checksum = checksum_fold(checksum_skb(buffer, buffer->transport_header, sum));
+	buffer->ip_summed = CHECKSUM_NONE;
 }
 
-// Sends TCP segment
+// Brings ack_seq and window of a queued segment up to date, the checksum is adjusted for the changed fields only
+static void tcp_out_refresh(struct tcp_socket *tcp_socket, struct sk_buff *buffer) {
+	struct tcp_segment *tcp_segment = tcp_segment_from_skb(buffer);
+
+	uint32_t ack_seq = tcp_segment->ack ? htonl(tcp_socket->rcv_nxt) : tcp_segment->ack_seq;
+	uint16_t window_size = htons((uint16_t)tcp_socket->rcv_wnd);
+	if(ack_seq == tcp_segment->ack_seq && window_size == tcp_segment->window_size)
+		return;
+
+	// The device sums the segment itself, the field only holds the pseudo header sum
+	if(buffer->ip_summed != CHECKSUM_PARTIAL) {
+		tcp_segment->checksum = checksum_adjust(tcp_segment->checksum, &tcp_segment->ack_seq, &ack_seq, sizeof(ack_seq));
+		tcp_segment->checksum = checksum_adjust(tcp_segment->checksum, &tcp_segment->window_size, &window_size,
+												sizeof(window_size));
+	}
+
+	tcp_segment->ack_seq = ack_seq;
+	tcp_segment->window_size = window_size;
+}
+
+// Sends TCP segment, consumes the caller's reference to the buffer
 void tcp_out_send(struct tcp_socket *tcp_socket, struct sk_buff *buffer) {
 	// Set RTO
 	tcp_socket->rto_expires = tcp_timer_get_ticks() + tcp_socket->rto;
 
 	struct tcp_segment *segment = tcp_segment_from_skb(buffer);
-	if((!segment->psh && !segment->syn) || tcp_socket->rto > 1000) // for debugging, imitate packet loss
+	if((segment->psh || segment->syn) && tcp_socket->rto <= 1000) // for debugging, imitate packet loss
+		skb_free(buffer);
+	else if(tcp_socket->sock.family == AF_INET6)
+		ipv6_send_packet(&tcp_socket->sock, buffer);
+	else
 		ipv4_send_packet(&tcp_socket->sock, buffer);
 }
 
 
-uint32_t tcp_out_data(struct tcp_socket *tcp_socket, uint8_t *data, uint32_t data_len) {
-    uint32_t packet_count = data_len / (tcp_socket->mss + 1) + 1;
+// Largest segment handed to the device, whole multiple of the MSS that still fits the send window
+static uint32_t tcp_out_max_segment(struct tcp_socket *tcp_socket) {
+	if(!(tcp_socket->sock.dev->features & NETIF_F_TSO))
+		return tcp_socket->mss;
+
+	uint32_t size = min((uint32_t)TCP_TSO_MAX_SIZE, tcp_socket->snd_wnd - 1);
+	return max(size - size % tcp_socket->mss, (uint32_t)tcp_socket->mss);
+}
+
+// Queues one data segment pointing into the page. With csum_valid, csum is the payload's sum from the copy.
+static void tcp_out_data_segment(struct tcp_socket *tcp_socket, struct skb_page *page, uint32_t offset,
+								 uint16_t packet_len, int last, int csum_valid, uint32_t csum) {
+	struct sk_buff *buffer = tcp_out_create_buffer(0, 0);
+
+	// TSO: the device cuts it into MSS sized segments
+	if(packet_len > tcp_socket->mss)
+		buffer->gso_size = tcp_socket->mss;
+
+	struct tcp_segment *tcp_segment = tcp_segment_from_skb(buffer);
+
+	// Set PSH flag only if last packet
+	if(last)
+		tcp_segment->psh = 1;
+
+	tcp_segment->ack = 1;
+
+	skb_add_frag(buffer, page, offset, packet_len);
+	buffer->payload_size = packet_len;
+
+	if(csum_valid) {
+		buffer->ip_summed = CHECKSUM_COMPLETE;
+		buffer->csum = csum;
+	}
+
+	tcp_out_set_seqnums(tcp_socket, buffer);
+	tcp_out_header(tcp_socket, buffer);
 
-    for(int i = 0; i < packet_count; i++) {
-        uint16_t packet_len = (i < packet_count - 1) ? tcp_socket->mss : (uint16_t)(data_len % tcp_socket->mss);
-        struct sk_buff *buffer = tcp_out_create_buffer(packet_len);
-        struct tcp_segment *tcp_segment = tcp_segment_from_skb(buffer);
+	// Advance snd_next
+	tcp_socket->snd_nxt += packet_len;
 
-        // Set PSH flag only if last packet
-        if(i == packet_count - 1)
-            tcp_segment->psh = 1;
+	tcp_out_queue_push(tcp_socket, buffer);
+}
 
-        tcp_segment->ack = 1;
+// Queues data that has to stay valid until the segments are ACKed, each segment references the page
+uint32_t tcp_out_data_page(struct tcp_socket *tcp_socket, struct skb_page *page, uint32_t offset, uint32_t data_len) {
+	uint32_t sent = 0;
+	uint32_t max_segment = tcp_out_max_segment(tcp_socket);
 
-        memcpy(tcp_segment->data, data + (i * tcp_socket->mss), (size_t)packet_len);
-		buffer->payload_size = packet_len;
+	while(sent < data_len) {
+		uint16_t packet_len = (uint16_t)min(data_len - sent, max_segment);
+		tcp_out_data_segment(tcp_socket, page, offset + sent, packet_len, sent + packet_len == data_len, 0, 0);
+		sent += packet_len;
+	}
 
-		tcp_out_set_seqnums(tcp_socket, buffer);
-		tcp_out_header(tcp_socket, buffer);
+	tcp_out_queue_send(tcp_socket);
+	return data_len;
+}
 
-		// Advance snd_next
-		tcp_socket->snd_nxt += packet_len;
+// Copies the data once, so the caller can reuse its buffer right away. Unless the device sums the segments,
+// each one is summed while it's copied, checksum_copy_partial() picks the faster way for its size.
+uint32_t tcp_out_data(struct tcp_socket *tcp_socket, uint8_t *data, uint32_t data_len) {
+	struct skb_page *page = skb_page_alloc(data_len);
 
-		tcp_out_queue_push(tcp_socket, buffer);
-    }
+	if(tcp_socket->sock.dev->features & NETIF_F_HW_CSUM) {
+		memcpy(page->data, data, data_len);
+		tcp_out_data_page(tcp_socket, page, 0, data_len);
+		skb_page_put(page);
+		return data_len;
+	}
+
+	uint32_t sent = 0;
+	uint32_t max_segment = tcp_out_max_segment(tcp_socket);
+
+	while(sent < data_len) {
+		uint16_t packet_len = (uint16_t)min(data_len - sent, max_segment);
+		uint32_t csum = checksum_copy_partial(page->data + sent, data + sent, packet_len, 0);
+
+		tcp_out_data_segment(tcp_socket, page, sent, packet_len, sent + packet_len == data_len, 1, csum);
+		sent += packet_len;
+	}
 
 	tcp_out_queue_send(tcp_socket);
+	skb_page_put(page);
+
 	return data_len;
 }
 
@@ -98,15 +199,72 @@ void tcp_out_queue_push(struct tcp_socket *tcp_socket, struct sk_buff *sk_buff)
 
 		tail->next = buffer_queue_entry;
 	}
+}
 
-	sk_buff->manual_free = 1;  // don't free() when calling eth_write()
+// Makes a queued segment fit an MSS that shrank after it was queued. TSO segments just get a smaller gso_size, the
+// others are cut into segments referencing the same page, with new headers and their checksums.
+static void tcp_out_fit_mss(struct tcp_socket *tcp_socket, struct tcp_buffer_queue_entry *entry) {
+	struct sk_buff *buffer = entry->sk_buff;
+	struct tcp_segment *tcp_segment = tcp_segment_from_skb(buffer);
+
+	if(buffer->gso_size) {
+		buffer->gso_size = min(buffer->gso_size, tcp_socket->mss);
+		return;
+	}
+
+	if(buffer->nr_frags != 1)
+		return;  // only data segments are large, and they reference one page
+
+	struct skb_frag *frag = &buffer->frags[0];
+	uint32_t seq = ntohl(tcp_segment->seq);
+	struct tcp_buffer_queue_entry *tail = entry;
+
+	for(uint32_t offset = 0; offset < buffer->payload_size; offset += tcp_socket->mss) {
+		uint16_t packet_len = (uint16_t)min(buffer->payload_size - offset, (uint32_t)tcp_socket->mss);
+
+		struct sk_buff *piece = tcp_out_create_buffer(0, 0);
+		struct tcp_segment *piece_segment = tcp_segment_from_skb(piece);
+
+		piece_segment->ack = 1;
+		piece_segment->psh = (uint8_t)(tcp_segment->psh && offset + packet_len == buffer->payload_size);
+		piece_segment->seq = seq + offset;
+		piece_segment->ack_seq = tcp_socket->rcv_nxt;
+
+		skb_add_frag(piece, frag->page, frag->offset + offset, packet_len);
+		piece->payload_size = packet_len;
+		tcp_out_header(tcp_socket, piece);
+
+		if(offset == 0) {
+			entry->sk_buff = piece;
+			continue;
+		}
+
+		struct tcp_buffer_queue_entry *piece_entry = malloc(sizeof(struct tcp_buffer_queue_entry));
+		if(piece_entry == NULL) {
+			perror("could not allocate memory for TCP queue entry");
+			exit(1);
+		}
+
+		piece_entry->sk_buff = piece;
+		piece_entry->next = tail->next;
+		tail->next = piece_entry;
+		tail = piece_entry;
+	}
+
+	skb_free(buffer);
 }
 
 void tcp_out_queue_send(struct tcp_socket *tcp_socket) {
 	struct tcp_buffer_queue_entry *entry = tcp_socket->out_queue_head;
 
 	while(entry != NULL && entry->sk_buff->payload_size < tcp_socket->snd_wnd) {
-		tcp_out_send(tcp_socket, entry->sk_buff);
+		if(entry->sk_buff->payload_size > tcp_socket->mss)
+			tcp_out_fit_mss(tcp_socket, entry);  // the path MTU shrank since it was queued
+
+		tcp_out_refresh(tcp_socket, entry->sk_buff);  // retransmissions acknowledge what arrived since
+		// The queued segment stays untouched: each transmission gets its own headers, which may still sit in a
+		// device queue or be read by the kernel when the segment is sent again
+		tcp_out_send(tcp_socket, skb_copy_head(entry->sk_buff));
 		tcp_socket->snd_wnd -= entry->sk_buff->payload_size;
 		tcp_socket->delayed_ack = 0;  // piggyback off
 
@@ -135,7 +293,7 @@ void tcp_out_queue_clear(struct tcp_socket *tcp_socket, uint32_t seq_num) {
 }
 
 void tcp_out_ack(struct tcp_socket *tcp_socket) {
-	struct sk_buff *buffer = tcp_out_create_buffer(0);
+	struct sk_buff *buffer = tcp_out_create_buffer(0, 0);
 	struct tcp_segment *tcp_segment = tcp_segment_from_skb(buffer);
 
 	tcp_segment->ack = 1;
@@ -148,7 +306,7 @@ void tcp_out_ack(struct tcp_socket *tcp_socket) {
 }
 
 void tcp_out_syn(struct tcp_socket *tcp_socket) {
-	struct sk_buff *buffer = tcp_out_create_buffer(4);
+	struct sk_buff *buffer = tcp_out_create_buffer(0, 4);
 	struct tcp_segment *tcp_segment = tcp_segment_from_skb(buffer);
 
 	// Set state
@@ -156,7 +314,6 @@ void tcp_out_syn(struct tcp_socket *tcp_socket) {
 
 	// TCP
 	tcp_segment->syn = 1;
-	tcp_segment->data_offset = 6;
 	tcp_out_set_seqnums(tcp_socket, buffer);
 
 	// Options TODO: improve this part
@@ -177,7 +334,7 @@ void tcp_out_syn(struct tcp_socket *tcp_socket) {
 }
 
 void tcp_out_fin(struct tcp_socket *tcp_socket) {
-	struct sk_buff *buffer = tcp_out_create_buffer(0);
+	struct sk_buff *buffer = tcp_out_create_buffer(0, 0);
 	struct tcp_segment *tcp_segment = tcp_segment_from_skb(buffer);
 
 	tcp_segment->fin = 1;
@@ -189,7 +346,7 @@ void tcp_out_fin(struct tcp_socket *tcp_socket) {
 }
 
 void tcp_out_synack(struct tcp_socket *tcp_socket) {
-	struct sk_buff *buffer = tcp_out_create_buffer(0);
+	struct sk_buff *buffer = tcp_out_create_buffer(0, 0);
 	struct tcp_segment *tcp_segment = tcp_segment_from_skb(buffer);
 
 	tcp_segment->ack = 0;
@@ -201,7 +358,7 @@ void tcp_out_synack(struct tcp_socket *tcp_socket) {
 }
 
 void tcp_out_rst(struct tcp_socket *tcp_socket) {
-	struct sk_buff *buffer = tcp_out_create_buffer(0);
+	struct sk_buff *buffer = tcp_out_create_buffer(0, 0);
 	struct tcp_segment *tcp_segment = tcp_segment_from_skb(buffer);
 
 	tcp_segment->rst = 1;
@@ -212,7 +369,7 @@ void tcp_out_rst(struct tcp_socket *tcp_socket) {
 }
 
 void tcp_out_rstack(struct tcp_socket *tcp_socket) {
-	struct sk_buff *buffer = tcp_out_create_buffer(0);
+	struct sk_buff *buffer = tcp_out_create_buffer(0, 0);
 	struct tcp_segment *tcp_segment = tcp_segment_from_skb(buffer);
 
 	tcp_segment->ack = 1;
@@ -1,9 +1,9 @@
 #include "tcp.h"
+#include "ipv4_pmtu.h"
 
-LIST_HEAD(tcp_socket_list);
 
-
-struct tcp_socket* tcp_socket_new(struct net_dev *device, uint32_t dest_ip, uint16_t source_port, uint16_t dest_port) {
+// Addresses of the family, IPv4 or IPv6
+struct tcp_socket* tcp_socket_new(struct net_dev *device, uint8_t family, const struct sock_addr *source, const struct sock_addr *dest, uint16_t source_port, uint16_t dest_port) {
     struct tcp_socket* tcp_socket = (struct tcp_socket*)malloc(sizeof(struct tcp_socket));
     if(tcp_socket == NULL) {
         perror("could not allocate memory for TCP socket");
@@ -12,7 +12,11 @@ struct tcp_socket* tcp_socket_new(struct net_dev *device, uint32_t dest_ip, uint
     memset(tcp_socket, 0, sizeof(struct tcp_socket));
 
     tcp_socket->state = TCPS_CLOSED;
-    tcp_socket->mss = device->mtu - (uint16_t)IP_HEADER_SIZE - (uint16_t)TCP_HEADER_SIZE;
+    if(family == AF_INET6)
+        tcp_socket->mss = device->mtu - (uint16_t)IPV6_HEADER_SIZE - (uint16_t)TCP_HEADER_SIZE;
+    else
+        tcp_socket->mss = ipv4_pmtu_get(dest->ipv4, device->mtu, NULL, NULL) - (uint16_t)IP_HEADER_SIZE -
+                          (uint16_t)TCP_HEADER_SIZE;
     tcp_socket->rto = 1000;  // RFC6298: 1 second or greater first
     tcp_socket->iss = (uint32_t)lrand48();
     tcp_socket->snd_nxt = tcp_socket->iss;
@@ -21,29 +25,36 @@ struct tcp_socket* tcp_socket_new(struct net_dev *device, uint32_t dest_ip, uint
     tcp_socket->snd_wnd = TCP_INITIAL_WINDOW;
 
     tcp_socket->sock.dev = device;
+    tcp_socket->sock.family = family;
     tcp_socket->sock.protocol = IPPROTO_TCP;
-    tcp_socket->sock.source_ip = device->ipv4;
-    tcp_socket->sock.dest_ip = dest_ip;
+    tcp_socket->sock.source = *source;
+    tcp_socket->sock.dest = *dest;
     tcp_socket->sock.source_port = source_port;
     tcp_socket->sock.dest_port = dest_port;
 
-    list_add(&tcp_socket->list, &tcp_socket_list);
+    // The caller holds the lock of this queue
+    struct net_queue *queue = net_dev_flow_queue(device, sock_addr_fold(source), sock_addr_fold(dest), source_port, dest_port);
+    tcp_socket->sock.queue = queue->index;
+    list_add(&tcp_socket->list, &queue->sockets);
 
     return tcp_socket;
 }
 
-struct tcp_socket* tcp_socket_get(uint32_t source_ip, uint32_t dest_ip, uint16_t source_port, uint16_t dest_port) {
+// The caller holds the lock of the flow's queue
+struct tcp_socket* tcp_socket_get(struct net_dev *dev, uint8_t family, const struct sock_addr *source, const struct sock_addr *dest, uint16_t source_port, uint16_t dest_port) {
     struct list_head *list_item;
     struct tcp_socket *tcp_socket_item;
+    struct net_queue *queue = net_dev_flow_queue(dev, sock_addr_fold(source), sock_addr_fold(dest), source_port, dest_port);
 
-    list_for_each(list_item, &tcp_socket_list) {
+    list_for_each(list_item, &queue->sockets) {
         tcp_socket_item = list_entry(list_item, struct tcp_socket, list);
 
         if(tcp_socket_item == NULL)
             return NULL;
 
-        if(tcp_socket_item->sock.source_ip == source_ip && tcp_socket_item->sock.dest_ip == dest_ip &&
-           tcp_socket_item->sock.source_port == source_port && tcp_socket_item->sock.dest_port == dest_port) {
+        if(tcp_socket_item->sock.family == family && sock_addr_equal(&tcp_socket_item->sock.source, source) &&
+           sock_addr_equal(&tcp_socket_item->sock.dest, dest) && tcp_socket_item->sock.source_port == source_port &&
+           tcp_socket_item->sock.dest_port == dest_port) {
             return tcp_socket_item;
         }
     }
@@ -51,6 +62,36 @@ struct tcp_socket* tcp_socket_get(uint32_t source_ip, uint32_t dest_ip, uint16_t
     return NULL;
 }
 
+// Copies at most data_len bytes of received payload, returns the number of bytes copied
+uint32_t tcp_socket_read(struct tcp_socket *tcp_socket, uint8_t *data, uint32_t data_len) {
+    uint32_t copied = 0;
+
+    while(tcp_socket->in_queue_head != NULL && copied < data_len) {
+        struct tcp_buffer_queue_entry *entry = tcp_socket->in_queue_head;
+        struct sk_buff *sk_buff = entry->sk_buff;
+
+        uint32_t len = min(data_len - copied, sk_buff->payload_size);
+        memcpy(data + copied, sk_buff->data, len);
+        copied += len;
+
+        if(len < sk_buff->payload_size) {
+            // Partially read
+            skb_pull(sk_buff, len);
+            sk_buff->payload_size -= len;
+            break;
+        }
+
+        tcp_socket->in_queue_head = entry->next;
+        skb_free(sk_buff);
+        free(entry);
+    }
+
+    // Reopen the window
+    tcp_socket->rcv_wnd = min(tcp_socket->rcv_wnd + copied, (uint32_t)TCP_INITIAL_WINDOW);
+
+    return copied;
+}
+
 void tcp_socket_free_queues(struct tcp_socket *tcp_socket) {
     struct tcp_buffer_queue_entry *entry = tcp_socket->out_queue_head;
     while(entry != NULL) {
@@ -59,6 +100,7 @@ void tcp_socket_free_queues(struct tcp_socket *tcp_socket) {
         free(entry);
         entry = tmp;
     }
+    tcp_socket->out_queue_head = NULL;
 
     entry = tcp_socket->in_queue_head;
     while(entry != NULL) {
@@ -67,6 +109,7 @@ void tcp_socket_free_queues(struct tcp_socket *tcp_socket) {
         free(entry);
         entry = tmp;
     }
+    tcp_socket->in_queue_head = NULL;
 }
 
 void tcp_socket_free(struct tcp_socket *tcp_socket) {
@@ -0,0 +1,230 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <inttypes.h>
+
+#include "udp.h"
+#include "ipv4.h"
+#include "eth.h"
+#include "utils.h"
+
+
+#define UDP_MAX_PAYLOAD (65535 - IP_HEADER_SIZE - UDP_HEADER_SIZE)
+
+
+static struct udp_socket *udp_hash[UDP_HASH_SIZE];
+static pthread_rwlock_t udp_hash_lock = PTHREAD_RWLOCK_INITIALIZER;  // sockets come and go rarely, workers only read
+static uint16_t udp_next_ephemeral = UDP_EPHEMERAL_MIN;
+
+// Updated by every queue worker
+static atomic_uint_fast64_t udp_received;
+static atomic_uint_fast64_t udp_sent;
+static atomic_uint_fast64_t udp_no_socket;
+static atomic_uint_fast64_t udp_ring_full;
+static atomic_uint_fast64_t udp_invalid;
+
+
+static inline uint32_t udp_bucket(uint16_t port) {
+	return ((uint32_t)port * 0x9e3779b1) >> 24;  // golden ratio, the top byte depends on both bytes of the port
+}
+
+// Caller holds udp_hash_lock
+static struct udp_socket *udp_socket_find_locked(uint32_t local_ip, uint16_t port) {
+	for(struct udp_socket *udp_socket = udp_hash[udp_bucket(port)]; udp_socket != NULL;
+		udp_socket = udp_socket->hash_next) {
+		if(udp_socket->sock.source_port == port && udp_socket->sock.source.ipv4 == local_ip)
+			return udp_socket;
+	}
+
+	return NULL;
+}
+
+// Checks the datagram and queues it to the socket bound to its port. The socket holds on to the RX buffer instead
+// of copying the payload out, the reader gets pointers into it.
+void udp_in(struct sk_buff *buffer) {
+	struct ipv4_packet *ip_packet = ipv4_packet_from_skb(buffer);
+	struct udp_datagram *udp_datagram = udp_datagram_from_skb(buffer);
+
+	// Short frames are padded, the UDP length is what counts
+	uint32_t payload_len = ip_packet->len - ip_packet->header_len * 4u;
+	uint16_t len = skb_headlen(buffer) >= UDP_HEADER_SIZE ? ntohs(udp_datagram->len) : 0;
+	if(len < UDP_HEADER_SIZE || len > payload_len || len > skb_headlen(buffer)) {
+		atomic_fetch_add_explicit(&udp_invalid, 1, memory_order_relaxed);
+		return;
+	}
+
+	// A zero checksum means the sender didn't compute one
+	if(udp_datagram->checksum != 0 && buffer->ip_summed != CHECKSUM_UNNECESSARY) {
+		uint32_t sum = pseudo_header_sum(IPPROTO_UDP, len, ip_packet->source_ip, ip_packet->dest_ip);
+		if(checksum_fold(checksum_partial(udp_datagram, len, sum)) != 0) {
+			atomic_fetch_add_explicit(&udp_invalid, 1, memory_order_relaxed);
+			return;
+		}
+	}
+
+	pthread_rwlock_rdlock(&udp_hash_lock);
+	struct udp_socket *udp_socket = udp_socket_find_locked(ip_packet->dest_ip, ntohs(udp_datagram->dest_port));
+	if(udp_socket == NULL) {
+		pthread_rwlock_unlock(&udp_hash_lock);
+		atomic_fetch_add_explicit(&udp_no_socket, 1, memory_order_relaxed);
+		return;
+	}
+
+	skb_pull(buffer, UDP_HEADER_SIZE);
+	buffer->payload_size = len - UDP_HEADER_SIZE;
+
+	pthread_mutex_lock(&udp_socket->lock);
+	if(udp_socket->tail - udp_socket->head == UDP_RX_RING_SIZE) {
+		pthread_mutex_unlock(&udp_socket->lock);
+		pthread_rwlock_unlock(&udp_hash_lock);
+		atomic_fetch_add_explicit(&udp_ring_full, 1, memory_order_relaxed);
+		return;
+	}
+
+	udp_socket->ring[udp_socket->tail++ % UDP_RX_RING_SIZE] = skb_keep(buffer);
+	pthread_mutex_unlock(&udp_socket->lock);
+	pthread_rwlock_unlock(&udp_hash_lock);
+
+	atomic_fetch_add_explicit(&udp_received, 1, memory_order_relaxed);
+}
+
+// Binds to the port, or to a free ephemeral one with port 0. Returns NULL if the port is taken.
+struct udp_socket *udp_socket_new(struct net_dev *dev, uint32_t source_ip, uint16_t port) {
+	if(source_ip == 0)
+		source_ip = dev->ipv4;
+
+	pthread_rwlock_wrlock(&udp_hash_lock);
+
+	for(uint32_t tries = 0; port == 0 && tries <= 65535 - UDP_EPHEMERAL_MIN; tries++) {
+		uint16_t candidate = udp_next_ephemeral;
+		udp_next_ephemeral = udp_next_ephemeral == 65535 ? UDP_EPHEMERAL_MIN : (uint16_t)(udp_next_ephemeral + 1);
+
+		if(udp_socket_find_locked(source_ip, candidate) == NULL)
+			port = candidate;
+	}
+
+	if(port == 0 || udp_socket_find_locked(source_ip, port) != NULL) {
+		pthread_rwlock_unlock(&udp_hash_lock);
+		return NULL;
+	}
+
+	struct udp_socket *udp_socket = calloc(1, sizeof(struct udp_socket));
+	if(udp_socket == NULL) {
+		perror("could not allocate memory for UDP socket");
+		exit(1);
+	}
+
+	pthread_mutex_init(&udp_socket->lock, NULL);
+	udp_socket->sock.family = AF_INET;
+	udp_socket->sock.protocol = IPPROTO_UDP;
+	udp_socket->sock.dev = dev;
+	udp_socket->sock.source = sock_addr_ipv4(source_ip);
+	udp_socket->sock.source_port = port;
+	udp_socket->sock.queue = net_dev_flow_queue(dev, source_ip, 0, port, 0)->index;
+
+	udp_socket->hash_next = udp_hash[udp_bucket(port)];
+	udp_hash[udp_bucket(port)] = udp_socket;
+
+	pthread_rwlock_unlock(&udp_hash_lock);
+	return udp_socket;
+}
+
+// Unbinds the socket and drops whatever wasn't read. Messages still held from udp_recv_batch() stay valid.
+void udp_socket_close(struct udp_socket *udp_socket) {
+	pthread_rwlock_wrlock(&udp_hash_lock);
+	struct udp_socket **link = &udp_hash[udp_bucket(udp_socket->sock.source_port)];
+	while(*link != udp_socket)
+		link = &(*link)->hash_next;
+	*link = udp_socket->hash_next;
+	pthread_rwlock_unlock(&udp_hash_lock);
+
+	for(uint32_t i = udp_socket->head; i != udp_socket->tail; i++)
+		skb_free(udp_socket->ring[i % UDP_RX_RING_SIZE]);
+
+	pthread_mutex_destroy(&udp_socket->lock);
+	free(udp_socket);
+}
+
+// Sends the datagrams back to back and flushes the device queue once for the batch, where sendmmsg() makes one
+// system call for it. Each payload is summed while it is copied in. Consecutive datagrams to the same peer share
+// the dst cache, so the socket should only be sent through by one thread at a time. Returns the number of
+// datagrams handed to IPv4, stopping at the first one that is too large.
+uint32_t udp_send_batch(struct udp_socket *udp_socket, struct udp_msg *msgs, uint32_t count) {
+	struct sock *sock = &udp_socket->sock;
+	uint32_t sent = 0;
+
+	for(; sent < count; sent++) {
+		struct udp_msg *msg = &msgs[sent];
+		if(msg->len > UDP_MAX_PAYLOAD)
+			break;
+
+		if(msg->remote_ip != sock->dest.ipv4) {
+			sock->dest = sock_addr_ipv4(msg->remote_ip);
+			sock->dst.neigh = NULL;  // the cache was filled in for the previous peer
+		}
+		sock->dest_port = msg->remote_port;
+
+		uint16_t len = (uint16_t)(UDP_HEADER_SIZE + msg->len);
+		struct sk_buff *buffer = skb_alloc(SKB_MAX_HEADER + len);
+		skb_reserve(buffer, SKB_MAX_HEADER);
+
+		struct udp_datagram *udp_datagram = (struct udp_datagram *)skb_put(buffer, len);
+		skb_reset_transport_header(buffer);
+
+		udp_datagram->source_port = htons(sock->source_port);
+		udp_datagram->dest_port = htons(msg->remote_port);
+		udp_datagram->len = htons(len);
+		udp_datagram->checksum = 0;
+
+		uint32_t sum = pseudo_header_sum(IPPROTO_UDP, len, sock->source.ipv4, sock->dest.ipv4);
+		sum = checksum_copy_partial(udp_datagram->data, msg->data, msg->len, sum);
+		udp_datagram->checksum = checksum_fold(checksum_partial(udp_datagram, UDP_HEADER_SIZE, sum));
+		if(udp_datagram->checksum == 0)
+			udp_datagram->checksum = 0xffff;  // 0 would mean no checksum
+
+		ipv4_send_packet(sock, buffer);
+	}
+
+	if(sent > 0) {
+		struct net_dev *dev = sock->dst.neigh != NULL ? sock->dst.dev : sock->dev;
+		eth_flush(dev, (uint16_t)(sock->queue % dev->queue_count));
+		atomic_fetch_add_explicit(&udp_sent, sent, memory_order_relaxed);
+	}
+
+	return sent;
+}
+
+// Takes up to count datagrams off the ring without copying or waiting, like a non-blocking recvmmsg(). The
+// messages point into the RX buffers until they are handed to udp_recv_done().
+uint32_t udp_recv_batch(struct udp_socket *udp_socket, struct udp_msg *msgs, uint32_t count) {
+	pthread_mutex_lock(&udp_socket->lock);
+	uint32_t received = min(count, udp_socket->tail - udp_socket->head);
+	for(uint32_t i = 0; i < received; i++)
+		msgs[i].buffer = udp_socket->ring[udp_socket->head++ % UDP_RX_RING_SIZE];
+	pthread_mutex_unlock(&udp_socket->lock);
+
+	for(uint32_t i = 0; i < received; i++) {
+		struct sk_buff *buffer = msgs[i].buffer;
+
+		msgs[i].remote_ip = ipv4_packet_from_skb(buffer)->source_ip;
+		msgs[i].remote_port = ntohs(udp_datagram_from_skb(buffer)->source_port);
+		msgs[i].data = buffer->data;
+		msgs[i].len = buffer->payload_size;
+	}
+
+	return received;
+}
+
+void udp_recv_done(struct udp_msg *msgs, uint32_t count) {
+	for(uint32_t i = 0; i < count; i++) {
+		skb_free(msgs[i].buffer);
+		msgs[i].buffer = NULL;
+	}
+}
+
+void udp_print_stats() {
+	printf("UDP: received %" PRIuFAST64 " | sent %" PRIuFAST64 " | no socket %" PRIuFAST64 " | ring full %"
+		   PRIuFAST64 " | invalid %" PRIuFAST64 "\n", atomic_load(&udp_received), atomic_load(&udp_sent),
+		   atomic_load(&udp_no_socket), atomic_load(&udp_ring_full), atomic_load(&udp_invalid));
+}
@@ -1,45 +1,85 @@
+#include <string.h>
 #include "ipv4.h"
 #include "netinet/in.h"
 #include "utils.h"
 
+uint16_t checksum_fold(uint32_t sum)
+{
+	sum  = (sum >> 16) + (sum & 0xffff);
+	sum += (sum >> 16);
+	return (uint16_t)~sum;
+}
+
 uint16_t checksum(register uint16_t *ptr, register uint32_t len, register uint32_t sum)
 {
-	// Credit: 	http://www.csee.usf.edu/~kchriste/tools/checksum.c
-	//			https://github.com/chobits/tapip
-	uint16_t			odd_byte;
-
-	/*
-	 * Our algorithm is simple, using a 32-bit accumulator (sum),
-	 * we add sequential 16-bit words to it, and at the end, fold back
-	 * all the carry bits from the top 16 bits into the lower 16 bits.
-	 */
-	while (len > 1)  {
-		sum += *ptr++;
-		len -= 2;
+	return checksum_fold(checksum_partial(ptr, len, sum));
+}
+
+// Partial sum of everything from start to the end of the sk_buff, fragments included
+uint32_t checksum_skb(struct sk_buff *skb, uint8_t *start, uint32_t sum) {
+	uint32_t len = (uint32_t)(skb->tail - start);
+	sum = checksum_partial(start, len, sum);
+
+	// The payload was summed when it was copied in
+	if(skb->ip_summed == CHECKSUM_COMPLETE) {
+		uint32_t frag_sum = skb->csum;
+		if(len & 1)
+			frag_sum = ((frag_sum & 0xff) << 8) | (frag_sum >> 8);
+		return sum + frag_sum;
+	}
+
+	for(int i = 0; i < skb->nr_frags; i++) {
+		uint32_t frag_sum = checksum_partial(skb_frag_address(&skb->frags[i]), skb->frags[i].len, 0);
+
+		// A fragment starting at an odd offset has its bytes in swapped positions
+		if(len & 1)
+			frag_sum = ((frag_sum & 0xff) << 8) | (frag_sum >> 8);
+
+		sum += frag_sum;
+		len += skb->frags[i].len;
 	}
 
-	/* mop up an odd byte, if necessary */
-	if (len == 1) {
-		odd_byte = 0;		/* make sure top half is zero */
-		*((uint8_t *) &odd_byte) = *(uint8_t *)ptr;   /* one byte only */
-		sum += odd_byte;
+	return sum;
+}
+
+// Checksum after len bytes (even) covered by check changed from old_data to new_data, RFC 1624 eqn. 3:
+// HC' = ~(~HC + ~m + m'). Costs as much as the changed bytes, not the whole packet.
+uint16_t checksum_adjust(uint16_t check, const void *old_data, const void *new_data, uint32_t len) {
+	uint32_t sum = (uint16_t)~check;
+
+	for(uint32_t i = 0; i < len; i += 2) {
+		uint16_t old_word, new_word;
+		memcpy(&old_word, (const uint8_t *)old_data + i, sizeof(old_word));
+		memcpy(&new_word, (const uint8_t *)new_data + i, sizeof(new_word));
+		sum += (uint16_t)~old_word + new_word;
 	}
 
-	/*
-	 * Add back carry outs from top 16 bits to low 16 bits.
-	 */
+	return checksum_fold(sum);
+}
+
+// Sum of the IPv4 pseudo header TCP and UDP checksums cover, addresses in network order
+uint32_t pseudo_header_sum(uint8_t protocol, uint16_t len, uint32_t source_ip, uint32_t dest_ip) {
+	return htons(protocol)
+		   + htons(len)
+		   + (source_ip >> 16) + (source_ip & 0xffff)
+		   + (dest_ip >> 16) + (dest_ip & 0xffff);
+}
+
+// Sum of the IPv6 pseudo header, the upper layer length takes 32 bits there
+uint32_t ipv6_pseudo_header_sum(uint8_t protocol, uint32_t len, const uint8_t *source_ip, const uint8_t *dest_ip) {
+	uint32_t sum = checksum_partial(source_ip, 16, 0);
+	sum = checksum_partial(dest_ip, 16, sum);
 
-	sum  = (sum >> 16) + (sum & 0xffff);	/* add high-16 to low-16 */
-	sum += (sum >> 16);			/* add carry */
-	return (uint16_t)~sum;;
+	return sum + htons((uint16_t)(len >> 16)) + htons((uint16_t)len) + htons(protocol);
+}
+
+uint32_t tcp_pseudo_header_sum(uint16_t tcp_segment_len, uint32_t source_ip, uint32_t dest_ip) {
+	return pseudo_header_sum(IPPROTO_TCP, tcp_segment_len, source_ip, dest_ip);
 }
 
 uint16_t tcp_checksum(void *tcp_segment, uint16_t tcp_segment_len, uint32_t source_ip, uint32_t dest_ip) {
 	// We need to include the pseudo-header in the checksum.
-	uint32_t sum = htons(IPPROTO_TCP)
-				   + htons(tcp_segment_len)
-				   + source_ip
-				   + dest_ip;
+	uint32_t sum = tcp_pseudo_header_sum(tcp_segment_len, source_ip, dest_ip);
 
 	return checksum((uint16_t *)tcp_segment, (uint32_t) (tcp_segment_len), sum);
-}
\ No newline at end of file
+}
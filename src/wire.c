@@ -0,0 +1,189 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wire.h"
+
+
+static LIST_HEAD(wire_list);
+static pthread_mutex_t wire_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint8_t wire_count;
+
+
+static int wire_end(struct wire *wire, struct net_dev *dev) {
+	return wire->ends[0] == dev ? 0 : 1;
+}
+
+static struct wire *wire_find(const char *name) {
+	struct list_head *list_item;
+
+	list_for_each(list_item, &wire_list) {
+		struct wire *wire = list_entry(list_item, struct wire, list);
+		if(strcmp(wire->name, name) == 0 && wire->ends[1] == NULL)
+			return wire;
+	}
+
+	return NULL;
+}
+
+static struct wire *wire_new(struct net_dev *dev) {
+	struct wire *wire = malloc(sizeof(struct wire));
+	if(wire == NULL) {
+		perror("could not allocate memory for wire");
+		exit(1);
+	}
+	memset(wire, 0, sizeof(struct wire));
+
+	strcpy(wire->name, dev->name);
+	wire->index = wire_count++;
+	wire->queue_count = dev->queue_count;
+
+	for(int end = 0; end < 2; end++) {
+		for(uint16_t i = 0; i < dev->queue_count; i++)
+			pthread_mutex_init(&wire->rings[end][i].lock, NULL);
+	}
+
+	list_add(&wire->list, &wire_list);
+	return wire;
+}
+
+static void wire_free(struct wire *wire) {
+	for(int end = 0; end < 2; end++) {
+		for(uint16_t i = 0; i < wire->queue_count; i++) {
+			struct wire_ring *ring = &wire->rings[end][i];
+
+			for(uint32_t j = ring->head; j != ring->tail; j++)
+				skb_free(ring->slots[j % WIRE_RING_SIZE]);
+			pthread_mutex_destroy(&ring->lock);
+		}
+	}
+
+	list_del(&wire->list);
+	free(wire);
+}
+
+
+// The first device opened under a name waits for the second one, which plugs into the other end
+static int wire_open(struct net_dev *dev, uint32_t features, const void *arg) {
+	pthread_mutex_lock(&wire_mutex);
+
+	struct wire *wire = wire_find(dev->name);
+	if(wire == NULL)
+		wire = wire_new(dev);
+	else if(wire->queue_count != dev->queue_count) {
+		pthread_mutex_unlock(&wire_mutex);
+		fprintf(stderr, "both ends of wire %s need %u queue(s)\n", dev->name, wire->queue_count);
+		return -1;
+	}
+
+	int end = wire->ends[0] == NULL ? 0 : 1;
+	wire->ends[end] = dev;
+	dev->priv = wire;
+	for(uint16_t i = 0; i < dev->queue_count; i++)
+		dev->queues[i].priv = &wire->rings[end][i];
+
+	pthread_mutex_unlock(&wire_mutex);
+
+	// Locally administered address, unique per wire end
+	uint8_t hwaddr[6] = { 0x02, 0x00, 0x00, 0x00, wire->index, (uint8_t)end };
+	memcpy(dev->hwaddr, hwaddr, sizeof(hwaddr));
+
+	// Frames never leave the process, there's no point in checksumming them
+	dev->features = NETIF_F_HW_CSUM;
+
+	return 0;
+}
+
+static void wire_close(struct net_dev *dev) {
+	struct wire *wire = dev->priv;
+
+	pthread_mutex_lock(&wire_mutex);
+	wire->ends[wire_end(wire, dev)] = NULL;
+	if(wire->ends[0] == NULL && wire->ends[1] == NULL)
+		wire_free(wire);
+	pthread_mutex_unlock(&wire_mutex);
+}
+
+
+static uint32_t wire_rx_batch(struct net_dev *dev, uint16_t queue, struct eth_rx_ring *ring_unused,
+							  struct sk_buff **buffers, uint32_t max) {
+	struct wire_ring *ring = dev->queues[queue].priv;
+
+	uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	uint32_t count = tail - head < max ? tail - head : max;
+
+	for(uint32_t i = 0; i < count; i++) {
+		struct sk_buff *buffer = ring->slots[(head + i) % WIRE_RING_SIZE];
+
+		buffer->dev = dev;
+		buffer->queue_mapping = queue;
+		buffer->ip_summed = buffer->ip_summed == CHECKSUM_PARTIAL ? CHECKSUM_UNNECESSARY : CHECKSUM_NONE;
+		buffer->gso_size = 0;
+		buffer->payload_size = 0;
+
+		buffers[i] = buffer;
+	}
+
+	atomic_store_explicit(&ring->head, head + count, memory_order_release);
+	return count;
+}
+
+// The buffer changes hands, unless the sender still holds a reference or it has fragments the receive path can't
+// deal with. Those are copied.
+static struct sk_buff *wire_detach(struct sk_buff *buffer) {
+	if(!skb_shared(buffer) && buffer->nr_frags == 0)
+		return buffer;
+
+	struct sk_buff *copy = skb_copy(buffer);
+	skb_free(buffer);
+	return copy;
+}
+
+static uint32_t wire_tx_batch(struct net_dev *dev, uint16_t queue, struct sk_buff **buffers, uint32_t count) {
+	struct wire *wire = dev->priv;
+	int peer = 1 - wire_end(wire, dev);
+	struct wire_ring *ring = &wire->rings[peer][queue];
+	uint32_t sent = 0;
+
+	pthread_mutex_lock(&ring->lock);
+
+	uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+	for(uint32_t i = 0; i < count; i++) {
+		if(wire->ends[peer] == NULL || tail - head == WIRE_RING_SIZE) {
+			atomic_fetch_add_explicit(&ring->drops, 1, memory_order_relaxed);
+			skb_free(buffers[i]);
+			continue;
+		}
+
+		ring->slots[tail++ % WIRE_RING_SIZE] = wire_detach(buffers[i]);
+		sent++;
+	}
+
+	atomic_store_explicit(&ring->tail, tail, memory_order_release);
+	pthread_mutex_unlock(&ring->lock);
+
+	return sent;
+}
+
+// Frames lost on their way to the device
+uint64_t wire_drops(struct net_dev *dev) {
+	struct wire *wire = dev->priv;
+	uint64_t drops = 0;
+
+	for(uint16_t i = 0; i < dev->queue_count; i++)
+		drops += atomic_load_explicit(&wire->rings[wire_end(wire, dev)][i].drops, memory_order_relaxed);
+
+	return drops;
+}
+
+
+const struct net_dev_ops wire_ops = {
+	.name = "wire",
+	.open = wire_open,
+	.close = wire_close,
+	.rx_batch = wire_rx_batch,
+	.tx_batch = wire_tx_batch,
+};